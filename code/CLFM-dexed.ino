@@ -36,12 +36,14 @@ Bounce *resetsw = new Bounce();
 
 #include "src/synth_dexed.h"
 #include "Utility.h"
+#include "CVInput.h"
 
 bool idle = true;
 bool quantise = true;
 bool aftertouch = false;
 
-#define PITCH_BEND_FACTOR 7
+// Pitch bend range in Q24 log frequency: a semitone either way
+#define PITCH_BEND_RANGE ((1 << 24) / 12)
 
 bool resetpressed = false;
 
@@ -120,6 +122,7 @@ const int envModeSw[] = { ENV_MODE_CTS, ENV_MODE_ADSR, ENV_MODE_ASR };
 
 volatile bool gate = LOW;
 volatile bool gatetoggled = false;
+volatile uint32_t gatetime = 0; // sample clock time of the last gate edge
 volatile float note = -1;
  
 #define RESET 31
@@ -150,7 +153,9 @@ typedef struct controlsStruct
   byte modvalue;
 } controlsStruct;
 
-configStruct config;
+// The controls edit uiConfig; sendConfig() passes its changes on to the
+// engine
+configStruct uiConfig;
 controlsStruct controls;
 
 bool showConfigOnChange = false;
@@ -158,21 +163,66 @@ bool showConfigOnChange = false;
 const char *wavestr[] = {"sin", "tri", "sqr", "sinfld", "trifld"};
 void printConfig()
 {
-  Serial.printf("Algorithm: %3d\n", config.algorithm + 1);
-  Serial.printf("Coarse: %6s %6s %6s %6s\n", coarseFactors[config.coarse[3]], coarseFactors[config.coarse[2]], coarseFactors[config.coarse[1]], coarseFactors[config.coarse[0]]);  
-  Serial.printf("Fine:   %6d %6d %6d %6d\n", config.fine[3], config.fine[2], config.fine[1], config.fine[0]);
+  Serial.printf("Algorithm: %3d\n", uiConfig.algorithm + 1);
+  Serial.printf("Coarse: %6s %6s %6s %6s\n", coarseFactors[uiConfig.coarse[3]], coarseFactors[uiConfig.coarse[2]], coarseFactors[uiConfig.coarse[1]], coarseFactors[uiConfig.coarse[0]]);  
+  Serial.printf("Fine:   %6d %6d %6d %6d\n", uiConfig.fine[3], uiConfig.fine[2], uiConfig.fine[1], uiConfig.fine[0]);
   Serial.printf("Wave:   %6s %6s %6s %6s\n", 
-    wavestr[config.wave[3]], wavestr[config.wave[2]], wavestr[config.wave[1]], wavestr[config.wave[0]]);
+    wavestr[uiConfig.wave[3]], wavestr[uiConfig.wave[2]], wavestr[uiConfig.wave[1]], wavestr[uiConfig.wave[0]]);
   for (int k = 3; k >= 0; --k)
   {
-    if (config.env[k].drone)
+    if (uiConfig.env[k].drone)
       Serial.printf("Op %d drone\n", 4 - k);
     else
-      Serial.printf("Op %d ADSR env: %3d %3d %3d %3d\n", 4 - k, config.env[k].a, config.env[k].d, config.env[k].s, config.env[k].r);
+      Serial.printf("Op %d ADSR env: %3d %3d %3d %3d\n", 4 - k, uiConfig.env[k].a, uiConfig.env[k].d, uiConfig.env[k].s, uiConfig.env[k].r);
   }
-  Serial.printf("Levels: %6d %6d %6d %6d\n", config.level[3], config.level[2], config.level[1], config.level[0]);
-  Serial.printf("Feedback: %4d on operator %d\n", config.feedback, feedback2 ? 2 : 4);
-  Serial.printf("Oscillator sync is %s\n", config.sync ? "on" : "off");
+  Serial.printf("Levels: %6d %6d %6d %6d\n", uiConfig.level[3], uiConfig.level[2], uiConfig.level[1], uiConfig.level[0]);
+  Serial.printf("Feedback: %4d on operator %d\n", uiConfig.feedback, feedback2 ? 2 : 4);
+  Serial.printf("Oscillator sync is %s\n", uiConfig.sync ? "on" : "off");
+}
+
+// Publishes the changes to uiConfig: all of it as a new snapshot on a full
+// update, otherwise each field that has changed on the parameter queue. A
+// change the engine cannot take yet goes on a later loop.
+void sendConfig()
+{
+  static configStruct sent;
+  if (updateall)
+  {
+    if (fm.setConfig(uiConfig))
+      sent = uiConfig;
+    return;
+  }
+  for (int i = 0; i < 4; ++i)
+  {
+    if (uiConfig.coarse[i] != sent.coarse[i] && fm.setParam(PARAM_COARSE, i, uiConfig.coarse[i]))
+      sent.coarse[i] = uiConfig.coarse[i];
+    if (uiConfig.fine[i] != sent.fine[i] && fm.setParam(PARAM_FINE, i, uiConfig.fine[i]))
+      sent.fine[i] = uiConfig.fine[i];
+    if (uiConfig.wave[i] != sent.wave[i] && fm.setParam(PARAM_WAVE, i, uiConfig.wave[i]))
+      sent.wave[i] = uiConfig.wave[i];
+    if (uiConfig.level[i] != sent.level[i] && fm.setParam(PARAM_LEVEL, i, uiConfig.level[i]))
+      sent.level[i] = uiConfig.level[i];
+    if (uiConfig.scale[i] != sent.scale[i] && fm.setParam(PARAM_SCALE, i, uiConfig.scale[i]))
+      sent.scale[i] = uiConfig.scale[i];
+    if (uiConfig.env[i].a != sent.env[i].a && fm.setParam(PARAM_ENV_A, i, uiConfig.env[i].a))
+      sent.env[i].a = uiConfig.env[i].a;
+    if (uiConfig.env[i].d != sent.env[i].d && fm.setParam(PARAM_ENV_D, i, uiConfig.env[i].d))
+      sent.env[i].d = uiConfig.env[i].d;
+    if (uiConfig.env[i].s != sent.env[i].s && fm.setParam(PARAM_ENV_S, i, uiConfig.env[i].s))
+      sent.env[i].s = uiConfig.env[i].s;
+    if (uiConfig.env[i].r != sent.env[i].r && fm.setParam(PARAM_ENV_R, i, uiConfig.env[i].r))
+      sent.env[i].r = uiConfig.env[i].r;
+    if (uiConfig.env[i].drone != sent.env[i].drone && fm.setParam(PARAM_DRONE, i, uiConfig.env[i].drone))
+      sent.env[i].drone = uiConfig.env[i].drone;
+  }
+  if (uiConfig.detune != sent.detune && fm.setParam(PARAM_DETUNE, 0, uiConfig.detune))
+    sent.detune = uiConfig.detune;
+  if (uiConfig.fold != sent.fold && fm.setParam(PARAM_FOLD, 0, uiConfig.fold))
+    sent.fold = uiConfig.fold;
+  if (uiConfig.feedback != sent.feedback && fm.setParam(PARAM_FEEDBACK, 0, uiConfig.feedback))
+    sent.feedback = uiConfig.feedback;
+  if (uiConfig.sync != sent.sync && fm.setParam(PARAM_SYNC, 0, uiConfig.sync))
+    sent.sync = uiConfig.sync;
 }
 
 bool potchange(potval *v, unsigned long now, bool centre, bool jittery)
@@ -202,7 +252,8 @@ bool potchange(potval *v, unsigned long now, bool centre, bool jittery)
 #define SCALE (1.0f * ANALOG_MID / (ANALOG_MID - MID_RANGE))
 void updatePot(potval *thepot, int pin, unsigned long t, int shift, bool invert, bool centre, int average)
 {
-  int v = adc->analogRead(pin);
+  // keep off ADC_1 where possible, it is converting the pitch CV
+  int v = adc->adc0->checkPin(pin) ? adc->adc0->analogRead(pin) : adc->analogRead(pin);
   if (invert)
     v = ANALOG_MAX - v;
   if (centre)
@@ -290,10 +341,10 @@ int getAlgorithm()
     }
   }
 
-  if (a == 0 && config.algorithm > 1)  // this is just break before make
+  if (a == 0 && uiConfig.algorithm > 1)  // this is just break before make
   {
-//    Serial.printf("%d %d\n", a, config.algorithm);
-    a = config.algorithm;
+//    Serial.printf("%d %d\n", a, uiConfig.algorithm);
+    a = uiConfig.algorithm;
   }
   
   return a;
@@ -311,27 +362,25 @@ void resetAllDrone()
 {
   for (int i = 0; i < 4; ++i)
   {
-    if (config.env[i].drone)
+    if (uiConfig.env[i].drone)
     {
       setDrone(i, false);
-      config.env[i].drone = false;
+      uiConfig.env[i].drone = false;
     }
   }
 }
 
 void setDrone(int i, bool set)
 {
-  if (set && !config.env[i].drone)
+  if (set && !uiConfig.env[i].drone)
   {
-    config.env[i].drone = true;
+    uiConfig.env[i].drone = true;
     Serial.printf("Switching on drone %i\n", i);
-    fm.setOPDrone(i, true);
   } 
-  else if (config.env[i].drone)
+  else if (uiConfig.env[i].drone)
   {
     Serial.printf("Switching off drone %i\n", i);
-    config.env[i].drone = false;
-    fm.setOPDrone(i, false);
+    uiConfig.env[i].drone = false;
   }
 }
 
@@ -353,26 +402,26 @@ void handleContinuousEnvelopes(int i, int v)
 
   if (v > 123)  // drone
   {
-    config.env[i].a = 0;
-    config.env[i].d = 0;
-    config.env[i].s = rescaleSustain(127);
-    config.env[i].r = 0;
-    if (!config.env[i].drone)
+    uiConfig.env[i].a = 0;
+    uiConfig.env[i].d = 0;
+    uiConfig.env[i].s = rescaleSustain(127);
+    uiConfig.env[i].r = 0;
+    if (!uiConfig.env[i].drone)
       setDrone(i, true);
   }
   else
   {
-    if (config.env[i].drone)
+    if (uiConfig.env[i].drone)
       setDrone(i, false);
     const int scale = 21;    
     v = max(0, min(6 * scale, v));
     int k = floor(v / scale);
     int l = v % scale;
     int m = scale - l;
-    config.env[i].a = (m * as[k] + l * as[k + 1]) / scale;
-    config.env[i].d = (m * ds[k] + l * ds[k + 1]) / scale;
-    config.env[i].s = rescaleSustain((m * ss[k] + l * ss[k + 1]) / scale);
-    config.env[i].r = (m * rs[k] + l * rs[k + 1]) / scale;
+    uiConfig.env[i].a = (m * as[k] + l * as[k + 1]) / scale;
+    uiConfig.env[i].d = (m * ds[k] + l * ds[k + 1]) / scale;
+    uiConfig.env[i].s = rescaleSustain((m * ss[k] + l * ss[k + 1]) / scale);
+    uiConfig.env[i].r = (m * rs[k] + l * rs[k + 1]) / scale;
   }
 }
 
@@ -386,7 +435,7 @@ void handleAD_ASREnvelopes(int i, int v, envCtrlMode mode, int algo)
       {
         if (getOpType(j, algo) == CARRIER)
         {
-          config.env[j].a = v;
+          uiConfig.env[j].a = v;
         }
       }
       break;
@@ -395,8 +444,8 @@ void handleAD_ASREnvelopes(int i, int v, envCtrlMode mode, int algo)
       {
         if (getOpType(j, algo) == CARRIER)
         {
-          config.env[j].d = v;
-          config.env[j].r = mode == AD ? 0 : v;
+          uiConfig.env[j].d = v;
+          uiConfig.env[j].r = mode == AD ? 0 : v;
         }
       }
       break;
@@ -405,7 +454,7 @@ void handleAD_ASREnvelopes(int i, int v, envCtrlMode mode, int algo)
       {
         if (getOpType(j, algo) == MODULATOR)
         {
-          config.env[j].a = v;
+          uiConfig.env[j].a = v;
         }
       }
       break;
@@ -414,8 +463,8 @@ void handleAD_ASREnvelopes(int i, int v, envCtrlMode mode, int algo)
       {
         if (getOpType(j, algo) == MODULATOR)
         {
-          config.env[j].d = v;
-          config.env[j].r = mode == AD ? 0 : v;
+          uiConfig.env[j].d = v;
+          uiConfig.env[j].r = mode == AD ? 0 : v;
         }
       }
       break; 
@@ -429,16 +478,16 @@ void handleADSREnvelopes(int i, int v)
     switch (i)
     {
       case 3:
-        config.env[j].a = v;
+        uiConfig.env[j].a = v;
         break;
       case 2:
-        config.env[j].d = v;
+        uiConfig.env[j].d = v;
         break;
       case 1:
-        config.env[j].s = rescaleSustain(v);
+        uiConfig.env[j].s = rescaleSustain(v);
         break;
       case 0:
-        config.env[j].r = v;
+        uiConfig.env[j].r = v;
         break;
     }
   }
@@ -446,10 +495,10 @@ void handleADSREnvelopes(int i, int v)
 
 bool handleEnvelopes(int i, int v, envCtrlMode mode, int algo)
 {
-  int a = config.env[i].a;
-  int d = config.env[i].d;
-  int s = config.env[i].s;
-  int r = config.env[i].r;
+  int a = uiConfig.env[i].a;
+  int d = uiConfig.env[i].d;
+  int s = uiConfig.env[i].s;
+  int r = uiConfig.env[i].r;
   switch (mode)
   {
     case AD:
@@ -470,16 +519,16 @@ bool handleEnvelopes(int i, int v, envCtrlMode mode, int algo)
       handleContinuousEnvelopes(i, v);
       break;
   }
-  return (a != config.env[i].a) || (d != config.env[i].d) || (s != config.env[i].s) || (r != config.env[i].r);
+  return (a != uiConfig.env[i].a) || (d != uiConfig.env[i].d) || (s != uiConfig.env[i].s) || (r != uiConfig.env[i].r);
 }
 
 bool handleCoarseTuning(int i, int v)
 {
   v = map(v, 0, 127, 0, 30);
   coarseAdj newcoarse = (coarseAdj)v;
-  if (config.coarse[i] != newcoarse)
+  if (uiConfig.coarse[i] != newcoarse)
   {
-    config.coarse[i] = newcoarse;
+    uiConfig.coarse[i] = newcoarse;
     return true;
   }
   return false;
@@ -487,11 +536,11 @@ bool handleCoarseTuning(int i, int v)
 
 bool handleFineTuning(int i, int v)
 {
-  int limit = config.fold ? MAXFOLDPARAM : 50;
-  v = map(v, 0, config.fold ? 1023 : 127, -limit, limit);
-  if (config.fine[i] != v)
+  int limit = uiConfig.fold ? MAXFOLDPARAM : 50;
+  v = map(v, 0, uiConfig.fold ? 1023 : 127, -limit, limit);
+  if (uiConfig.fine[i] != v)
   {
-    config.fine[i] = v;
+    uiConfig.fine[i] = v;
     return true;
   }
   return false;
@@ -504,8 +553,6 @@ void updateAllEnv(envCtrlMode mode, int algo)
   {
     handleEnvelopes(i, controls.envpot[i].value, mode, algo);
   }
-  
-  fm.doRefreshEnv();
 }
 
 bool checkEnvMode()
@@ -519,16 +566,16 @@ bool checkEnvMode()
     {
       for (i = 0; i < 4; ++i)
       {
-        config.env[i].s = 0;
-        config.env[i].r = 0;
+        uiConfig.env[i].s = 0;
+        uiConfig.env[i].r = 0;
       }
     }
     else if (controls.envMode == ASR)
     {
       for (i = 0; i < 4; ++i)
       {
-        config.env[i].s = rescaleSustain(127);
-        config.env[i].r = config.env[i].d;  
+        uiConfig.env[i].s = rescaleSustain(127);
+        uiConfig.env[i].r = uiConfig.env[i].d;  
       }
     }
     if (controls.envMode != CTS)
@@ -541,28 +588,28 @@ bool checkEnvMode()
 void updateWavetypes()
 {
   // set default and change where necessary
-  config.fold = false;
-  config.wave[0] = config.wave[1] = config.wave[2] = config.wave[3] = SIN;
+  uiConfig.fold = false;
+  uiConfig.wave[0] = uiConfig.wave[1] = uiConfig.wave[2] = uiConfig.wave[3] = SIN;
   if (feedback2) 
   {
-    switch (config.algorithm)
+    switch (uiConfig.algorithm)
     {
       case 3:
-        config.wave[0] = TRI;
-        config.wave[1] = SQR;
+        uiConfig.wave[0] = TRI;
+        uiConfig.wave[1] = SQR;
         break;
       case 4:
-        config.wave[0] = config.wave[1] = config.wave[3] = SQR;
-        config.wave[2] = TRI;
+        uiConfig.wave[0] = uiConfig.wave[1] = uiConfig.wave[3] = SQR;
+        uiConfig.wave[2] = TRI;
         break;
       case 6:
-        config.wave[1] = SQR;
-        config.wave[3] = TRI;
+        uiConfig.wave[1] = SQR;
+        uiConfig.wave[3] = TRI;
         break;
       case 9:
-        config.fold = true;
-        config.wave[0] = config.wave[1] = TRIFOLD;
-        config.wave[2] = config.wave[3] = SINFOLD;
+        uiConfig.fold = true;
+        uiConfig.wave[0] = uiConfig.wave[1] = TRIFOLD;
+        uiConfig.wave[2] = uiConfig.wave[3] = SINFOLD;
         break;
     }
   }
@@ -580,18 +627,16 @@ void handle_gate()
   if (midimode)
     return;
   gate = !digitalRead(GATE_IN);
+  gatetime = fm.sampleTime();
 //  Serial.printf("Gate in is %s\n", gate ? "HIGH" : "LOW");
   if (idle && gate) 
   {
     idle = false;
     set_arm_clock(600000000);  
   }
+  // handleCV releases the note, at gatetime
   if (!gate && note >= 0)
-  {
-    fm.keyup((int)note);
-    note = -1;
     gatetoggled = true;
-  }
 }
 
 bool checkswitches()
@@ -614,8 +659,8 @@ void checkSerialControl()
     switch (c)
     {
       case 'x':
-        config.wave[3] = SQR;
-        config.wave[1] = TRI;
+        uiConfig.wave[3] = SQR;
+        uiConfig.wave[1] = TRI;
         Serial.println("------------------------------------------");
         printConfig();
         Serial.println("------------------------------------------");
@@ -657,10 +702,10 @@ void checkSerialControl()
         Serial.println("---------------------");
         break;
       case 's':
-        config.sync = !config.sync;
+        uiConfig.sync = !uiConfig.sync;
         Serial.println("=====================");
         Serial.print("Sync is now ");
-        Serial.println(config.sync ? "on" : "off");
+        Serial.println(uiConfig.sync ? "on" : "off");
         Serial.println("---------------------");
         break;
       case 'h':
@@ -680,6 +725,121 @@ void checkSerialControl()
   }
 }
 
+#define CV_READS_PER_BLOCK 4 // values fed to the median per audio block
+#define CV_MEDIAN_WINDOW 11 // widen for noisy CV sources
+
+CVInput cvin;
+bool cvdma = false;         // the pitch CV is captured by cvin
+volatile int cvpolled = -1; // otherwise the last analogRead of it by loop()
+
+// Runs in the audio update, just before each block is rendered, so the
+// pitch CV is tracked at block rate whatever loop() is busy with. Notes
+// are queued for the start of the block, or for the gate edge that
+// started or stopped them.
+void handleCV()
+{
+  int values[CV_READS_PER_BLOCK];
+  int n;
+  if (cvdma)
+  {
+    n = cvin.read(values, CV_READS_PER_BLOCK); // always drain the ring
+  }
+  else
+  {
+    values[0] = cvpolled;
+    n = values[0] >= 0 ? 1 : 0;
+  }
+  if (midimode)
+    return;
+
+  uint32_t now = fm.sampleClock();
+  uint32_t t = gatetoggled ? gatetime : now;
+  if (!gate && note >= 0) // released by the gate, or somehow stuck
+  {
+    fm.queueKeyup(t, (int)note);
+    note = -1;
+  }
+  if (n == 0)
+    return;
+
+  bool releasing = fm.isReleasing();
+  if (gate || releasing)
+  {
+//    const float n = 10.0;
+    static float saveraw = 0;
+    
+    long raw = 0;
+    int median = 0;
+    for (int i = 0; i < n; ++i)
+    {
+      raw = ANALOG_MAX - values[i];
+      median = handleCVBuffer(raw, 1000); // maintain the median incase we are switched back
+    }
+//    if (quantise)
+      saveraw = median;      
+//    else
+//      saveraw = (n - 1) * saveraw / n + 1.0 * raw  / n;
+//    Serial.println(saveraw);
+/*
+ * Odessa
+ * 
+   Calibration data
+    C2 input is 33
+    C7 input is 3489
+    scaling factor f ~ 60 / (3489 - 33)
+    pitch_cv = (raw - 33) * f;
+ */
+//      const float fbase = 149;
+//      const float f = 60.0 / (3618 - fbase);
+
+    const float fbase = 33;
+    const float f = 60.0 / (3489 - fbase);
+  
+    float pitch_cv = (saveraw - fbase) * f;
+    
+    if (gate)
+    {
+//    Serial.printf("raw: %ld, median: %d, average: %f\n", raw, median, saveraw);
+      bool newnote = false;
+      if (quantise) 
+      {
+        pitch_cv = round(pitch_cv);
+        newnote = abs(raw - saveraw) <= 5; // has it settled on a new value?
+      }
+      else
+      {
+        newnote = raw != saveraw;
+      }
+      if (newnote || gatetoggled)
+      {
+//        Serial.printf("Pitch_cv/raw/saveraw/rawforlastnote = %f/%d/%.1f [%.1f] %d [%d] => %d\n", 
+//          pitch_cv + PITCH_OFFSET, raw, saveraw,  abs(raw - saveraw), note, gatetoggled, newnote);
+        float notetoplay = PITCH_OFFSET + pitch_cv;
+        if (gatetoggled || notetoplay != note)
+        {
+          if ((quantise && (gatetoggled && note >= 0)) || (!quantise && gatetoggled)) {
+            fm.queueKeyup(t, (int)note);
+          }
+          note = PITCH_OFFSET + pitch_cv;
+//          Serial.printf("Note down: %f [%d]\n", note, (int)note);
+          if (quantise)
+            fm.queueKeydown(t, (int)note, 80);
+          else
+            fm.queueFreq(t, note, 80);
+        }
+      }
+      gatetoggled = false;
+    }
+    else 
+    {
+      if (releasing) {
+//        Serial.printf("Pitch_cv/raw/saveraw/rawforlastnote = %f/%d\n", pitch_cv + PITCH_OFFSET, round(PITCH_OFFSET + pitch_cv));
+        fm.queuePitchOnly(now, quantise ? round(PITCH_OFFSET + pitch_cv) : PITCH_OFFSET + pitch_cv); 
+      }
+    }
+  }
+}
+
 void setup() 
 { 
   for (int i = 0; i < 4; ++i)
@@ -732,18 +892,24 @@ void setup()
   adc->adc1->setConversionSpeed(ADC_CONVERSION_SPEED::MED_SPEED); // change the conversion speed
   // it can be any of the ADC_MED_SPEED enum: VERY_LOW_SPEED, LOW_SPEED, MED_SPEED, HIGH_SPEED or VERY_HIGH_SPEED
   adc->adc1->setSamplingSpeed(ADC_SAMPLING_SPEED::MED_SPEED); // change the sampling speed
+
+  setCVWindow(CV_MEDIAN_WINDOW);
+  cvdma = cvin.begin(adc, CV_IN);
+  if (!cvdma)
+    Serial.println("CV input can't be captured by DMA, reading it in loop()");
+  fm.setUpdateHook(handleCV);
  
   filter.frequency(6000);
   setAmpGain();
   
   resetAllDrone();
   
-  config.algorithm = -1; // invalid ensures initial update
+  uiConfig.algorithm = -1; // invalid ensures initial update
   controls.envMode = (envCtrlMode)-1; // invalid ensures initial update
   controls.modvalue = 0;
   scaleModulators(0);
-  config.detune = 0;
-  config.sync = false;
+  uiConfig.detune = 0;
+  uiConfig.sync = false;
 
   myusb.begin();
 
@@ -787,10 +953,10 @@ void loop()
   loopcount++;
   for (i = 0; i < 4; ++i)
   {
-    updatePot(&controls.finepot[i], finePots[i], now, config.fold ? 2 : ANALOG_SHIFT, false, true, config.fold ? 5 : NO_AVG); // smooth the folding a bit
+    updatePot(&controls.finepot[i], finePots[i], now, uiConfig.fold ? 2 : ANALOG_SHIFT, false, true, uiConfig.fold ? 5 : NO_AVG); // smooth the folding a bit
     updatePot(&controls.coarsepot[i], coarsePots[i], now, ANALOG_SHIFT, true, true, NO_AVG);
     // slow down the modulator response to minimise stepping
-    updatePot(&controls.levelpot[i], levelSliders[i], now, ANALOG_SHIFT, true, false, getOpType(i, config.algorithm) == CARRIER ? 4 : 10);
+    updatePot(&controls.levelpot[i], levelSliders[i], now, ANALOG_SHIFT, true, false, getOpType(i, uiConfig.algorithm) == CARRIER ? 4 : 10);
     updatePot(&controls.envpot[i], envPots[i], now, ANALOG_SHIFT, false, false, NO_AVG);
   }
   updatePot(&controls.feedbackpot, FEEDBACK_POT, now, ANALOG_SHIFT, false, false, NO_AVG);
@@ -798,9 +964,9 @@ void loop()
   needsUpdate = checkswitches();  
   
   int alg = getAlgorithm();
-  if (alg != config.algorithm)
+  if (alg != uiConfig.algorithm)
   {
-    config.algorithm = alg;
+    uiConfig.algorithm = alg;
     setAlgorithmLEDs(alg);
   }
 
@@ -808,20 +974,22 @@ void loop()
   {
     needsUpdate = true;
 //    updateEnv = true;
-    updateAllEnv(controls.envMode, config.algorithm);
+    updateAllEnv(controls.envMode, uiConfig.algorithm);
   }
 
   // Use operators 3-6 with DX7 algorithms 1, 14, 8, 7, 5, 22, 31, 32.
 //  static const int DX7ALGORITHMS[] = {1, 14, 8, 7, 5, 22, 31, 32};
-  int dx7algo = config.algorithm;
+  int dx7algo = uiConfig.algorithm;
   if (feedback2)
     dx7algo += N_ALGS;
   if (fm.getAlgorithm() != dx7algo)
   {
     fm.setAlgorithm(dx7algo);
+    // the voices take a new algorithm in a full refresh
+    fm.doRefreshVoice();
     setAmpGain();
     needsUpdate = true;
-    updateAllEnv(controls.envMode, config.algorithm);
+    updateAllEnv(controls.envMode, uiConfig.algorithm);
     updateWavetypes();
   }
 
@@ -843,7 +1011,7 @@ void loop()
     }
     if (potchange(&controls.envpot[i], now, false, true))
     {
-      bool envupdate = handleEnvelopes(i, controls.envpot[i].value, controls.envMode, config.algorithm);
+      bool envupdate = handleEnvelopes(i, controls.envpot[i].value, controls.envMode, uiConfig.algorithm);
       if (!needsUpdate) {
         needsUpdate = envupdate;
         updateEnv = true;
@@ -852,32 +1020,30 @@ void loop()
     if (potchange(&controls.levelpot[i], now, false, false))
     {
       long v = (uint8_t)(sqrt(controls.levelpot[i].value / 127.0) * 99);
-//      config.level[i] = midimode && getOpType(i, config.algorithm) == CARRIER ? 0.75 * v : v;
-//      config.level[i] = midimode ? 0.75 * v : v;
-      config.level[i] = midimode ? 0.9 * v : v;
-//      config.level[i] = v;
-//      Serial.printf("Level: %d %3d %2d\n", i + 1, config.levelpot[i].value, v);
+//      uiConfig.level[i] = midimode && getOpType(i, uiConfig.algorithm) == CARRIER ? 0.75 * v : v;
+//      uiConfig.level[i] = midimode ? 0.75 * v : v;
+      uiConfig.level[i] = midimode ? 0.9 * v : v;
+//      uiConfig.level[i] = v;
+//      Serial.printf("Level: %d %3d %2d\n", i + 1, uiConfig.levelpot[i].value, v);
       needsUpdate = true;
     }
   }
   if (potchange(&controls.feedbackpot, now, false, false))
   {
     int newfb = round(controls.feedbackpot.value / 127.0 * 100);
-    if (config.feedback != newfb)
+    if (uiConfig.feedback != newfb)
     {
-      config.feedback = newfb;
+      uiConfig.feedback = newfb;
       needsUpdate = true;
     }
   }
 
-  updateall = false;
+  sendConfig();
 
-  if (updateEnv)
-    fm.doRefreshEnv();
+  updateall = false;
     
   if (needsUpdate)
   {
-    fm.doRefreshVoice();
     if (showConfigOnChange)
       printConfig();
   }
@@ -885,91 +1051,10 @@ void loop()
   myusb.Task();
   midi1.read();
   usbMIDI.read();
-  if (!midimode)
-  {
-  // TODO move the pitch cv handling to a method
-    bool releasing = fm.isReleasing();
-    if (gate || releasing)
-    {
-  //    const float n = 10.0;
-      static float saveraw = 0;
-      
-      long raw = ANALOG_MAX - adc->analogRead(CV_IN);
-      int median = handleCVBuffer(raw, 1000); // maintain the median incase we are switched back
-  //    if (quantise)
-        saveraw = median;      
-  //    else
-  //      saveraw = (n - 1) * saveraw / n + 1.0 * raw  / n;
-//    Serial.println(saveraw);
-  /*
-   * Odessa
-   * 
-     Calibration data
-      C2 input is 33
-      C7 input is 3489
-      scaling factor f ~ 60 / (3489 - 33)
-      pitch_cv = (raw - 33) * f;
-   */
-//      const float fbase = 149;
-//      const float f = 60.0 / (3618 - fbase);
-
-      const float fbase = 33;
-      const float f = 60.0 / (3489 - fbase);
-    
-      float pitch_cv = (saveraw - fbase) * f;
-      
-      if (gate)
-      {
-//    Serial.printf("raw: %ld, median: %d, average: %f\n", raw, median, saveraw);
-        bool newnote = false;
-        if (quantise) 
-        {
-          pitch_cv = round(pitch_cv);
-          newnote = abs(raw - saveraw) <= 5; // has it settled on a new value?
-        }
-        else
-        {
-          newnote = raw != saveraw;
-        }
-        if (newnote || gatetoggled)
-        {
-  //        Serial.printf("Pitch_cv/raw/saveraw/rawforlastnote = %f/%d/%.1f [%.1f] %d [%d] => %d\n", 
-  //          pitch_cv + PITCH_OFFSET, raw, saveraw,  abs(raw - saveraw), note, gatetoggled, newnote);
-          float notetoplay = PITCH_OFFSET + pitch_cv;
-          if (gatetoggled || notetoplay != note)
-          {
-            if ((quantise && (gatetoggled && note >= 0)) || (!quantise && gatetoggled)) {
-              fm.keyup((int)note);
-            }
-            note = PITCH_OFFSET + pitch_cv;
-  //          Serial.printf("Note down: %f [%d]\n", note, (int)note);
-            if (quantise)
-              fm.keydown((int)note, 80);
-            else
-              fm.freq(note, 80);
-          }
-        }
-        gatetoggled = false;
-      }
-      else 
-      {
-        if (releasing) {
-  //        Serial.printf("Pitch_cv/raw/saveraw/rawforlastnote = %f/%d\n", pitch_cv + PITCH_OFFSET, round(PITCH_OFFSET + pitch_cv));
-          fm.updatePitchOnly(quantise ? round(PITCH_OFFSET + pitch_cv) : PITCH_OFFSET + pitch_cv); 
-        }
-      }
-    }
-
-    if (!gate && note >= 0) // if a note somehow got stuck...
-    {
-      Serial.println("Emergency notes off");
-      fm.keyup((int)note);
-  //      fm.notesOff();
-      note = -1;
-    }
-  }
-  
-  if (!idle && loopcount % 100 == 0) {
+  if (!cvdma && !midimode)
+    cvpolled = adc->analogRead(CV_IN);
+  // the engine keeps count of its live voices, so this is cheap to ask
+  if (!idle) {
     idle = fm.isIdle();
     if (idle) {
       set_arm_clock(24000000);  
@@ -1036,7 +1121,7 @@ void handleResetButton()
         break;
     }
     resetState = NONE;
-    setAlgorithmLEDs(config.algorithm);
+    setAlgorithmLEDs(uiConfig.algorithm);
   }
 }
 
@@ -1077,23 +1162,22 @@ void handleNoteOn(byte channel, byte note, byte velocity)
       idle = false;
       set_arm_clock(600000000);  
     }
-    fm.keydown((int16_t)note + MIDI_NOTE_OFFSET, (int8_t)velocity);
+    fm.queueKeydown(fm.sampleTime(), (int16_t)note + MIDI_NOTE_OFFSET, (int8_t)velocity);
   }
 }
 
 void handleNoteOff(byte channel, byte note, byte velocity) 
 {
   if (midimode)
-    fm.keyup((int16_t)note + MIDI_NOTE_OFFSET);
+    fm.queueKeyup(fm.sampleTime(), (int16_t)note + MIDI_NOTE_OFFSET);
 }
 
 void handlePitchChange(byte channel, int pitch) 
 {
   if (midimode)
   {
-    pitch = map(pitch, -8192, 8192, -7 * PITCH_BEND_FACTOR, 7 * PITCH_BEND_FACTOR);
-    config.detune = pitch;
-    fm.doRefreshVoice();
+    // pitch is -8192 to 8191; map() would overflow
+    fm.queuePitchBend(fm.sampleTime(), (int64_t)pitch * PITCH_BEND_RANGE / 8192);
   }
 }
 
@@ -1101,20 +1185,20 @@ void scaleModulators(byte amount)
 {
   for (int i = 0; i < 4; ++i)
   {
-    if (getOpType(i, config.algorithm) == MODULATOR)
+    if (getOpType(i, uiConfig.algorithm) == MODULATOR)
     {
-      float l = sqrt(config.level[i] / 100.0);
+      float l = sqrt(uiConfig.level[i] / 100.0);
       float f = max(min((1 - l) + 0.1, 1), 0.1);
-      config.scale[i] = 1 + f * (amount / 127.0);
-//      int current = config.level[i];
-//      int target = current * config.scale[i];
-//      Serial.printf("%d => %.2f [%d => %d]\t", amount, config.scale[i], current, target);
+      uiConfig.scale[i] = 1 + f * (amount / 127.0);
+//      int current = uiConfig.level[i];
+//      int target = current * uiConfig.scale[i];
+//      Serial.printf("%d => %.2f [%d => %d]\t", amount, uiConfig.scale[i], current, target);
     }
     else
-      config.scale[i] = 1;
+      uiConfig.scale[i] = 1;
   }
   Serial.println();
-  fm.doRefreshEnv();
+  sendConfig();
 }
 
 void handleAfterTouchChannel(byte channel, byte pressure) 
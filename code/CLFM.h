@@ -32,5 +32,3 @@ typedef struct configStruct
   float scale[4];
   int feedback;
 } configStruct;
-
-extern configStruct config;
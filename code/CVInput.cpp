@@ -0,0 +1,60 @@
+#include <Arduino.h>
+
+#include "CVInput.h"
+
+// There is only the one CV input, so the ring is a file static: DMA
+// buffers need to be in DMAMEM and aligned to cache lines.
+DMAMEM static volatile uint16_t __attribute__((aligned(32))) ring[CV_RING_SIZE];
+
+bool CVInput::begin(ADC *adc, uint8_t pin)
+{
+  bool second = adc->adc1->checkPin(pin);
+  ADC_Module *module = second ? adc->adc1 : adc->adc0;
+  if (!module->checkPin(pin))
+    return false;
+
+  // ADC_0 and ADC_1 are the ADC1 and ADC2 blocks of the i.MX RT
+  if (second)
+  {
+    dma.source((volatile uint16_t &)ADC2_R0);
+    dma.triggerAtHardwareEvent(DMAMUX_SOURCE_ADC2);
+  }
+  else
+  {
+    dma.source((volatile uint16_t &)ADC1_R0);
+    dma.triggerAtHardwareEvent(DMAMUX_SOURCE_ADC1);
+  }
+  // the destination wraps back to the start of the ring at the end of
+  // every major loop, and the channel stays enabled
+  dma.destinationBuffer(ring, sizeof(ring));
+  readpos = 0;
+  dma.enable();
+
+  module->enableDMA();
+  return module->startContinuous(pin);
+}
+
+int CVInput::read(int *values, int n)
+{
+  uint32_t writepos = (volatile uint16_t *)dma.TCD->DADDR - ring;
+  uint32_t count = (writepos - readpos) & (CV_RING_SIZE - 1);
+  if (count == 0 || n <= 0)
+    return 0;
+  if ((uint32_t)n > count)
+    n = count;
+
+  // only DMA writes the ring, so there is nothing dirty to lose
+  arm_dcache_delete((void *)ring, sizeof(ring));
+  for (int i = 0; i < n; i++)
+  {
+    uint32_t run = count * (i + 1) / n - count * i / n;
+    uint32_t sum = 0;
+    for (uint32_t j = 0; j < run; j++)
+    {
+      sum += ring[readpos];
+      readpos = (readpos + 1) & (CV_RING_SIZE - 1);
+    }
+    values[i] = sum / run;
+  }
+  return n;
+}
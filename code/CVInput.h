@@ -0,0 +1,30 @@
+#pragma once
+
+#include <ADC.h>
+#include <DMAChannel.h>
+
+// Samples captured by DMA between two reads. At the conversion rate set up
+// in setup() this covers several audio blocks, so a late read loses nothing.
+#define CV_RING_SIZE 512 // power of two, a whole number of cache lines
+
+// Continuous conversion of one analog pin, written by DMA into a ring
+// buffer so that nothing in loop() has to poll the ADC for it. The reader
+// (the audio update) takes whatever arrived since its last read, so the
+// pitch CV is seen once per audio block whatever else loop() is doing.
+class CVInput
+{
+  public:
+    // Starts continuous conversion of pin on ADC_1 when it can read the pin,
+    // otherwise on ADC_0. The ADC's averaging, resolution and speeds should
+    // already be set up. Returns false if the pin can't be converted.
+    bool begin(ADC *adc, uint8_t pin);
+
+    // Reduces the samples captured since the last call to at most n values,
+    // the means of equal runs of them, oldest first. Returns the number of
+    // values written, 0 if nothing new has arrived.
+    int read(int *values, int n);
+
+  private:
+    DMAChannel dma;
+    uint32_t readpos = 0;
+};
@@ -51,37 +51,74 @@ float noteToFreq(float n)
   return pow(2, (n - 49) / 12.0) * 440;
 }
 
-#define BUFFERSIZE 11 // must be odd (since I don't average below)
-#define MIDBUFFER (BUFFERSIZE >> 1)
-
-static int buffer[BUFFERSIZE] = { 0 };
-static int sortbuffer[BUFFERSIZE];
+// The median window slides one sample at a time, so rather than sorting
+// the whole window for every sample, a sorted copy is kept alongside the
+// ring: the oldest value is replaced by the new one and shuffled into
+// place, which costs at most one pass over the window.
+static int buffer[MAX_CV_WINDOW];   // in arrival order
+static int sorted[MAX_CV_WINDOW];   // the same values, ascending
+static int window = 11;
 static int bufferindex = 0;
 static int samples = 0;
 
-int sort_desc(const void *cmp1, const void *cmp2)
+void setCVWindow(int n)
 {
-  // Need to cast the void * to int *
-  int a = *((int *)cmp1);
-  int b = *((int *)cmp2);
-  return b - a;
+  if (n < 1)
+    n = 1;
+  if (n > MAX_CV_WINDOW)
+    n = MAX_CV_WINDOW;
+  window = n | 1; // must be odd (since I don't average below)
+  if (window > MAX_CV_WINDOW)
+    window -= 2;
+  bufferindex = 0;
+  samples = 0;
 }
 
-int median() 
+// first index in sorted[0, count) whose value is not less than v
+static int lowerBound(int v, int count)
 {
-  memcpy(sortbuffer, buffer, BUFFERSIZE * sizeof(int));
-  qsort(sortbuffer, BUFFERSIZE, sizeof(sortbuffer[0]), sort_desc);
-  return sortbuffer[MIDBUFFER];
+  int lo = 0, hi = count;
+  while (lo < hi)
+  {
+    int mid = (lo + hi) >> 1;
+    if (sorted[mid] < v)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
 }
 
 int handleCVBuffer(int v, int thresh)
 {
   int m = 0;
+  int i;
+  if (samples < window)
+  {
+    i = samples++;
+  }
+  else
+  {
+    // the slot of the value leaving the window
+    i = lowerBound(buffer[bufferindex], window);
+  }
+  while (i > 0 && sorted[i - 1] > v)
+  {
+    sorted[i] = sorted[i - 1];
+    --i;
+  }
+  while (i + 1 < samples && sorted[i + 1] < v)
+  {
+    sorted[i] = sorted[i + 1];
+    ++i;
+  }
+  sorted[i] = v;
   buffer[bufferindex] = v;
-  bufferindex = (bufferindex + 1) % BUFFERSIZE;
-  if (++samples >= BUFFERSIZE)
+  bufferindex = (bufferindex + 1) % window;
+
+  if (samples >= window)
   {
-    m = median();
+    m = sorted[window >> 1];
 //    Serial.printf("Added %d, median = %d\n", v, m);
     // catch rapid change and just trust the new value
     if (abs(v - m) >= thresh)
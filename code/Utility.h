@@ -21,4 +21,9 @@ int quantise_note(int n, quantisation q, int transpose);
 float freqToNote(float f);
 float noteToFreq(float n);
 
+#define MAX_CV_WINDOW 63 // longest CV median window
+
+// Median of the last n CV readings, n odd (an even n is rounded up) and at
+// most MAX_CV_WINDOW. Changing it restarts the window.
+void setCVWindow(int n);
 int handleCVBuffer(int v, int thresh);
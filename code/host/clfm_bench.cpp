@@ -0,0 +1,581 @@
+/*
+   clfm_bench - micro benchmarks for the CLFM engine
+
+   Measures the operator kernels for each wave type, FmCore::render for each
+   algorithm and a full Dexed::getSamples at increasing polyphony, with and
+   without voice per lane rendering and on a thread pool. Every
+   benchmark reports the time per output sample so that numbers are
+   comparable across block sizes.
+
+     clfm_bench --benchmark_filter=Kernel
+*/
+
+#include <benchmark/benchmark.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string>
+
+#include "platform.h"
+#include "dexed.h"
+#include "fm_core.h"
+#include "exp2.h"
+#include "fenv.h"
+#include "wavetables.h"
+#include "freqlut.h"
+#include "patch_file.h"
+#include "engine_checks.h"
+
+#define SAMPLE_RATE 44100
+
+static const char *wavenames[] = {"sin", "tri", "sqr", "sinfld", "trifld"};
+
+class BenchDexed : public Dexed {
+  public:
+    BenchDexed(uint8_t max_notes) : Dexed(max_notes, SAMPLE_RATE) {}
+    using Dexed::getSamples;
+};
+
+static void perSample(benchmark::State &state, int samples_per_iteration) {
+  state.SetItemsProcessed(state.iterations() * samples_per_iteration);
+  state.counters["per_sample"] = benchmark::Counter(samples_per_iteration,
+    benchmark::Counter::kIsIterationInvariantRate | benchmark::Counter::kInvert);
+}
+
+// Fold amount used for the folding wave types (configStruct::fine range)
+#define BENCH_FOLD 128
+
+static int16_t benchFold(wavetype wave) {
+  return wave == SINFOLD || wave == TRIFOLD ? BENCH_FOLD : 0;
+}
+
+struct KernelBuffers {
+  AlignedBuf<int32_t, _N_> input;
+  AlignedBuf<int32_t, _N_> output;
+  int32_t fb_buf[2];
+
+  KernelBuffers() {
+    for (int i = 0; i < _N_; i++) {
+      input.get()[i] = Sin::lookup(i << 18) >> 2;
+      output.get()[i] = 0;
+    }
+    fb_buf[0] = fb_buf[1] = 0;
+  }
+};
+
+static const int32_t kFreq = 1 << 20;
+static const int32_t kGain1 = 1 << 23;
+static const int32_t kGain2 = 1 << 24;
+
+static void BM_KernelCompute(benchmark::State &state) {
+  wavetype wave = (wavetype)state.range(0);
+  KernelBuffers b;
+  int32_t phase = 0;
+  for (auto _ : state) {
+    FmOpKernel::compute(b.output.get(), b.input.get(), phase, kFreq, wave, benchFold(wave), kGain1, kGain2, true);
+    phase += kFreq << LG_N;
+    benchmark::ClobberMemory();
+  }
+  state.SetLabel(std::string(wavenames[wave]) + " " + FmOpKernel::simd_name());
+  perSample(state, _N_);
+  state.counters["mismatches"] = kernelMismatches(wave, benchFold(wave), false);
+}
+
+static void BM_KernelComputeScalar(benchmark::State &state) {
+  wavetype wave = (wavetype)state.range(0);
+  KernelBuffers b;
+  int32_t phase = 0;
+  for (auto _ : state) {
+    FmOpKernel::compute_scalar(b.output.get(), b.input.get(), phase, kFreq, wave, benchFold(wave), kGain1, kGain2, true);
+    phase += kFreq << LG_N;
+    benchmark::ClobberMemory();
+  }
+  state.SetLabel(wavenames[wave]);
+  perSample(state, _N_);
+}
+
+static void BM_KernelComputePure(benchmark::State &state) {
+  wavetype wave = (wavetype)state.range(0);
+  KernelBuffers b;
+  int32_t phase = 0;
+  for (auto _ : state) {
+    FmOpKernel::compute_pure(b.output.get(), phase, kFreq, wave, benchFold(wave), kGain1, kGain2, true);
+    phase += kFreq << LG_N;
+    benchmark::ClobberMemory();
+  }
+  state.SetLabel(std::string(wavenames[wave]) + " " + FmOpKernel::simd_name());
+  perSample(state, _N_);
+  state.counters["mismatches"] = kernelMismatches(wave, benchFold(wave), true);
+}
+
+static void BM_KernelComputePureScalar(benchmark::State &state) {
+  wavetype wave = (wavetype)state.range(0);
+  KernelBuffers b;
+  int32_t phase = 0;
+  for (auto _ : state) {
+    FmOpKernel::compute_pure_scalar(b.output.get(), phase, kFreq, wave, benchFold(wave), kGain1, kGain2, true);
+    phase += kFreq << LG_N;
+    benchmark::ClobberMemory();
+  }
+  state.SetLabel(wavenames[wave]);
+  perSample(state, _N_);
+}
+
+static void BM_KernelComputeFb(benchmark::State &state) {
+  wavetype wave = (wavetype)state.range(0);
+  KernelBuffers b;
+  int32_t phase = 0;
+  for (auto _ : state) {
+    FmOpKernel::compute_fb(b.output.get(), phase, kFreq, wave, benchFold(wave), kGain1, kGain2, b.fb_buf, 0.5f, true);
+    phase += kFreq << LG_N;
+    benchmark::ClobberMemory();
+  }
+  state.SetLabel(wavenames[wave]);
+  perSample(state, _N_);
+}
+
+BENCHMARK(BM_KernelCompute)->DenseRange(SIN, TRIFOLD);
+BENCHMARK(BM_KernelComputeScalar)->DenseRange(SIN, TRIFOLD);
+BENCHMARK(BM_KernelComputePure)->DenseRange(SIN, TRIFOLD);
+BENCHMARK(BM_KernelComputePureScalar)->DenseRange(SIN, TRIFOLD);
+BENCHMARK(BM_KernelComputeFb)->DenseRange(SIN, TRIFOLD);
+
+// Fold::apply against the floating point reference it replaced. max_err
+// is the largest difference (Q24) seen over the full input range.
+static void BM_Fold(benchmark::State &state) {
+  int16_t fold = state.range(0);
+  int32_t gain = Fold::gain(fold);
+
+  KernelBuffers b;
+  for (auto _ : state) {
+    for (int i = 0; i < _N_; i++)
+      b.output.get()[i] = Fold::apply(b.input.get()[i] << 2, gain);
+    benchmark::ClobberMemory();
+  }
+  perSample(state, _N_);
+  state.counters["max_err"] = foldMaxError(fold);
+}
+
+static void BM_FoldReference(benchmark::State &state) {
+  float foldamount = MAXFOLD * state.range(0) / 200.0;
+  KernelBuffers b;
+  for (auto _ : state) {
+    for (int i = 0; i < _N_; i++)
+      b.output.get()[i] = Fold::reference(b.input.get()[i] << 2, foldamount);
+    benchmark::ClobberMemory();
+  }
+  perSample(state, _N_);
+}
+
+BENCHMARK(BM_Fold)->Arg(-MAXFOLDPARAM)->Arg(-64)->Arg(64)->Arg(MAXFOLDPARAM);
+BENCHMARK(BM_FoldReference)->Arg(-MAXFOLDPARAM)->Arg(-64)->Arg(64)->Arg(MAXFOLDPARAM);
+
+static void BM_CoreRender(benchmark::State &state) {
+  int algorithm = state.range(0);
+  HostPatch patch;
+  initPatch(patch);
+
+  FmCore core;
+  FmOpParams params[4];
+  AlignedBuf<int32_t, _N_> output;
+  int32_t fb_buf[2] = { 0, 0 };
+  for (int op = 0; op < 4; op++) {
+    params[op].level_in = 13 << 24;  // loud enough to pass kLevelThresh
+    params[op].gain_out = 0;
+    params[op].freq = kFreq * (op + 1);
+    params[op].phase = 0;
+    params[op].fold = 0;
+    params[op].wave = patch.config.wave[op];
+  }
+  for (auto _ : state) {
+    core.render(output.get(), params, algorithm, fb_buf, 0.5f);
+    benchmark::ClobberMemory();
+  }
+  perSample(state, _N_);
+}
+
+BENCHMARK(BM_CoreRender)->DenseRange(0, 2 * N_ALGS - 1);
+
+// FEnv::getsample for four operators held through attack, decay and
+// sustain, then released, one call per block as in Dx7Note::prepare
+static void BM_Envelope(benchmark::State &state) {
+  FEnv env[4];
+  for (int op = 0; op < 4; op++) {
+    env[op].setop(op);
+    env[op].init(5 + op, 20, 60, 30, false, 99 * 32);
+  }
+  int block = 0;
+  int32_t sum = 0;
+  for (auto _ : state) {
+    if (block % 2048 == 0)
+      for (int op = 0; op < 4; op++)
+        env[op].keydown(true);
+    else if (block % 2048 == 1536)
+      for (int op = 0; op < 4; op++)
+        env[op].keydown(false);
+    block++;
+    for (int op = 0; op < 4; op++)
+      sum += env[op].getsample();
+    benchmark::DoNotOptimize(sum);
+  }
+  perSample(state, _N_);
+}
+
+BENCHMARK(BM_Envelope);
+
+// The operator pitches of one voice; argument: osc_freq for every operator
+// (0) or the snapshot's note pitch plus its cached offsets (1)
+static void BM_NotePitch(benchmark::State &state) {
+  bool cached = state.range(0);
+  HostPatch patch;
+  initPatch(patch);
+  patch.config.detune = 20;
+  ConfigSnapshot snapshot;
+  snapshot.config = patch.config;
+  snapshot.derive();
+
+  const configStruct &c = snapshot.config;
+  int32_t pitch[4];
+  float note = 40;
+  for (auto _ : state) {
+    note = note < 90 ? note + 0.25f : 40;
+    if (cached) {
+      int32_t logfreq = snapshot.noteLogfreq(note);
+      for (int op = 0; op < 4; op++)
+        pitch[op] = logfreq + snapshot.ratio[op];
+    } else {
+      for (int op = 0; op < 4; op++)
+        pitch[op] = osc_freq(note, 0, c.coarse[op], c.fine[op], c.detune);
+    }
+    benchmark::DoNotOptimize(pitch);
+  }
+  state.counters["mismatches"] = pitchMismatches();
+}
+
+BENCHMARK(BM_NotePitch)->Arg(0)->Arg(1);
+
+// Block size of AudioSynthDexed::update on the Teensy
+#define BENCH_BLOCK 128
+
+// Arguments: voices, voice per lane rendering on/off
+static void BM_GetSamples(benchmark::State &state) {
+  int nvoices = state.range(0);
+  bool batch = state.range(1);
+  HostPatch patch;
+  initPatch(patch);
+  // full sustain so every operator stays above the level threshold, and
+  // some feedback (50 is none)
+  for (int op = 0; op < 4; op++)
+    patch.config.env[op].s = 99;
+  patch.config.feedback = 70;
+
+  BenchDexed fm(_MAX_NOTES);
+  fm.loadConfig(patch.config);
+  fm.setVoiceBatching(batch);
+  fm.setAlgorithm(patch.engineAlgorithm());
+  for (int i = 0; i < nvoices; i++)
+    fm.keydown(48 + 3 * i, 100);
+
+  int16_t buffer[BENCH_BLOCK];
+  for (auto _ : state) {
+    fm.getSamples(BENCH_BLOCK, buffer);
+    benchmark::ClobberMemory();
+  }
+  perSample(state, BENCH_BLOCK);
+  if (batch && nvoices == _MAX_NOTES)
+    state.counters["mismatches"] = batchMismatches();
+}
+
+// 16 voices at this build's block size (CLFM_LG_N); block_us is how
+// finely envelopes, gain ramps and queued notes are timed, against the
+// per block overhead in per_sample
+static void BM_BlockSize(benchmark::State &state) {
+  HostPatch patch;
+  initPatch(patch);
+  for (int op = 0; op < 4; op++)
+    patch.config.env[op].s = 99;
+  patch.config.feedback = 70;
+
+  BenchDexed fm(_MAX_NOTES);
+  fm.loadConfig(patch.config);
+  fm.setAlgorithm(patch.engineAlgorithm());
+  for (int i = 0; i < _MAX_NOTES; i++)
+    fm.keydown(48 + 3 * i, 100);
+
+  int16_t buffer[BENCH_BLOCK];
+  for (auto _ : state) {
+    fm.getSamples(BENCH_BLOCK, buffer);
+    benchmark::ClobberMemory();
+  }
+  perSample(state, BENCH_BLOCK);
+  state.counters["block"] = _N_;
+  state.counters["block_us"] = _N_ * 1e6 / SAMPLE_RATE;
+}
+
+BENCHMARK(BM_BlockSize);
+
+// The voice mixdown on its own, over BENCH_BLOCK samples of each voice.
+// BM_MixFloat is the mix getSamples used to do (per voice saturate, divide
+// and float add, then arm_float_to_q15); BM_MixInt is the int32 mix.
+struct MixBuffers {
+  int32_t voice[_MAX_NOTES][BENCH_BLOCK];
+  int16_t out[BENCH_BLOCK];
+
+  MixBuffers() {
+    for (int v = 0; v < _MAX_NOTES; v++)
+      for (int i = 0; i < BENCH_BLOCK; i++)
+        voice[v][i] = Sin::lookup((i + 7 * v) << 17) << 2;
+  }
+};
+
+static void BM_MixFloat(benchmark::State &state) {
+  int nvoices = state.range(0);
+  MixBuffers b;
+  float sumbuf[BENCH_BLOCK];
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(b.voice);
+    for (int i = 0; i < BENCH_BLOCK; i++)
+      sumbuf[i] = 0.0;
+    for (int v = 0; v < nvoices; v++)
+      for (int i = 0; i < BENCH_BLOCK; i++)
+        sumbuf[i] += signed_saturate_rshift(b.voice[v][i] >> 4, 24, 9) / 32768.0;
+    arm_float_to_q15(sumbuf, b.out, BENCH_BLOCK);
+    benchmark::DoNotOptimize(b.out);
+  }
+  perSample(state, BENCH_BLOCK);
+}
+
+static void BM_MixInt(benchmark::State &state) {
+  int nvoices = state.range(0);
+  MixBuffers b;
+  int32_t mixbuf[BENCH_BLOCK];
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(b.voice);
+    for (int i = 0; i < BENCH_BLOCK; i++)
+      mixbuf[i] = 0;
+    for (int v = 0; v < nvoices; v++)
+      for (int i = 0; i < BENCH_BLOCK; i++)
+        mixbuf[i] += b.voice[v][i] >> 4;
+    for (int i = 0; i < BENCH_BLOCK; i++)
+      b.out[i] = signed_saturate_rshift(mixbuf[i], 16, 9);
+    benchmark::DoNotOptimize(b.out);
+  }
+  perSample(state, BENCH_BLOCK);
+}
+
+BENCHMARK(BM_MixFloat)->Arg(1)->Arg(4)->Arg(16);
+BENCHMARK(BM_MixInt)->Arg(1)->Arg(4)->Arg(16);
+
+BENCHMARK(BM_GetSamples)->ArgsProduct({ benchmark::CreateDenseRange(1, _MAX_NOTES, 1), { 0, 1 } });
+
+// A level change on 16 voices; argument: snapshot (1) or full refresh (0)
+static void BM_ConfigChange(benchmark::State &state) {
+  bool snapshot = state.range(0);
+  HostPatch patch;
+  initPatch(patch);
+
+  BenchDexed fm(_MAX_NOTES);
+  fm.loadConfig(patch.config);
+  for (int i = 0; i < _MAX_NOTES; i++)
+    fm.keydown(48 + 3 * i, 100);
+
+  int16_t buffer[BENCH_BLOCK];
+  for (auto _ : state) {
+    patch.config.level[1] = (patch.config.level[1] + 1) % 100;
+    fm.setConfig(patch.config);
+    if (!snapshot)
+      fm.doRefreshVoice();
+    fm.getSamples(BENCH_BLOCK, buffer);
+    benchmark::ClobberMemory();
+  }
+  perSample(state, BENCH_BLOCK);
+  state.counters["mismatches"] = configMismatches();
+}
+
+BENCHMARK(BM_ConfigChange)->Arg(0)->Arg(1);
+
+// A level change on 16 voices; argument: whole snapshot (0) or queued
+// parameter (1)
+static void BM_ParamChange(benchmark::State &state) {
+  bool queue = state.range(0);
+  HostPatch patch;
+  initPatch(patch);
+
+  BenchDexed fm(_MAX_NOTES);
+  fm.loadConfig(patch.config);
+  for (int i = 0; i < _MAX_NOTES; i++)
+    fm.keydown(48 + 3 * i, 100);
+
+  int16_t buffer[BENCH_BLOCK];
+  for (auto _ : state) {
+    patch.config.level[1] = (patch.config.level[1] + 1) % 100;
+    if (queue)
+      fm.setParam(PARAM_LEVEL, 1, patch.config.level[1]);
+    else
+      fm.setConfig(patch.config);
+    fm.getSamples(BENCH_BLOCK, buffer);
+    benchmark::ClobberMemory();
+  }
+  perSample(state, BENCH_BLOCK);
+  state.counters["mismatches"] = paramMismatches();
+}
+
+BENCHMARK(BM_ParamChange)->Arg(0)->Arg(1);
+
+// A pitch bend message every block on 16 voices; argument: through the
+// config's detune (0) or setPitchBend (1)
+static void BM_PitchBend(benchmark::State &state) {
+  bool bend = state.range(0);
+  HostPatch patch;
+  initPatch(patch);
+
+  BenchDexed fm(_MAX_NOTES);
+  fm.loadConfig(patch.config);
+  for (int i = 0; i < _MAX_NOTES; i++)
+    fm.keydown(48 + 3 * i, 100);
+
+  int16_t buffer[BENCH_BLOCK];
+  int step = 0;
+  for (auto _ : state) {
+    step = (step + 1) % 98;
+    if (bend) {
+      fm.setPitchBend((step - 49) << 14);
+    } else {
+      patch.config.detune = step - 49;
+      fm.setConfig(patch.config);
+    }
+    fm.getSamples(BENCH_BLOCK, buffer);
+    benchmark::ClobberMemory();
+  }
+  perSample(state, BENCH_BLOCK);
+}
+
+BENCHMARK(BM_PitchBend)->Arg(0)->Arg(1);
+
+// A note on and off somewhere in every block on 16 voices; argument: keyed
+// before the block (0) or queued for their time in it (1)
+static void BM_NoteEvents(benchmark::State &state) {
+  bool queued = state.range(0);
+  HostPatch patch;
+  initPatch(patch);
+
+  BenchDexed fm(_MAX_NOTES);
+  fm.loadConfig(patch.config);
+  for (int i = 0; i < _MAX_NOTES - 1; i++)
+    fm.keydown(48 + 3 * i, 100);
+
+  int16_t buffer[BENCH_BLOCK];
+  int step = 0;
+  for (auto _ : state) {
+    step = (step + 37) % BENCH_BLOCK;
+    uint32_t time = fm.sampleClock() + step;
+    if (queued) {
+      fm.queueKeydown(time, 100, 100);
+      fm.queueKeyup(time + 1, 100);
+    } else {
+      fm.keydown(100, 100);
+      fm.keyup(100);
+    }
+    fm.getSamples(BENCH_BLOCK, buffer);
+    benchmark::ClobberMemory();
+  }
+  perSample(state, BENCH_BLOCK);
+  state.counters["onset_error"] = onsetError(queued);
+}
+
+BENCHMARK(BM_NoteEvents)->Arg(0)->Arg(1);
+
+// Block size of clfm_render, which is where multithreaded rendering is used
+#define BENCH_RENDER_BLOCK 4096
+
+// Arguments: voices, threads
+static void BM_GetSamplesThreads(benchmark::State &state) {
+  int nvoices = state.range(0);
+  int threads = state.range(1);
+  HostPatch patch;
+  initPatch(patch);
+  for (int op = 0; op < 4; op++)
+    patch.config.env[op].s = 99;
+  patch.config.feedback = 70;
+
+  BenchDexed fm(_MAX_NOTES);
+  fm.loadConfig(patch.config);
+  fm.setRenderThreads(threads);
+  fm.setAlgorithm(patch.engineAlgorithm());
+  for (int i = 0; i < nvoices; i++)
+    fm.keydown(48 + 3 * i, 100);
+
+  static int16_t buffer[BENCH_RENDER_BLOCK];
+  for (auto _ : state) {
+    fm.getSamples(BENCH_RENDER_BLOCK, buffer);
+    benchmark::ClobberMemory();
+  }
+  perSample(state, BENCH_RENDER_BLOCK);
+  state.counters["mismatches"] = threadMismatches(threads);
+}
+
+BENCHMARK(BM_GetSamplesThreads)->ArgsProduct({ { 4, 16 }, { 1, 2, 4, 8 } })->UseRealTime();
+
+// Folding, which adds harmonics far above the Nyquist frequency to a high
+// note, rendered at the sample rate and oversampled by the argument;
+// alias_db from aliasDb. (Feedback is left out: strong feedback is noisy at
+// any rate, which would hide the aliasing.)
+static void BM_Oversampling(benchmark::State &state) {
+  int oversampling = state.range(0);
+  HostPatch patch;
+  initPatch(patch);
+  patch.config.fold = true;
+  for (int op = 0; op < 4; op++) {
+    patch.config.wave[op] = SINFOLD;
+    patch.config.fine[op] = 40;
+  }
+
+  BenchDexed fm(_MAX_NOTES);
+  fm.loadConfig(patch.config);
+  fm.setOversampling(oversampling);
+  fm.setAlgorithm(patch.engineAlgorithm());
+  for (int i = 0; i < 4; i++)
+    fm.keydown(60 + 7 * i, 100);
+
+  int16_t buffer[BENCH_BLOCK];
+  for (auto _ : state) {
+    fm.getSamples(BENCH_BLOCK, buffer);
+    benchmark::ClobberMemory();
+  }
+  perSample(state, BENCH_BLOCK);
+  state.counters["alias_db"] = aliasDb(patch, 108, oversampling);
+  state.counters["mismatches"] = threadMismatches(4, oversampling);
+}
+
+BENCHMARK(BM_Oversampling)->Arg(1)->Arg(2)->Arg(4);
+
+// A plain carrier of the wave type in the argument, whose harmonics reach
+// the Nyquist frequency on high notes; alias_db from aliasDb
+static void BM_WaveAlias(benchmark::State &state) {
+  wavetype wave = (wavetype)state.range(0);
+  HostPatch patch;
+  initPatch(patch);
+  for (int op = 0; op < 4; op++) {
+    patch.config.wave[op] = wave;
+    patch.config.level[op] = op == 3 ? 99 : 0;
+  }
+
+  BenchDexed fm(_MAX_NOTES);
+  fm.loadConfig(patch.config);
+  fm.setAlgorithm(patch.engineAlgorithm());
+  for (int i = 0; i < 4; i++)
+    fm.keydown(60 + 7 * i, 100);
+
+  int16_t buffer[BENCH_BLOCK];
+  for (auto _ : state) {
+    fm.getSamples(BENCH_BLOCK, buffer);
+    benchmark::ClobberMemory();
+  }
+  state.SetLabel(wavenames[wave]);
+  perSample(state, BENCH_BLOCK);
+  state.counters["alias_db"] = aliasDb(patch, 108, 1);
+  state.counters["alias_db_high"] = aliasDb(patch, 120, 1);
+}
+
+BENCHMARK(BM_WaveAlias)->Arg(TRI)->Arg(SQR);
+
+BENCHMARK_MAIN();
@@ -0,0 +1,197 @@
+/*
+   clfm_render - offline renderer for the CLFM engine
+
+   Plays a Standard MIDI File (or a single test note) through Dexed with a
+   patch file loaded and writes the result to a mono WAV file as fast as
+   the engine allows. MIDI handling follows the sketch in MIDI mode: note
+   on/off with MIDI_NOTE_OFFSET applied and pitch bend of up to
+   PITCH_BEND_RANGE.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "dexed.h"
+#include "patch_file.h"
+#include "midi_file.h"
+#include "wav_file.h"
+
+#define POLYPHONY 16
+#define MIDI_NOTE_OFFSET 24
+#define PITCH_BEND_RANGE ((1 << 24) / 12)
+#define MAX_CHUNK 4096
+
+class OfflineDexed : public Dexed {
+  public:
+    OfflineDexed(uint8_t max_notes, int rate) : Dexed(max_notes, rate) {}
+    using Dexed::getSamples;
+};
+
+static void usage() {
+  fprintf(stderr,
+    "usage: clfm_render [options] -o out.wav [file.mid]\n"
+    "  -o file     output WAV file\n"
+    "  -p file     patch file (default: init patch)\n"
+    "  -f format   16, 24 or float (default 16)\n"
+    "  -r rate     sample rate (default 44100)\n"
+    "  -O factor   render the voices oversampled 1, 2 or 4 times (default 1)\n"
+    "  -v voices   polyphony (default %d)\n"
+    "  -j threads  render the voices on this many threads (default 1)\n"
+    "  -t seconds  maximum release tail after the last event (default 10)\n"
+    "  -n note     without a MIDI file, play this MIDI note (default 60)\n"
+    "  -d seconds  length of that note (default 1)\n"
+    "  -V velocity velocity of that note (default 100)\n"
+    "  -w file     write the init patch to file and exit\n", POLYPHONY);
+}
+
+// Queues a MIDI event to play at sample time; false if the queue is full.
+// Dexed plays it at the start of the block it falls in (see
+// Dexed::queueKeydown), so up to a block early.
+static bool dispatch(OfflineDexed &fm, const MidiEvent &ev, uint32_t time) {
+  switch (ev.status & 0xf0) {
+    case 0x90:
+      return fm.queueKeydown(time, (int16_t)ev.data1 + MIDI_NOTE_OFFSET, ev.data2);
+    case 0x80:
+      return fm.queueKeyup(time, (int16_t)ev.data1 + MIDI_NOTE_OFFSET);
+    case 0xe0:
+    {
+      int pitch = ((ev.data2 << 7) | ev.data1) - 8192;
+      return fm.queuePitchBend(time, (int64_t)pitch * PITCH_BEND_RANGE / 8192);
+    }
+  }
+  return true;
+}
+
+int main(int argc, char **argv) {
+  const char *outpath = NULL;
+  const char *patchpath = NULL;
+  WavFormat format = WAV_PCM16;
+  int rate = 44100;
+  int voices = POLYPHONY;
+  int threads = 1;
+  int oversampling = 1;
+  double tail = 10;
+  int testnote = 60;
+  double testlength = 1;
+  int testvelocity = 100;
+
+  HostPatch patch;
+  initPatch(patch);
+
+  int c;
+  while ((c = getopt(argc, argv, "o:p:f:r:O:v:j:t:n:d:V:w:h")) != -1) {
+    switch (c) {
+      case 'o': outpath = optarg; break;
+      case 'p': patchpath = optarg; break;
+      case 'f':
+        if (!strcmp(optarg, "16")) format = WAV_PCM16;
+        else if (!strcmp(optarg, "24")) format = WAV_PCM24;
+        else if (!strcmp(optarg, "float")) format = WAV_FLOAT32;
+        else {
+          fprintf(stderr, "unknown format '%s'\n", optarg);
+          return 1;
+        }
+        break;
+      case 'r': rate = atoi(optarg); break;
+      case 'O': oversampling = atoi(optarg); break;
+      case 'v': voices = atoi(optarg); break;
+      case 'j': threads = atoi(optarg); break;
+      case 't': tail = atof(optarg); break;
+      case 'n': testnote = atoi(optarg); break;
+      case 'd': testlength = atof(optarg); break;
+      case 'V': testvelocity = atoi(optarg); break;
+      case 'w':
+        if (!savePatch(optarg, patch)) {
+          fprintf(stderr, "cannot write %s\n", optarg);
+          return 1;
+        }
+        return 0;
+      default:
+        usage();
+        return c == 'h' ? 0 : 1;
+    }
+  }
+  if (!outpath || optind < argc - 1 || rate <= 0 || voices < 1 || voices > _MAX_NOTES ||
+      threads < 1 || threads > 64 || (oversampling != 1 && oversampling != 2 && oversampling != 4)) {
+    usage();
+    return 1;
+  }
+
+  std::string error;
+  if (patchpath && !loadPatch(patchpath, patch, error)) {
+    fprintf(stderr, "%s\n", error.c_str());
+    return 1;
+  }
+
+  std::vector<MidiEvent> events;
+  if (optind < argc) {
+    if (!readMidiFile(argv[optind], events, error)) {
+      fprintf(stderr, "%s: %s\n", argv[optind], error.c_str());
+      return 1;
+    }
+  } else {
+    events.push_back(MidiEvent { 0.0, 0x90, (uint8_t)testnote, (uint8_t)testvelocity });
+    events.push_back(MidiEvent { testlength, 0x80, (uint8_t)testnote, 0 });
+  }
+
+  OfflineDexed fm(voices, rate);
+  fm.loadConfig(patch.config);
+  fm.setAlgorithm(patch.engineAlgorithm());
+  fm.setRenderThreads(threads);
+  fm.setOversampling(oversampling);
+
+  // Events are queued at their sample times, a chunk ahead of rendering.
+  // Rendering stops at the block of the last one, then plays out the tail.
+  std::vector<size_t> eventpos(events.size());
+  for (size_t i = 0; i < events.size(); i++)
+    eventpos[i] = (size_t)(events[i].time * rate);
+
+  size_t lastevent = events.empty() ? 0 : (eventpos.back() >> LG_N) << LG_N;
+  size_t maxlength = lastevent + (((size_t)(tail * rate) + _N_ - 1) & ~(size_t)(_N_ - 1));
+  std::vector<float> out(maxlength);
+
+  auto start = std::chrono::steady_clock::now();
+
+  size_t pos = 0;
+  size_t ev = 0;
+  while (pos < maxlength) {
+    if (ev == events.size() && pos > lastevent && fm.isIdle())
+      break;
+
+    // up to the last event, then the tail a chunk at a time until it is idle
+    size_t n = min(maxlength - pos, (size_t)MAX_CHUNK);
+    if (pos < lastevent)
+      n = min(n, lastevent - pos);
+    for (; ev < events.size() && eventpos[ev] < pos + n; ev++) {
+      if (!dispatch(fm, events[ev], (uint32_t)eventpos[ev])) {
+        // The queue is full, so render up to the block this event falls
+        // in and queue the rest before it plays. If that block has already
+        // started (more events in it than the queue holds), render one
+        // block to drain the queue; the rest then play a block late.
+        size_t blockstart = (eventpos[ev] >> LG_N) << LG_N;
+        n = blockstart > pos ? blockstart - pos : _N_;
+        break;
+      }
+    }
+
+    fm.getSamples((uint16_t)n, out.data() + pos);
+    pos += n;
+  }
+
+  double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  double seconds = (double)pos / rate;
+
+  if (!writeWavFile(outpath, out.data(), pos, rate, format)) {
+    fprintf(stderr, "cannot write %s\n", outpath);
+    return 1;
+  }
+
+  printf("Rendered %.2f s of audio in %.3f s (%.1fx real time)\n",
+         seconds, elapsed, elapsed > 0 ? seconds / elapsed : 0.0);
+  return 0;
+}
@@ -0,0 +1,212 @@
+/*
+   clfm_test - checks of the CLFM engine for ctest
+
+   Runs the checks named on the command line, or all of them, printing
+   what each measured. Exits non-zero if any is out of bounds.
+
+     clfm_test kernel
+*/
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "platform.h"
+#include "engine_checks.h"
+
+static const char *wavenames[] = {"sin", "tri", "sqr", "sinfld", "trifld"};
+
+static bool expect(bool ok, const char *format, ...) {
+  va_list args;
+  va_start(args, format);
+  printf("%s ", ok ? "  ok  " : "  FAIL");
+  vprintf(format, args);
+  printf("\n");
+  va_end(args);
+  return ok;
+}
+
+// compute and compute_pure are bit exact against the scalar kernels, for
+// every wave type and, for the folding ones, either sign of fold
+static bool testKernel() {
+  static const int16_t folds[] = { 0, 64, MAXFOLDPARAM, -64, -MAXFOLDPARAM };
+  bool ok = true;
+  printf("%s kernels\n", FmOpKernel::simd_name());
+  for (int wave = SIN; wave <= TRIFOLD; wave++) {
+    bool folding = wave == SINFOLD || wave == TRIFOLD;
+    for (int f = 0; f < (folding ? 5 : 1); f++) {
+      for (int pure = 0; pure < 2; pure++) {
+        int mismatches = kernelMismatches((wavetype)wave, folds[f], pure);
+        ok &= expect(mismatches == 0, "%s fold %d %s: %d mismatches", wavenames[wave],
+                     folds[f], pure ? "compute_pure" : "compute", mismatches);
+      }
+    }
+  }
+  return ok;
+}
+
+// Fold::apply is within FOLD_MAX_ERROR (Q24, two parts in a million of
+// full scale) of the floating point fold it replaced, at every amount but
+// 0, which does not fold
+#define FOLD_MAX_ERROR 32
+
+static bool testFold() {
+  bool ok = true;
+  for (int fold = -MAXFOLDPARAM; fold <= MAXFOLDPARAM; fold += 8) {
+    if (fold == 0)
+      continue;
+    int32_t err = foldMaxError(fold);
+    ok &= expect(err <= FOLD_MAX_ERROR, "fold %d: max error %d", fold, err);
+  }
+  return ok;
+}
+
+// note_logfreq plus the cached osc_ratio gives the same operator pitches
+// as osc_freq did, and the snapshot's detune table stays close to it
+static bool testPitch() {
+  int mismatches = pitchMismatches();
+  return expect(mismatches == 0, "%d mismatches", mismatches);
+}
+
+// Rendering voices a lane each gives the same output as one at a time
+static bool testBatch() {
+  int mismatches = batchMismatches();
+  return expect(mismatches == 0, "%d mismatches", mismatches);
+}
+
+// The int32 voice mix is exact at full polyphony, and both output formats
+// are taken from it
+static bool testMix() {
+  int mismatches = mixMismatches();
+  return expect(mismatches == 0, "%d mismatches", mismatches);
+}
+
+// Rendering on a thread pool gives the same output as a single thread
+static bool testThreads() {
+  bool ok = true;
+  for (int threads = 2; threads <= 8; threads *= 2) {
+    int mismatches = threadMismatches(threads);
+    ok &= expect(mismatches == 0, "%d threads: %d mismatches", threads, mismatches);
+  }
+  return ok;
+}
+
+// A new config snapshot sounds the same as a full refresh of the voices
+static bool testConfig() {
+  int mismatches = configMismatches();
+  return expect(mismatches == 0, "%d mismatches", mismatches);
+}
+
+// Queued parameter changes, and a patch load queued behind one, sound the
+// same as a full refresh
+static bool testParams() {
+  int mismatches = paramMismatches();
+  return expect(mismatches == 0, "%d mismatches", mismatches);
+}
+
+// Queued notes start in the engine block they are due in, where notes
+// keyed between getSamples calls can be a whole call out
+static bool testEvents() {
+  int error = onsetError(true);
+  return expect(error < _N_, "queued notes up to %d samples from their time (block %d)", error, _N_);
+}
+
+// Oversampling a high folded note cuts its aliasing by at least
+// OVERSAMPLING_GAIN dB at 4x, rendering it on threads is unchanged, and
+// the rate of one Dexed does not change how another one sounds
+#define OVERSAMPLING_GAIN 12
+
+static bool testOversampling() {
+  HostPatch patch;
+  initPatch(patch);
+  patch.config.fold = true;
+  for (int op = 0; op < 4; op++) {
+    patch.config.wave[op] = SINFOLD;
+    patch.config.fine[op] = 40;
+  }
+
+  bool ok = true;
+  double alias[5];
+  for (int oversampling = 1; oversampling <= 4; oversampling *= 2) {
+    int mismatches = threadMismatches(4, oversampling);
+    alias[oversampling] = aliasDb(patch, 108, oversampling);
+    ok &= expect(mismatches == 0, "%dx: %d mismatches on 4 threads, aliasing %.1f dB",
+                 oversampling, mismatches, alias[oversampling]);
+  }
+  ok &= expect(alias[2] < alias[1], "2x aliases less than 1x");
+  ok &= expect(alias[4] < alias[1] - OVERSAMPLING_GAIN, "4x aliases at least %d dB less than 1x",
+               OVERSAMPLING_GAIN);
+  int mismatches = rateMismatches();
+  ok &= expect(mismatches == 0, "%d mismatches next to other rates", mismatches);
+  return ok;
+}
+
+// A plain triangle or square carrier aliases at least WAVE_ALIAS_DB below
+// its level on high notes, and every band-limited table level has the same
+// fundamental, so a note does not change level from one octave to the next
+#define WAVE_ALIAS_DB 80
+#define WAVE_LEVEL_SPREAD 0.01
+
+static bool testWaves() {
+  const wavetype waves[] = { TRI, SQR };
+  bool ok = true;
+  for (wavetype wave : waves) {
+    HostPatch patch;
+    initPatch(patch);
+    for (int op = 0; op < 4; op++) {
+      patch.config.wave[op] = wave;
+      patch.config.level[op] = op == 3 ? 99 : 0;
+    }
+    for (int note = 108; note <= 120; note += 12) {
+      double alias = aliasDb(patch, note, 1);
+      ok &= expect(alias < -WAVE_ALIAS_DB, "%s note %d: aliasing %.1f dB",
+                   wavenames[wave], note, alias);
+    }
+    double spread = levelSpreadDb(wave);
+    ok &= expect(spread < WAVE_LEVEL_SPREAD, "%s: fundamental within %.4f dB over the table levels",
+                 wavenames[wave], spread);
+  }
+  return ok;
+}
+
+static const struct {
+  const char *name;
+  bool (*run)();
+} tests[] = {
+  { "kernel", testKernel },
+  { "fold", testFold },
+  { "pitch", testPitch },
+  { "batch", testBatch },
+  { "mix", testMix },
+  { "threads", testThreads },
+  { "config", testConfig },
+  { "params", testParams },
+  { "events", testEvents },
+  { "oversampling", testOversampling },
+  { "waves", testWaves },
+};
+
+#define N_TESTS ((int)(sizeof(tests) / sizeof(tests[0])))
+
+int main(int argc, char **argv) {
+  bool ok = true;
+  for (int i = 1; i < argc; i++) {
+    int t = 0;
+    while (t < N_TESTS && strcmp(argv[i], tests[t].name) != 0)
+      t++;
+    if (t == N_TESTS) {
+      fprintf(stderr, "clfm_test: no check called %s\n", argv[i]);
+      return 2;
+    }
+  }
+  for (int t = 0; t < N_TESTS; t++) {
+    bool run = argc == 1;
+    for (int i = 1; i < argc; i++)
+      run |= strcmp(argv[i], tests[t].name) == 0;
+    if (run) {
+      printf("%s\n", tests[t].name);
+      ok &= tests[t].run();
+    }
+  }
+  return ok ? 0 : 1;
+}
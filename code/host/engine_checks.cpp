@@ -0,0 +1,428 @@
+/*
+   Checks of the CLFM engine against its reference implementations.
+*/
+
+#include <math.h>
+#include <stdlib.h>
+#include <initializer_list>
+
+#include "engine_checks.h"
+#include "freqlut.h"
+#include "wavetables.h"
+
+// Renders test and ref n samples at a time, after step(block) has played
+// or changed whatever the block needs on them, and counts the samples
+// where they differ. n is at most CHECK_RENDER_BLOCK.
+template<typename Step>
+static int lockstepMismatches(CheckDexed &test, CheckDexed &ref, int blocks, int n, Step step) {
+  static float out[CHECK_RENDER_BLOCK], expected[CHECK_RENDER_BLOCK];
+  int mismatches = 0;
+  for (int block = 0; block < blocks; block++) {
+    step(block);
+    test.getSamples(n, out);
+    ref.getSamples(n, expected);
+    for (int i = 0; i < n; i++)
+      mismatches += out[i] != expected[i];
+  }
+  return mismatches;
+}
+
+int kernelMismatches(wavetype wave, int16_t fold, bool pure) {
+  srand(1);
+  int mismatches = 0;
+  AlignedBuf<int32_t, _N_> input, out, ref;
+  for (int block = 0; block < 1000; block++) {
+    int32_t phase = (uint32_t)rand() << 8;
+    int32_t freq = rand() % (1 << 24);
+    int32_t gain1 = rand() % (1 << 25);
+    int32_t gain2 = rand() % (1 << 25);
+    bool add = block & 1;
+    for (int i = 0; i < _N_; i++) {
+      input.get()[i] = (uint32_t)(rand() - RAND_MAX / 2) << 4;
+      out.get()[i] = ref.get()[i] = rand();
+    }
+    if (pure) {
+      FmOpKernel::compute_pure(out.get(), phase, freq, wave, fold, gain1, gain2, add);
+      FmOpKernel::compute_pure_scalar(ref.get(), phase, freq, wave, fold, gain1, gain2, add);
+    } else {
+      FmOpKernel::compute(out.get(), input.get(), phase, freq, wave, fold, gain1, gain2, add);
+      FmOpKernel::compute_scalar(ref.get(), input.get(), phase, freq, wave, fold, gain1, gain2, add);
+    }
+    for (int i = 0; i < _N_; i++)
+      mismatches += out.get()[i] != ref.get()[i];
+  }
+  return mismatches;
+}
+
+int32_t foldMaxError(int16_t fold) {
+  int32_t gain = Fold::gain(fold);
+  float foldamount = MAXFOLD * fold / 200.0;
+  int32_t max_err = 0;
+  for (int32_t v = -(1 << 24); v <= (1 << 24); v += 61) {
+    int32_t err = abs(Fold::apply(v, gain) - Fold::reference(v, foldamount));
+    max_err = max(max_err, err);
+  }
+  return max_err;
+}
+
+// osc_freq in ratio mode as it was before the operator offsets were
+// cached, with coarse from the same table
+static int32_t referenceFreq(float midinote, int coarse, int fine, int detune) {
+  const int32_t base = 50857777;
+  const int32_t step = (1 << 24) / 12;
+  int rounded = (int)midinote;
+  int32_t logfreq = base + step * rounded;
+  float f = midinote - (int)midinote;
+  if (f > 0)
+    logfreq += f * step;
+  if (detune) {
+    float detuneRatio = 0.0209 * expf(-0.396 * (((float)logfreq) / (1 << 24))) / 7;
+    logfreq += detuneRatio * logfreq * detune;
+  }
+  logfreq += osc_ratio(coarse, 0);
+  if (fine)
+    logfreq += (int32_t)floor(24204406.323123 * logf(1 + 0.01 * fine) + 0.5);
+  return logfreq;
+}
+
+// Q24 log frequency, about 0.02 cents
+#define PITCH_TOLERANCE 256
+
+int pitchMismatches() {
+  int mismatches = 0;
+  for (int coarse = 0; coarse < 31; coarse++)
+    for (int fine = -99; fine <= 99; fine += 11)
+      for (int detune = -49; detune <= 49; detune += 7)
+        for (float note = 0; note < 128; note += 0.5f)
+          mismatches += note_logfreq(note, detune) + osc_ratio(coarse, fine) !=
+                        referenceFreq(note, coarse, fine, detune);
+  // the snapshot's interpolated detune: exact for whole notes, and within
+  // PITCH_TOLERANCE between them
+  for (int detune = -49; detune <= 49; detune++) {
+    ConfigSnapshot snapshot;
+    snapshot.config = configStruct();
+    snapshot.config.detune = detune;
+    snapshot.derive();
+    for (float note = 0; note < 128; note += 1.0f / 16) {
+      int32_t err = abs(snapshot.noteLogfreq(note) - note_logfreq(note, detune));
+      mismatches += note == (int)note ? err != 0 : err > PITCH_TOLERANCE;
+    }
+  }
+  return mismatches;
+}
+
+int batchMismatches() {
+  int mismatches = 0;
+  for (int algorithm = 0; algorithm < 2 * N_ALGS; algorithm++) {
+    HostPatch patch;
+    initPatch(patch);
+    for (int op = 0; op < 4; op++) {
+      patch.config.wave[op] = (wavetype)((algorithm + op) % 5);
+      patch.config.fine[op] = 40 * op - 60;
+      patch.config.env[op].r = 20 + 10 * op;
+    }
+    patch.config.fold = algorithm & 1;
+    patch.config.feedback = algorithm & 2 ? -80 : 80;
+
+    CheckDexed batched(_MAX_NOTES), single(_MAX_NOTES);
+    batched.loadConfig(patch.config);
+    single.loadConfig(patch.config);
+    single.setVoiceBatching(false);
+    batched.setAlgorithm(algorithm);
+    single.setAlgorithm(algorithm);
+    mismatches += lockstepMismatches(batched, single, 200, CHECK_BLOCK, [&](int block) {
+      for (CheckDexed *fm : { &batched, &single }) {
+        if (block % 10 == 0 && block < 120)
+          fm->keydown(40 + block / 2, 60 + block / 4);
+        if (block % 20 == 15)
+          fm->keyup(40 + (block - 15) / 2);
+      }
+    });
+  }
+  return mismatches;
+}
+
+// Output samples compared by mixMismatches
+#define MIX_CHECK_SAMPLES (8 * CHECK_BLOCK)
+
+int mixMismatches() {
+  HostPatch patch;
+  initPatch(patch);
+  // every operator a full level carrier
+  patch.config.algorithm = N_ALGS - 1;
+  for (int op = 0; op < 4; op++) {
+    patch.config.level[op] = 99;
+    patch.config.fine[op] = 7 * op;
+  }
+
+  static float out[MIX_CHECK_SAMPLES], single[MIX_CHECK_SAMPLES];
+  static double sum[MIX_CHECK_SAMPLES];
+  static int16_t out16[MIX_CHECK_SAMPLES];
+  CheckDexed poly(_MAX_NOTES), poly16(_MAX_NOTES);
+  poly.loadConfig(patch.config);
+  poly16.loadConfig(patch.config);
+  poly.setAlgorithm(patch.engineAlgorithm());
+  poly16.setAlgorithm(patch.engineAlgorithm());
+  for (int i = 0; i < MIX_CHECK_SAMPLES; i++)
+    sum[i] = 0;
+  for (int v = 0; v < _MAX_NOTES; v++) {
+    poly.keydown(36 + 5 * v, 127);
+    poly16.keydown(36 + 5 * v, 127);
+    CheckDexed fm(1);
+    fm.loadConfig(patch.config);
+    fm.setAlgorithm(patch.engineAlgorithm());
+    fm.keydown(36 + 5 * v, 127);
+    for (int i = 0; i < MIX_CHECK_SAMPLES; i += CHECK_BLOCK)
+      fm.getSamples(CHECK_BLOCK, single + i);
+    for (int i = 0; i < MIX_CHECK_SAMPLES; i++)
+      sum[i] += single[i];
+  }
+  for (int i = 0; i < MIX_CHECK_SAMPLES; i += CHECK_BLOCK) {
+    poly.getSamples(CHECK_BLOCK, out + i);
+    poly16.getSamples(CHECK_BLOCK, out16 + i);
+  }
+
+  int mismatches = 0;
+  for (int i = 0; i < MIX_CHECK_SAMPLES; i++) {
+    double q15 = fmin(fmax(floor(out[i] * 32768.0), -32768), 32767);
+    mismatches += fabs(out[i] - sum[i]) > 1.0 / 65536 || out16[i] != q15;
+  }
+  return mismatches;
+}
+
+int threadMismatches(int threads, int oversampling) {
+  HostPatch patch;
+  initPatch(patch);
+  patch.config.feedback = 20;
+
+  CheckDexed threaded(_MAX_NOTES), single(_MAX_NOTES);
+  threaded.loadConfig(patch.config);
+  single.loadConfig(patch.config);
+  threaded.setRenderThreads(threads);
+  threaded.setOversampling(oversampling);
+  single.setOversampling(oversampling);
+  return lockstepMismatches(threaded, single, 40, CHECK_RENDER_BLOCK, [&](int block) {
+    // splits the threaded render at these
+    uint32_t time = single.sampleClock() + 517 * block % CHECK_RENDER_BLOCK;
+    for (CheckDexed *fm : { &threaded, &single }) {
+      if (block < 24)
+        fm->keydown(40 + block, 100);
+      if (block % 3 == 2)
+        fm->keyup(40 + block - 2);
+      if (block % 5 == 1)
+        fm->setPitchBend((block - 20) * 65536);
+      if (block % 4 == 3) {
+        fm->queueKeydown(time, 90 - block, 80);
+        fm->queueKeyup(time + 1500, 90 - block);
+      }
+    }
+  });
+}
+
+// Blocks rendered by rateMismatches
+#define RATE_CHECK_BLOCKS 60
+
+int rateMismatches() {
+  HostPatch patch;
+  initPatch(patch);
+  for (int op = 0; op < 4; op++) {
+    patch.config.env[op].d = 30 + 10 * op;
+    patch.config.env[op].s = 50;
+  }
+  static float ref[RATE_CHECK_BLOCKS * CHECK_BLOCK];
+  float out[CHECK_BLOCK], other[CHECK_BLOCK];
+
+  // the reference, before there is any other Dexed
+  {
+    CheckDexed alone(_MAX_NOTES);
+    alone.loadConfig(patch.config);
+    for (int block = 0; block < RATE_CHECK_BLOCKS; block++) {
+      if (block % 10 == 0)
+        alone.keydown(48 + block / 2, 100);
+      alone.getSamples(CHECK_BLOCK, ref + block * CHECK_BLOCK);
+    }
+  }
+
+  int mismatches = 0;
+  CheckDexed fm(_MAX_NOTES);
+  fm.loadConfig(patch.config);
+  for (int block = 0; block < RATE_CHECK_BLOCKS; block++) {
+    if (block % 10 == 0)
+      fm.keydown(48 + block / 2, 100);
+    if (block == 25) {
+      // between fm's notes, and with one of them playing
+      CheckDexed oversampled(_MAX_NOTES), rate48k(_MAX_NOTES, 48000);
+      oversampled.loadConfig(patch.config);
+      rate48k.loadConfig(patch.config);
+      oversampled.setOversampling(4);
+      oversampled.keydown(60, 100);
+      rate48k.keydown(60, 100);
+      for (int i = 0; i < 4; i++) {
+        oversampled.getSamples(CHECK_BLOCK, other);
+        rate48k.getSamples(CHECK_BLOCK, other);
+      }
+    }
+    fm.getSamples(CHECK_BLOCK, out);
+    for (int i = 0; i < CHECK_BLOCK; i++)
+      mismatches += out[i] != ref[block * CHECK_BLOCK + i];
+  }
+  return mismatches;
+}
+
+// The changes configMismatches and paramMismatches make, one every
+// CHANGE_BLOCKS blocks, each to the operator op where the field is per
+// operator. The level change comes last, as a full refresh would restart
+// its glide.
+static const ParamEvent configChanges[] = {
+  { PARAM_COARSE, 0, MUL_3 },
+  { PARAM_FINE, 1, 25 },
+  { PARAM_FEEDBACK, 2, 80 },
+  { PARAM_DETUNE, 3, 30 },
+  { PARAM_FOLD, 0, 1 },
+  { PARAM_LEVEL, 1, 40 },
+};
+
+#define N_CHANGES ((int)(sizeof(configChanges) / sizeof(configChanges[0])))
+#define CHANGE_BLOCKS 6
+
+// Samples where 8 voices changed by apply(fm, change, config), config
+// being the whole patch after the change, differ from a full refresh of
+// every voice after each change in configChanges
+template<typename Apply>
+static int changeMismatches(Apply apply) {
+  HostPatch patch;
+  initPatch(patch);
+  configStruct &c = patch.config;
+
+  CheckDexed test(_MAX_NOTES), full(_MAX_NOTES);
+  test.loadConfig(c);
+  full.loadConfig(c);
+  for (int i = 0; i < 8; i++) {
+    test.keydown(48 + 5 * i, 100);
+    full.keydown(48 + 5 * i, 100);
+  }
+  return lockstepMismatches(test, full, (N_CHANGES + 1) * CHANGE_BLOCKS, CHECK_BLOCK, [&](int block) {
+    int k = block / CHANGE_BLOCKS;
+    if (block % CHANGE_BLOCKS == CHANGE_BLOCKS / 2 && k < N_CHANGES) {
+      Dexed::setField(c, configChanges[k]);
+      apply(test, configChanges[k], c);
+      full.loadConfig(c);
+      full.doRefreshVoice();
+    }
+  });
+}
+
+int configMismatches() {
+  return changeMismatches([](CheckDexed &fm, const ParamEvent &change, const configStruct &c) {
+    fm.setConfig(c);
+  });
+}
+
+int paramMismatches() {
+  return changeMismatches([](CheckDexed &fm, const ParamEvent &change, const configStruct &c) {
+    if (change.param == PARAM_DETUNE) {
+      fm.setParam(PARAM_DETUNE, 0, 99);
+      fm.setConfig(c);
+    } else {
+      fm.setParam(change.param, change.op, change.value);
+    }
+  });
+}
+
+// The first sample of a note played at time on a fresh engine, keyed in
+// the CHECK_BLOCK it falls in (direct) or queued for time
+static int onsetSample(int time, bool queued) {
+  HostPatch patch;
+  initPatch(patch);
+  CheckDexed fm(1);
+  fm.loadConfig(patch.config);
+  if (queued)
+    fm.queueKeydown(time, 60, 100);
+
+  float out[CHECK_BLOCK];
+  for (int pos = 0; pos < 8 * CHECK_BLOCK; pos += CHECK_BLOCK) {
+    if (!queued && time >= pos && time < pos + CHECK_BLOCK)
+      fm.keydown(60, 100);
+    fm.getSamples(CHECK_BLOCK, out);
+    for (int i = 0; i < CHECK_BLOCK; i++)
+      if (out[i] != 0)
+        return pos + i;
+  }
+  return -1;
+}
+
+int onsetError(bool queued) {
+  int start = onsetSample(0, queued);
+  int worst = 0;
+  for (int time = 0; time < 4 * CHECK_BLOCK; time += 7)
+    worst = max(worst, abs(onsetSample(time, queued) - start - time));
+  return worst;
+}
+
+// Samples looked at for aliasing, after the attack
+#define ALIAS_WINDOW 16384
+
+// Power of x at frequency f (cycles per sample) under a Hann window, as
+// the mean square of the sinusoid it would be (Goertzel)
+static double tonePower(const float *x, const double *w, int n, double f) {
+  double coeff = 2 * cos(2 * M_PI * f);
+  double s1 = 0, s2 = 0, wsum = 0;
+  for (int i = 0; i < n; i++) {
+    double s0 = w[i] * x[i] + coeff * s1 - s2;
+    s2 = s1;
+    s1 = s0;
+    wsum += w[i];
+  }
+  double mag2 = s1 * s1 + s2 * s2 - coeff * s1 * s2;
+  return 2 * mag2 / (wsum * wsum);
+}
+
+double aliasDb(const HostPatch &patch, int note, int oversampling) {
+  static float out[4096 + ALIAS_WINDOW];
+  static double w[ALIAS_WINDOW];
+  CheckDexed fm(1);
+  fm.loadConfig(patch.config);
+  fm.setOversampling(oversampling);
+  fm.setAlgorithm(patch.engineAlgorithm());
+  fm.keydown(note, 100);
+  fm.getSamples(4096, out);
+  fm.getSamples(ALIAS_WINDOW, out + 4096);
+  // cycles per output sample of a ratio 1 operator, from a table for the
+  // rendering rate (keydown takes TRANSPOSE_FIX off the note)
+  Freqlut freqlut;
+  freqlut.init(CHECK_SAMPLE_RATE * oversampling);
+  double f0 = freqlut.lookup(note_logfreq(note - TRANSPOSE_FIX, 0)) /
+    ((double)(1 << 24) * oversampling);
+
+  const float *x = out + 4096;
+  double total = 0, wsq = 0;
+  for (int i = 0; i < ALIAS_WINDOW; i++) {
+    w[i] = 0.5 - 0.5 * cos(2 * M_PI * i / ALIAS_WINDOW);
+    total += w[i] * w[i] * x[i] * x[i];
+    wsq += w[i] * w[i];
+  }
+  total /= wsq;
+
+  double harmonics = 0;
+  for (int k = 1; k * f0 < 0.5; k++)
+    harmonics += tonePower(x, w, ALIAS_WINDOW, k * f0);
+  return 10 * log10(fmax(total - harmonics, total * 1e-12) / total);
+}
+
+double levelSpreadDb(wavetype wave) {
+  double lo = INFINITY, hi = -INFINITY;
+  for (int level = 0; level < BL_LEVELS; level++) {
+    // the top of the level's octave of phase increments
+    int32_t freq = 1 << (23 - level);
+    const int16_t *tab = wave == SQR ? Sqr::table(freq) : Tri::table(freq);
+    double re = 0, im = 0;
+    for (int i = 0; i < SIN_N_SAMPLES; i++) {
+      re += tab[i] * cos(2 * M_PI * i / SIN_N_SAMPLES);
+      im += tab[i] * sin(2 * M_PI * i / SIN_N_SAMPLES);
+    }
+    double db = 20 * log10(2 * hypot(re, im) / (SIN_N_SAMPLES * 32768.0));
+    lo = fmin(lo, db);
+    hi = fmax(hi, db);
+  }
+  return hi - lo;
+}
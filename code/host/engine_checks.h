@@ -0,0 +1,89 @@
+/*
+   Checks of the CLFM engine against its reference implementations.
+
+   Each returns what it measured, usually the number of output samples
+   that differ from the reference, so that clfm_test can assert it and
+   clfm_bench can report it next to the timing it goes with.
+*/
+
+#ifndef ENGINE_CHECKS_H
+#define ENGINE_CHECKS_H
+
+#include "platform.h"
+#include "dexed.h"
+#include "fm_op_kernel.h"
+#include "patch_file.h"
+
+#define CHECK_SAMPLE_RATE 44100
+
+// Block size of AudioSynthDexed::update on the Teensy
+#define CHECK_BLOCK 128
+
+// Block size of clfm_render, which is where multithreaded rendering is used
+#define CHECK_RENDER_BLOCK 4096
+
+class CheckDexed : public Dexed {
+  public:
+    CheckDexed(uint8_t max_notes, int rate = CHECK_SAMPLE_RATE) : Dexed(max_notes, rate) {}
+    using Dexed::getSamples;
+};
+
+// Number of output samples where compute/compute_pure differ from the
+// scalar reference kernels, over random phases, frequencies and gains
+int kernelMismatches(wavetype wave, int16_t fold, bool pure);
+
+// The largest difference (Q24) between Fold::apply and the floating point
+// reference it replaced, over the full input range
+int32_t foldMaxError(int16_t fold);
+
+// Operator pitches from note_logfreq plus osc_ratio that differ from the
+// reference, over notes, coarse, fine and detune, plus snapshot note
+// pitches that stray from note_logfreq
+int pitchMismatches();
+
+// Samples where voice per lane rendering differs from rendering one voice
+// at a time, over every algorithm with folding, squared feedback and notes
+// released at different times.
+int batchMismatches();
+
+// Samples where the mix of 16 voices of four full level carriers is not
+// the sum of the voices rendered on their own (as it is unless the int32
+// mix overflows), or where the int16 output is not the float output
+// floored and saturated to Q15
+int mixMismatches();
+
+// Samples where rendering on a thread pool differs from a single thread,
+// with voices starting and stopping as in batchMismatches, pitch bends and
+// queued notes, rendering at oversampling times the sample rate
+int threadMismatches(int threads, int oversampling = 1);
+
+// Samples where a Dexed differs from the same notes on a Dexed of its own,
+// while others are created at another sample rate and oversampled next to
+// it, and play notes of their own
+int rateMismatches();
+
+// Samples where taking a new config snapshot differs from a full refresh
+// of every voice, for the fields where a full refresh leaves the envelopes
+// alone
+int configMismatches();
+
+// The same for queued single parameter changes. The detune goes in as a
+// whole patch load, queued after a change that it has to override.
+int paramMismatches();
+
+// The worst distance, in samples, between when a note was due and when it
+// started, relative to a note due at 0, over every offset in a block
+int onsetError(bool queued);
+
+// How far below the whole output (dB) the power that is not at a harmonic
+// of the note is, for a held note through patch (operators at whole number
+// ratios and no detune, so that the note is periodic). The note's harmonics
+// above the Nyquist frequency alias to other frequencies, so the more
+// negative the less aliasing.
+double aliasDb(const HostPatch &patch, int note, int oversampling);
+
+// The spread (dB) of the fundamental over the band-limited table levels of
+// a triangle or square, which switch as a note crosses octaves
+double levelSpreadDb(wavetype wave);
+
+#endif
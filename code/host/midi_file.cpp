@@ -0,0 +1,201 @@
+/*
+   Minimal Standard MIDI File (format 0 and 1) reader for the host tools.
+*/
+
+#include <stdio.h>
+#include <algorithm>
+
+#include "midi_file.h"
+
+namespace {
+
+struct RawEvent {
+  uint32_t tick;
+  uint32_t seq;       // file order, keeps sorting stable across tracks
+  bool tempo;
+  uint32_t usPerQuarter;
+  MidiEvent ev;
+};
+
+class Reader {
+  public:
+    Reader(const std::vector<uint8_t> &data, size_t pos, size_t end) : data_(data), pos_(pos), end_(end) {}
+
+    bool eof() const { return pos_ >= end_; }
+    size_t pos() const { return pos_; }
+
+    bool byte(uint8_t &b) {
+      if (pos_ >= end_) return false;
+      b = data_[pos_++];
+      return true;
+    }
+
+    bool peek(uint8_t &b) const {
+      if (pos_ >= end_) return false;
+      b = data_[pos_];
+      return true;
+    }
+
+    bool be(int n, uint32_t &v) {
+      v = 0;
+      for (int i = 0; i < n; i++) {
+        uint8_t b;
+        if (!byte(b)) return false;
+        v = (v << 8) | b;
+      }
+      return true;
+    }
+
+    bool varlen(uint32_t &v) {
+      v = 0;
+      for (int i = 0; i < 4; i++) {
+        uint8_t b;
+        if (!byte(b)) return false;
+        v = (v << 7) | (b & 0x7f);
+        if (!(b & 0x80)) return true;
+      }
+      return false;
+    }
+
+    bool skip(uint32_t n) {
+      if (end_ - pos_ < n) return false;
+      pos_ += n;
+      return true;
+    }
+
+  private:
+    const std::vector<uint8_t> &data_;
+    size_t pos_;
+    size_t end_;
+};
+
+bool readTrack(Reader &r, std::vector<RawEvent> &raw, uint32_t &seq) {
+  uint32_t tick = 0;
+  uint8_t running = 0;
+  while (!r.eof()) {
+    uint32_t delta;
+    uint8_t status;
+    if (!r.varlen(delta) || !r.peek(status)) return false;
+    tick += delta;
+    if (status & 0x80) {
+      r.byte(status);
+    } else {
+      if (!running) return false;
+      status = running;
+    }
+
+    if (status == 0xff) {
+      uint8_t type;
+      uint32_t len;
+      if (!r.byte(type) || !r.varlen(len)) return false;
+      if (type == 0x51 && len == 3) {
+        RawEvent e = {};
+        e.tick = tick;
+        e.seq = seq++;
+        e.tempo = true;
+        if (!r.be(3, e.usPerQuarter)) return false;
+        raw.push_back(e);
+      } else if (type == 0x2f) {
+        return r.skip(len);
+      } else if (!r.skip(len)) {
+        return false;
+      }
+      running = 0;
+    } else if (status == 0xf0 || status == 0xf7) {
+      uint32_t len;
+      if (!r.varlen(len) || !r.skip(len)) return false;
+      running = 0;
+    } else if (status >= 0xf0) {
+      // system common/realtime messages are not valid in a file
+      return false;
+    } else {
+      RawEvent e = {};
+      e.tick = tick;
+      e.seq = seq++;
+      e.ev.status = status;
+      uint8_t type = status & 0xf0;
+      if (!r.byte(e.ev.data1)) return false;
+      if (type != 0xc0 && type != 0xd0 && !r.byte(e.ev.data2)) return false;
+      raw.push_back(e);
+      running = status;
+    }
+  }
+  return true;
+}
+
+}  // namespace
+
+bool readMidiFile(const char *path, std::vector<MidiEvent> &events, std::string &error) {
+  FILE *f = fopen(path, "rb");
+  if (!f) {
+    error = std::string("cannot open ") + path;
+    return false;
+  }
+  std::vector<uint8_t> data;
+  uint8_t chunk[4096];
+  size_t n;
+  while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0)
+    data.insert(data.end(), chunk, chunk + n);
+  fclose(f);
+
+  Reader hdr(data, 0, data.size());
+  uint32_t magic, len, format, ntracks, division;
+  if (!hdr.be(4, magic) || magic != 0x4d546864 || !hdr.be(4, len) || len < 6 ||
+      !hdr.be(2, format) || !hdr.be(2, ntracks) || !hdr.be(2, division) || !hdr.skip(len - 6)) {
+    error = "not a standard MIDI file";
+    return false;
+  }
+  if (division == 0 || ((division & 0x8000) && (division & 0xff) == 0)) {
+    error = "invalid MIDI time division";
+    return false;
+  }
+  if (format > 1) {
+    error = "only format 0 and 1 MIDI files are supported";
+    return false;
+  }
+
+  std::vector<RawEvent> raw;
+  uint32_t seq = 0;
+  size_t pos = hdr.pos();
+  for (uint32_t t = 0; t < ntracks; t++) {
+    Reader r(data, pos, data.size());
+    if (!r.be(4, magic) || !r.be(4, len) || !r.skip(len)) {
+      error = "truncated MIDI file";
+      return false;
+    }
+    pos = r.pos();
+    if (magic != 0x4d54726b)
+      continue;  // unknown chunk type, skip it
+    Reader track(data, pos - len, pos);
+    if (!readTrack(track, raw, seq)) {
+      error = "corrupt track " + std::to_string(t);
+      return false;
+    }
+  }
+
+  std::sort(raw.begin(), raw.end(), [](const RawEvent &a, const RawEvent &b) {
+    return a.tick != b.tick ? a.tick < b.tick : a.seq < b.seq;
+  });
+
+  // SMPTE division gives a fixed number of ticks per second
+  bool smpte = (division & 0x8000) != 0;
+  double secondsPerTick = smpte ?
+    1.0 / ((-(int8_t)(division >> 8)) * (division & 0xff)) :
+    0.5 / division;  // 120 bpm until the first tempo event
+  double time = 0;
+  uint32_t lastTick = 0;
+
+  events.clear();
+  for (size_t i = 0; i < raw.size(); i++) {
+    time += (raw[i].tick - lastTick) * secondsPerTick;
+    lastTick = raw[i].tick;
+    if (raw[i].tempo) {
+      if (!smpte)
+        secondsPerTick = raw[i].usPerQuarter * 1e-6 / division;
+    } else {
+      raw[i].ev.time = time;
+      events.push_back(raw[i].ev);
+    }
+  }
+  return true;
+}
@@ -0,0 +1,25 @@
+/*
+   Minimal Standard MIDI File (format 0 and 1) reader for the host tools.
+
+   All tracks are merged into a single list of channel messages ordered by
+   time, with the tempo map already applied. Meta and sysex events are
+   dropped.
+*/
+
+#ifndef MIDI_FILE_H
+#define MIDI_FILE_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+struct MidiEvent {
+  double time;      // seconds from the start of the file
+  uint8_t status;
+  uint8_t data1;
+  uint8_t data2;
+};
+
+bool readMidiFile(const char *path, std::vector<MidiEvent> &events, std::string &error);
+
+#endif
@@ -0,0 +1,162 @@
+/*
+   Plain text serialisation of configStruct for the host tools.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sstream>
+#include <fstream>
+
+#include "patch_file.h"
+
+static const char *wavenames[] = {"sin", "tri", "sqr", "sinfld", "trifld"};
+
+static const char *coarsenames[] = {
+  "1/128", "1/96", "1/64", "1/48", "1/32", "1/24", "1/16", "1/12", "1/8", "1/7", "1/6", "1/5", "1/4", "1/3", "1/2",
+  "1", "2", "3", "4", "5", "6", "7", "8", "9", "10", "11", "12", "13", "14", "15", "16"};
+
+#define N_COARSE ((int)(sizeof(coarsenames) / sizeof(coarsenames[0])))
+#define COARSE_UNITY 15  // index into coarsemul (see dx7note.cpp) for a ratio of 1
+
+void initPatch(HostPatch &patch) {
+  configStruct &c = patch.config;
+  memset(&c, 0, sizeof(c));
+  c.algorithm = 0;
+  for (int op = 0; op < 4; op++) {
+    c.coarse[op] = (coarseAdj)COARSE_UNITY;
+    c.fine[op] = 0;
+    c.wave[op] = SIN;
+    c.env[op].a = 0;
+    c.env[op].d = 60;
+    c.env[op].s = 99;
+    c.env[op].r = 10;
+    c.env[op].scaled_s = 0;
+    c.env[op].drone = false;
+    c.level[op] = op == 3 ? 99 : 70;
+    c.scale[op] = 1;
+  }
+  c.detune = 0;
+  c.feedback = 50;
+  c.sync = false;
+  c.fold = false;
+  patch.feedback2 = false;
+}
+
+static int lookupName(const std::string &s, const char **names, int n) {
+  for (int i = 0; i < n; i++) {
+    if (s == names[i])
+      return i;
+  }
+  return -1;
+}
+
+bool loadPatch(const char *path, HostPatch &patch, std::string &error) {
+  std::ifstream in(path);
+  if (!in) {
+    error = std::string("cannot open ") + path;
+    return false;
+  }
+  initPatch(patch);
+  configStruct &c = patch.config;
+
+  std::string line;
+  int lineno = 0;
+  while (std::getline(in, line)) {
+    lineno++;
+    size_t hash = line.find('#');
+    if (hash != std::string::npos)
+      line.erase(hash);
+    std::istringstream ls(line);
+    std::string key;
+    if (!(ls >> key))
+      continue;
+
+    bool ok = true;
+    if (key == "algorithm") {
+      int a;
+      ok = (ls >> a) && a >= 1 && a <= N_ALGS;
+      if (ok) c.algorithm = a - 1;
+    } else if (key == "feedback_op") {
+      int op;
+      ok = (ls >> op) && (op == 2 || op == 4);
+      if (ok) patch.feedback2 = op == 2;
+    } else if (key == "coarse") {
+      for (int op = 0; op < 4 && ok; op++) {
+        std::string s;
+        int k = (ls >> s) ? lookupName(s, coarsenames, N_COARSE) : -1;
+        ok = k >= 0;
+        if (ok) c.coarse[op] = (coarseAdj)k;
+      }
+    } else if (key == "fine") {
+      for (int op = 0; op < 4 && ok; op++)
+        ok = (bool)(ls >> c.fine[op]);
+    } else if (key == "wave") {
+      for (int op = 0; op < 4 && ok; op++) {
+        std::string s;
+        int w = (ls >> s) ? lookupName(s, wavenames, 5) : -1;
+        ok = w >= 0;
+        if (ok) c.wave[op] = (wavetype)w;
+      }
+    } else if (key == "env") {
+      int op, drone;
+      envvals e;
+      ok = (ls >> op >> e.a >> e.d >> e.s >> e.r >> drone) && op >= 0 && op < 4;
+      if (ok) {
+        e.scaled_s = c.env[op].scaled_s;
+        e.drone = drone != 0;
+        c.env[op] = e;
+      }
+    } else if (key == "level") {
+      for (int op = 0; op < 4 && ok; op++)
+        ok = (bool)(ls >> c.level[op]);
+    } else if (key == "scale") {
+      for (int op = 0; op < 4 && ok; op++)
+        ok = (bool)(ls >> c.scale[op]);
+    } else if (key == "detune") {
+      ok = (bool)(ls >> c.detune);
+    } else if (key == "feedback") {
+      ok = (bool)(ls >> c.feedback);
+    } else if (key == "sync") {
+      int v;
+      ok = (bool)(ls >> v);
+      if (ok) c.sync = v != 0;
+    } else if (key == "fold") {
+      int v;
+      ok = (bool)(ls >> v);
+      if (ok) c.fold = v != 0;
+    } else {
+      error = std::string(path) + ":" + std::to_string(lineno) + ": unknown key '" + key + "'";
+      return false;
+    }
+    if (!ok) {
+      error = std::string(path) + ":" + std::to_string(lineno) + ": bad value for '" + key + "'";
+      return false;
+    }
+  }
+  return true;
+}
+
+bool savePatch(const char *path, const HostPatch &patch) {
+  FILE *f = fopen(path, "w");
+  if (!f)
+    return false;
+  const configStruct &c = patch.config;
+  fprintf(f, "# CLFM patch - per operator values are in engine order (op 4, 3, 2, 1)\n");
+  fprintf(f, "algorithm %d\n", c.algorithm + 1);
+  fprintf(f, "feedback_op %d\n", patch.feedback2 ? 2 : 4);
+  fprintf(f, "coarse %s %s %s %s\n", coarsenames[c.coarse[0]], coarsenames[c.coarse[1]],
+          coarsenames[c.coarse[2]], coarsenames[c.coarse[3]]);
+  fprintf(f, "fine %d %d %d %d\n", c.fine[0], c.fine[1], c.fine[2], c.fine[3]);
+  fprintf(f, "wave %s %s %s %s\n", wavenames[c.wave[0]], wavenames[c.wave[1]],
+          wavenames[c.wave[2]], wavenames[c.wave[3]]);
+  for (int op = 0; op < 4; op++)
+    fprintf(f, "env %d %d %d %d %d %d\n", op, c.env[op].a, c.env[op].d, c.env[op].s, c.env[op].r, c.env[op].drone);
+  fprintf(f, "level %d %d %d %d\n", c.level[0], c.level[1], c.level[2], c.level[3]);
+  fprintf(f, "scale %g %g %g %g\n", c.scale[0], c.scale[1], c.scale[2], c.scale[3]);
+  fprintf(f, "detune %d\n", c.detune);
+  fprintf(f, "feedback %d\n", c.feedback);
+  fprintf(f, "sync %d\n", c.sync);
+  fprintf(f, "fold %d\n", c.fold);
+  return fclose(f) == 0;
+}
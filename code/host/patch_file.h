@@ -0,0 +1,41 @@
+/*
+   Plain text serialisation of configStruct for the host tools.
+
+   A patch file is a list of "key value..." lines, '#' starts a comment.
+   Per operator values are given in configStruct order, ie index 0 is the
+   operator the panel labels 4 (the dexed library indexes them in reverse).
+
+     algorithm 1          # 1..N_ALGS as shown on the panel
+     feedback_op 4        # 4 or 2 (the FEEDBACK_SW switch)
+     coarse 1 1 1 1       # 1/128 .. 1 .. 16
+     fine 0 0 0 0         # -50..50, or fold amount when fold is set
+     wave sin sin sin sin # sin tri sqr sinfld trifld
+     env 0 0 60 99 40 0   # op a d s r drone
+     level 99 70 70 70
+     scale 1 1 1 1
+     detune 0
+     feedback 50
+     sync 0
+     fold 0
+*/
+
+#ifndef PATCH_FILE_H
+#define PATCH_FILE_H
+
+#include <string>
+
+#include "../CLFM.h"
+
+struct HostPatch {
+  configStruct config;
+  bool feedback2;
+
+  // Algorithm index as passed to Dexed::setAlgorithm
+  int engineAlgorithm() const { return config.algorithm + (feedback2 ? N_ALGS : 0); }
+};
+
+void initPatch(HostPatch &patch);
+bool loadPatch(const char *path, HostPatch &patch, std::string &error);
+bool savePatch(const char *path, const HostPatch &patch);
+
+#endif
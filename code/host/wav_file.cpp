@@ -0,0 +1,76 @@
+/*
+   Mono WAV writer for the host tools.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <math.h>
+#include <string.h>
+#include <vector>
+
+#include "wav_file.h"
+
+static void put16(std::vector<uint8_t> &out, uint32_t v) {
+  out.push_back(v & 0xff);
+  out.push_back((v >> 8) & 0xff);
+}
+
+static void put32(std::vector<uint8_t> &out, uint32_t v) {
+  put16(out, v & 0xffff);
+  put16(out, v >> 16);
+}
+
+static int32_t toPCM(float v, int bits) {
+  const float scale = (float)(1 << (bits - 1));
+  long s = lrintf(v * scale);
+  long maxval = (1L << (bits - 1)) - 1;
+  return (int32_t)(s > maxval ? maxval : (s < -maxval - 1 ? -maxval - 1 : s));
+}
+
+bool writeWavFile(const char *path, const float *samples, size_t n_samples,
+                  int sample_rate, WavFormat format) {
+  int bytes = format == WAV_PCM16 ? 2 : (format == WAV_PCM24 ? 3 : 4);
+  uint32_t datasize = (uint32_t)(n_samples * bytes);
+  std::vector<uint8_t> out;
+  out.reserve(44 + datasize + 1);
+
+  out.insert(out.end(), {'R', 'I', 'F', 'F'});
+  put32(out, 36 + datasize + (datasize & 1));
+  out.insert(out.end(), {'W', 'A', 'V', 'E', 'f', 'm', 't', ' '});
+  put32(out, 16);
+  put16(out, format == WAV_FLOAT32 ? 3 : 1);  // WAVE_FORMAT_IEEE_FLOAT or PCM
+  put16(out, 1);
+  put32(out, sample_rate);
+  put32(out, sample_rate * bytes);
+  put16(out, bytes);
+  put16(out, bytes * 8);
+  out.insert(out.end(), {'d', 'a', 't', 'a'});
+  put32(out, datasize);
+
+  for (size_t i = 0; i < n_samples; i++) {
+    uint32_t v;
+    switch (format) {
+      case WAV_PCM16:
+        put16(out, (uint32_t)toPCM(samples[i], 16));
+        break;
+      case WAV_PCM24:
+        v = (uint32_t)toPCM(samples[i], 24);
+        out.push_back(v & 0xff);
+        put16(out, (v >> 8) & 0xffff);
+        break;
+      case WAV_FLOAT32:
+        static_assert(sizeof(float) == 4, "IEEE single precision float required");
+        memcpy(&v, &samples[i], 4);
+        put32(out, v);
+        break;
+    }
+  }
+  if (datasize & 1)
+    out.push_back(0);
+
+  FILE *f = fopen(path, "wb");
+  if (!f)
+    return false;
+  bool ok = fwrite(out.data(), 1, out.size(), f) == out.size();
+  return fclose(f) == 0 && ok;
+}
@@ -0,0 +1,20 @@
+/*
+   Mono WAV writer for the host tools.
+*/
+
+#ifndef WAV_FILE_H
+#define WAV_FILE_H
+
+#include <stddef.h>
+
+enum WavFormat {
+  WAV_PCM16,
+  WAV_PCM24,
+  WAV_FLOAT32
+};
+
+// Samples are full scale at +/-1.0 and are clipped for the PCM formats
+bool writeWavFile(const char *path, const float *samples, size_t n_samples,
+                  int sample_rate, WavFormat format);
+
+#endif
@@ -0,0 +1,77 @@
+/*
+   Lookup tables generated at compile time.
+
+   A ConstTable is filled by a constexpr function, so the table is data in
+   the image rather than something built with libm in the Dexed
+   constructor. It converts to a plain pointer, so table[i] and table + 1
+   work as they do for an array.
+
+   The ConstMath functions are only good enough for generating tables:
+   arguments are expected to be small (|x| <= 1 for exp, sin and cos).
+*/
+
+#ifndef __CONST_TABLE_H
+#define __CONST_TABLE_H
+
+#include <stdint.h>
+
+template<typename T, int size>
+struct ConstTable {
+  T v[size];
+
+  constexpr operator const T *() const {
+    return v;
+  }
+};
+
+namespace ConstMath {
+
+constexpr double exp(double x) {
+  double term = 1, sum = 1;
+  for (int n = 1; n < 30; n++) {
+    term *= x / n;
+    sum += term;
+  }
+  return sum;
+}
+
+// cos for n even, sin for n odd
+constexpr double taylor(double x, int n) {
+  double term = n ? x : 1, sum = term;
+  for (; n < 40; n += 2) {
+    term *= -x * x / ((n + 1) * (n + 2));
+    sum += term;
+  }
+  return sum;
+}
+
+constexpr double sin(double x) {
+  return taylor(x, 1);
+}
+
+constexpr double cos(double x) {
+  return taylor(x, 0);
+}
+
+constexpr double sqrt(double x) {
+  if (x <= 0)
+    return 0;
+  double y = x > 1 ? x : 1;
+  for (int i = 0; i < 64; i++)
+    y = 0.5 * (y + x / y);
+  return y;
+}
+
+// floor for the non negative values the generators round
+constexpr int32_t floor(double x) {
+  return (int32_t)x;
+}
+
+// to the nearest, halves away from zero
+constexpr int32_t round(double x) {
+  return x < 0 ? -(int32_t)(0.5 - x) : (int32_t)(x + 0.5);
+}
+
+}
+
+#endif
@@ -0,0 +1,58 @@
+#include "platform.h"
+
+#include "decimator.h"
+
+// Kaiser windowed half-band filters, normalised to a DC gain of exactly 1
+// (the centre tap is 1 << 30)
+static const int32_t lastTaps[14] = {
+  680298492, -218218334, 121174186, -76942571, 50998899, -33988630, 22298658,
+  -14178013, 8609315, -4907803, 2563606, -1177575, 435092, -94410
+};
+
+static const int32_t firstTaps[5] = {
+  656889324, -157498779, 46304170, -9274439, 450636
+};
+
+HalfBand::HalfBand(const int32_t *taps, int ntaps) : taps_(taps), ntaps_(ntaps) {
+  reset();
+}
+
+void HalfBand::reset() {
+  memset(buf_, 0, sizeof(buf_));
+}
+
+void HalfBand::process(const int32_t *in, int32_t *out, int n) {
+  int history = 4 * ntaps_ - 2;
+  memcpy(buf_ + history, in, n * sizeof(int32_t));
+  for (int m = 0; m < n >> 1; m++) {
+    // the centre of the window that ends at input sample 2m + 1
+    const int32_t *x = buf_ + 2 * m + 2 * ntaps_;
+    int64_t acc = (int64_t)x[0] * (1 << 30);
+    for (int j = 0; j < ntaps_; j++)
+      acc += (int64_t)taps_[j] * ((int64_t)x[-(2 * j + 1)] + x[2 * j + 1]);
+    out[m] = (int32_t)((acc + (1 << 30)) >> 31);
+  }
+  memmove(buf_, buf_ + n, history * sizeof(int32_t));
+}
+
+Decimator::Decimator() : shift_(0), first_(firstTaps, 5), last_(lastTaps, 14) {
+}
+
+void Decimator::setShift(int shift) {
+  shift_ = shift;
+  reset();
+}
+
+void Decimator::reset() {
+  first_.reset();
+  last_.reset();
+}
+
+void Decimator::process(int32_t *buf, int n) {
+  if (shift_ == 2) {
+    first_.process(buf, buf, n);
+    n >>= 1;
+  }
+  if (shift_ >= 1)
+    last_.process(buf, buf, n);
+}
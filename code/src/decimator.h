@@ -0,0 +1,60 @@
+/*
+   Decimation of the oversampled mix back to the output rate.
+
+   A half-band FIR has every other tap zero besides the centre one, which
+   is a half, and it only has to be worked out for the samples that are
+   kept: for each output sample that is one multiply per non-zero tap pair
+   on one side. Decimator chains one stage for 2x oversampling, or two for
+   4x, where the first (at 4x) can be short as everything it lets through
+   above the final passband is removed by the second.
+
+   The final stage passes 0 to 0.204 of its input rate (18 kHz at 2 x 44.1
+   kHz) within 0.0002, and attenuates 75 dB from 0.296, so aliases only
+   land above the passband. The first passes 0 to 0.125 and attenuates 68
+   dB from 0.375.
+*/
+
+#ifndef DECIMATOR_H
+#define DECIMATOR_H
+
+#include <stdint.h>
+
+#include "synth.h"
+
+#define HALFBAND_MAX_TAPS 14
+
+class HalfBand {
+  public:
+    // taps are the non-zero taps on one side of the centre, nearest first,
+    // in Q31
+    HalfBand(const int32_t *taps, int ntaps);
+
+    void reset();
+    // Halves the rate of n samples (n even, at most _N_) from in into out,
+    // which may be the same buffer
+    void process(const int32_t *in, int32_t *out, int n);
+
+  private:
+    const int32_t *taps_;
+    int ntaps_;
+    // the last 4 * ntaps - 2 input samples, then the block being decimated
+    int32_t buf_[4 * HALFBAND_MAX_TAPS - 2 + _N_];
+};
+
+class Decimator {
+  public:
+    Decimator();
+
+    // Input at 1 << shift times the output rate, shift 0 to 2
+    void setShift(int shift);
+    void reset();
+    // Decimates n samples in place, leaving n >> shift
+    void process(int32_t *buf, int n);
+
+  private:
+    int shift_;
+    HalfBand first_;
+    HalfBand last_;
+};
+
+#endif
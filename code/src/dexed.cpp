@@ -22,7 +22,7 @@
    Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
 
 */
-#include "Arduino.h"
+#include "platform.h"
 
 #include "../CLFM.h"
 #include "synth.h"
@@ -33,29 +33,48 @@
 #include "freqlut.h"
 #include <unistd.h>
 #include <limits.h>
-//#include <dsp/support_functions.h>
-#include <arm_math.h>
 
-// FIXME - there's a memory overwrite bug connected to the voices
 Dexed::Dexed(uint8_t maxnotes, int rate)
 {
-  Exp2::init();
-  Tanh::init();
-  Sin::init();
-  Tri::init();
-  Sqr::init();
-
-  Freqlut::init(rate);
-  FEnv::init_sr(rate);
-  
   engineMsfa = new FmCore;
+  sampleRate = rate;
+  oversampleShift = 0;
+  initRate();
   max_notes=maxnotes;
-  currentNote = 0;
+  liveVoices = 0;
+  releasingVoices = 0;
   vuSignal = 0.0;
-  // voices=NULL;
-
+  refreshVoice = false;
+  refreshEnv = false;
+  algorithm = 0;
+  memset(&snapshot[0].config, 0, sizeof(configStruct));
+  snapshot[0].derive();
+  snapshot[1] = snapshot[0];
+  activeSnapshot = 0;
+  snapshotPending = false;
+  pitchBendTarget = 0;
+  pitchBend = 0;
+  bendTarget = 0;
+  sampleCount = 0;
+#ifdef VOICE_BATCH
+  batchVoices = true;
+#endif
+#ifdef VOICE_THREADS
+  pool = NULL;
+  threadout = NULL;
+  threadout_size = 0;
+  thread_samples = 0;
+  thread_offset = 0;
+  ntasks = 0;
+#endif
   for (int i = 0; i < _MAX_NOTES; i++)
-    voices[i].dx7_note = NULL;
+  {
+    voices[i].dx7_note = &notepool[i].note;
+    voices[i].dx7_note->setRate(&freqlut, &envRate);
+    voices[i].keydown = false;
+    voices[i].live = false;
+    voices[i].key_pressed_timer = 0;
+  }
 
   setMaxNotes(max_notes);
   // loadInitVoice();
@@ -66,57 +85,71 @@ Dexed::Dexed(uint8_t maxnotes, int rate)
 
 Dexed::~Dexed()
 {
-  currentNote = -1;
-
-  for (uint8_t note = 0; note < max_notes; note++)
-    delete voices[note].dx7_note;
-
-  for (uint8_t note = 0; note < max_notes; note++)
-    delete &voices[note];
-
   delete(engineMsfa);
+#ifdef VOICE_THREADS
+  delete pool;
+  delete[] threadout;
+#endif
 }
 
 void Dexed::setMaxNotes(uint8_t new_max_notes)
 {
-  uint8_t i=0;
-  
-  max_notes=constrain(max_notes,0,_MAX_NOTES);
+  panic();
+
+  max_notes=constrain(new_max_notes,0,_MAX_NOTES);
 
 #ifdef DEBUG
-  Serial.print("Allocating memory for ");
+  Serial.print("Using ");
   Serial.print(max_notes,DEC);
   Serial.println(" notes.");
   Serial.println();
 #endif
 
-  if(voices)
+  // start the voices in use from a fresh note, as a mode switch always has
+  for (uint8_t i = 0; i < max_notes; i++)
   {
-    panic();
-    for (i = 0; i < max_notes; i++)
-    {
-      if(voices[i].dx7_note)
-    	delete voices[i].dx7_note;
-    }
-    // delete(voices);
+    *voices[i].dx7_note = Dx7Note();
+    voices[i].dx7_note->setRate(&freqlut, &envRate);
+    voices[i].keydown = false;
+    voices[i].live = false;
+    voices[i].key_pressed_timer = 0;
   }
+  voiceAlloc.reset(max_notes);
+}
 
-  max_notes=constrain(new_max_notes,0,_MAX_NOTES);
+// A step of the pitch bend glide, taken at the start of every block.
+// Pitch bend messages are coarse and irregular, and the shift spreads each
+// one over a few blocks: about a quarter of the way every 64 samples at
+// 44.1 kHz, whatever the block size and rate.
+#define PITCH_BEND_SHIFT (8 - LG_N)
 
-  if(max_notes>0)
-  {
+static inline int32_t glideBend(int32_t bend, int32_t target, uint8_t shift)
+{
+  int32_t diff = target - bend;
+  if (abs(diff) < (1 << shift))
+    return target;
+  return bend + (diff >> shift);
+}
 
-    // voices=new ProcessorVoice[max_notes]; // sizeof(ProcessorVoice) = 20
-    for (i = 0; i < max_notes; i++)
-    {
-      voices[i].dx7_note = new Dx7Note; // sizeof(Dx7Note) = 692
-      voices[i].keydown = false;
-      voices[i].live = false;
-      voices[i].key_pressed_timer = 0;
-    }
-  }
-  // else
-  //    voices=NULL;
+void Dexed::setOversampling(uint8_t factor)
+{
+  panic();
+  oversampleShift = factor >= 4 ? 2 : (factor >= 2 ? 1 : 0);
+  initRate();
+}
+
+// Sets up the tables, the pitch bend glide and the decimator for the rate
+// the voices render at
+void Dexed::initRate()
+{
+  int rate = sampleRate << oversampleShift;
+  freqlut.init(rate);
+  envRate.init(rate);
+  // a step more for every doubling of the rate from 44.1 kHz
+  bendShift = PITCH_BEND_SHIFT;
+  for (int r = 44100 * 3 / 2; r <= rate; r *= 2)
+    bendShift++;
+  decimator.setShift(oversampleShift);
 }
 
 void Dexed::activate(void)
@@ -129,15 +162,339 @@ void Dexed::deactivate(void)
   panic();
 }
 
+// A voice can reach about 2^29 (four full level carriers), so each one is
+// scaled down by MIX_HEADROOM before the voices are summed in int32, then a
+// single saturating shift by MIX_SHIFT gives Q15.
+#define MIX_HEADROOM 4
+#define MIX_SHIFT 9
+#define MIX_FULL_SCALE (1 << (MIX_SHIFT + 15))
+
+// Output samples mixed per mixSamples call of getSamples, a multiple of _N_
+#define MIX_CHUNK 512
+
 void Dexed::getSamples(uint16_t n_samples, int16_t* buffer)
 {
-  uint16_t i, j;
-  uint8_t note;
-  float sumbuf[n_samples];
-#ifdef USE_SIMPLE_COMPRESSOR
-  float s;
-  const double decayFactor = 0.99992;
+  AlignedBuf<int32_t, MIX_CHUNK> mix;
+
+  for (uint16_t i = 0; i < n_samples; i += MIX_CHUNK)
+  {
+    uint16_t n = min(n_samples - i, MIX_CHUNK);
+    mixSamples(n, mix.get());
+    for (uint16_t j = 0; j < n; ++j)
+      buffer[i + j] = signed_saturate_rshift(mix.get()[j], 16, MIX_SHIFT);
+  }
+}
+
+void Dexed::getSamples(uint16_t n_samples, float* buffer)
+{
+  AlignedBuf<int32_t, MIX_CHUNK> mix;
+  const float scale = 1.0f / MIX_FULL_SCALE;
+
+  for (uint16_t i = 0; i < n_samples; i += MIX_CHUNK)
+  {
+    uint16_t n = min(n_samples - i, MIX_CHUNK);
+    mixSamples(n, mix.get());
+    for (uint16_t j = 0; j < n; ++j)
+      buffer[i + j] = mix.get()[j] * scale;
+  }
+}
+
+void Dexed::mixSamples(uint16_t n_samples, int32_t* mix)
+{
+  AlignedBuf<int32_t, _N_> mixbuf;
+
+  applyParams();
+  refreshVoices();
+  bendTarget = pitchBendTarget;
+  // output samples per block of the voices
+  uint16_t step = _N_ >> oversampleShift;
+  uint16_t next = 0;
+  for (uint16_t i = 0; i < n_samples; i += step)
+  {
+    if (i == next)
+    {
+      playEvents(i + step);
+      next = nextEvent(i + step, n_samples);
+#ifdef VOICE_THREADS
+      computeThreaded(i << oversampleShift, (next - i) << oversampleShift);
 #endif
+    }
+    mixVoices(mixbuf.get(), i << oversampleShift);
+    decimator.process(mixbuf.get(), _N_);
+    for (uint8_t j = 0; j < step; ++j)
+      mix[i + j] = mixbuf.get()[j];
+  }
+  sampleCount += n_samples;
+  updateActivity();
+}
+
+static NoteEvent noteEvent(uint32_t time, uint8_t type, uint8_t velocity, float pitch)
+{
+  NoteEvent ev;
+  ev.time = time;
+  ev.type = type;
+  ev.velocity = velocity;
+  ev.pitch = pitch;
+  return ev;
+}
+
+bool Dexed::queueKeydown(uint32_t time, int16_t pitch, uint8_t velo)
+{
+  return events.push(noteEvent(time, EVENT_KEYDOWN, velo, pitch));
+}
+
+bool Dexed::queueKeyup(uint32_t time, int16_t pitch)
+{
+  return events.push(noteEvent(time, EVENT_KEYUP, 0, pitch));
+}
+
+bool Dexed::queueFreq(uint32_t time, float fracpitch, uint8_t velo)
+{
+  return events.push(noteEvent(time, EVENT_FREQ, velo, fracpitch));
+}
+
+bool Dexed::queuePitchOnly(uint32_t time, float pitch)
+{
+  return events.push(noteEvent(time, EVENT_PITCH, 0, pitch));
+}
+
+bool Dexed::queuePitchBend(uint32_t time, int32_t bend)
+{
+  NoteEvent ev = noteEvent(time, EVENT_PITCH_BEND, 0, 0);
+  ev.bend = bend;
+  return events.push(ev);
+}
+
+// Plays the queued events due before sample end of this getSamples call
+void Dexed::playEvents(uint16_t end)
+{
+  NoteEvent ev;
+  while (events.peek(ev) && (int32_t)(ev.time - sampleCount) < end)
+  {
+    events.pop(ev);
+    switch (ev.type)
+    {
+      case EVENT_KEYDOWN:
+        keydown((int16_t)ev.pitch, ev.velocity);
+        break;
+      case EVENT_KEYUP:
+        keyup((int16_t)ev.pitch);
+        break;
+      case EVENT_FREQ:
+        freq(ev.pitch, ev.velocity);
+        break;
+      case EVENT_PITCH:
+        updatePitchOnly(ev.pitch);
+        break;
+      case EVENT_PITCH_BEND:
+        pitchBendTarget = ev.bend;
+        bendTarget = ev.bend;
+        break;
+    }
+  }
+}
+
+// The start of the block the next queued event falls in, from from on, or
+// n_samples if there is none in this call. Rounding down to the block
+// start is what makes events block accurate (see queueKeydown).
+uint16_t Dexed::nextEvent(uint16_t from, uint16_t n_samples)
+{
+  NoteEvent ev;
+  if (!events.peek(ev))
+    return n_samples;
+  int32_t offset = (int32_t)(ev.time - sampleCount);
+  if (offset < from)
+    return from;
+  if (offset >= n_samples)
+    return n_samples;
+  return (uint16_t)(offset & ~((_N_ >> oversampleShift) - 1));
+}
+
+bool Dexed::setParam(uint8_t param, uint8_t op, float value)
+{
+  ParamEvent event;
+  event.param = param;
+  event.op = constrain(op, 0, 3);
+  event.value = value;
+  return params.push(event);
+}
+
+bool Dexed::setConfig(const configStruct &c)
+{
+  if (snapshotPending)
+    return false;
+  ConfigSnapshot &next = snapshot[activeSnapshot ^ 1];
+  next.config = c;
+  next.derive();
+  snapshotPending = true;
+  // the marker publishes it, in order with the queued single changes
+  if (!setParam(PARAM_CONFIG, 0, 0))
+  {
+    snapshotPending = false;
+    return false;
+  }
+  return true;
+}
+
+void Dexed::loadConfig(const configStruct &c)
+{
+  setConfig(c);
+  applyParams();
+}
+
+void Dexed::setField(configStruct &config, const ParamEvent &event)
+{
+  uint8_t op = event.op;
+  int v = (int)event.value;
+  switch (event.param)
+  {
+    case PARAM_COARSE:
+      config.coarse[op] = (coarseAdj)v;
+      break;
+    case PARAM_FINE:
+      config.fine[op] = v;
+      break;
+    case PARAM_WAVE:
+      config.wave[op] = (wavetype)v;
+      break;
+    case PARAM_LEVEL:
+      config.level[op] = v;
+      break;
+    case PARAM_SCALE:
+      config.scale[op] = event.value;
+      break;
+    case PARAM_ENV_A:
+      config.env[op].a = v;
+      break;
+    case PARAM_ENV_D:
+      config.env[op].d = v;
+      break;
+    case PARAM_ENV_S:
+      config.env[op].s = v;
+      break;
+    case PARAM_ENV_R:
+      config.env[op].r = v;
+      break;
+    case PARAM_DRONE:
+      config.env[op].drone = v != 0;
+      break;
+    case PARAM_DETUNE:
+      config.detune = v;
+      break;
+    case PARAM_FOLD:
+      config.fold = v != 0;
+      break;
+    case PARAM_FEEDBACK:
+      config.feedback = v;
+      break;
+    case PARAM_SYNC:
+      config.sync = v != 0;
+      break;
+  }
+}
+
+// Takes the queued changes in order: a single field is written into the
+// snapshot the voices render from, and a PARAM_CONFIG swaps to the one
+// setConfig published
+void Dexed::applyParams()
+{
+  ParamEvent event;
+  ConfigSnapshot last;
+  bool changed = false;
+
+  while (params.pop(event))
+  {
+    if (event.param == PARAM_CONFIG)
+    {
+      if (changed)
+      {
+        snapshot[activeSnapshot].derive();
+        updateVoices(last);
+        changed = false;
+      }
+      adoptConfig();
+      continue;
+    }
+    if (!changed)
+    {
+      last = patch();
+      changed = true;
+    }
+    setField(snapshot[activeSnapshot].config, event);
+  }
+  if (changed)
+  {
+    snapshot[activeSnapshot].derive();
+    updateVoices(last);
+  }
+}
+
+// Swaps to the snapshot setConfig published
+void Dexed::adoptConfig()
+{
+  SynthMemoryBarrier();
+  activeSnapshot ^= 1;
+  // setConfig may fill the old one again once snapshotPending is clear
+  updateVoices(snapshot[activeSnapshot ^ 1]);
+  SynthMemoryBarrier();
+  snapshotPending = false;
+}
+
+// Updates only the operators where patch() differs from last, rather than
+// every operator of every voice
+void Dexed::updateVoices(const ConfigSnapshot &last)
+{
+  const ConfigSnapshot &next = patch();
+  uint8_t pitchOps = 0;
+  uint8_t levelOps = 0;
+  uint8_t envOps = 0;
+  bool feedback = next.fb_factor != last.fb_factor;
+  bool detune = next.config.detune != last.config.detune;
+
+  for (uint8_t op = 0; op < 4; op++)
+  {
+    const envvals &a = last.config.env[op];
+    const envvals &b = next.config.env[op];
+    // ratio covers coarse, fine and turning folding on or off
+    if (next.ratio[op] != last.ratio[op])
+      pitchOps |= 1 << op;
+    if (next.outlevel[op] != last.outlevel[op])
+      levelOps |= 1 << op;
+    if (a.a != b.a || a.d != b.d || a.s != b.s || a.r != b.r)
+      envOps |= 1 << op;
+    if (a.drone != b.drone)
+      setOPDrone(op, b.drone);
+  }
+
+  if (!(pitchOps | levelOps | envOps) && !feedback && !detune)
+    return;
+
+  for (uint8_t i = 0; i < max_notes; i++)
+  {
+    Dx7Note *note = voices[i].dx7_note;
+    bool live = voices[i].live;
+    // detune changes the note's pitch, coarse and fine one operator's
+    if (live && detune)
+      note->updatePitchOnly(next, voices[i].midi_note);
+    for (uint8_t op = 0; op < 4; op++)
+    {
+      // as refreshVoices: pitch only for live voices, and a level change
+      // leaves the envelope of a live voice where it is
+      if (live && !detune && (pitchOps & (1 << op)))
+        note->updateOpPitch(next, op);
+      if (envOps & (1 << op))
+        note->updateOpEnv(next, op, voices[i].midi_note, voices[i].velocity, true);
+      else if (levelOps & (1 << op))
+        note->updateOpEnv(next, op, voices[i].midi_note, voices[i].velocity, !live);
+    }
+    if (live && feedback)
+      note->calcFeedback(next);
+  }
+}
+
+void Dexed::refreshVoices()
+{
+  uint8_t i;
 
   if (refreshVoice)
   {
@@ -146,11 +503,11 @@ void Dexed::getSamples(uint16_t n_samples, int16_t* buffer)
     {
       if ( voices[i].live ) {
         // Serial.println("### voice is live");
-        voices[i].dx7_note->update(algorithm, voices[i].midi_note, voices[i].velocity, refreshEnv);
+        voices[i].dx7_note->update(patch(), algorithm, voices[i].midi_note, voices[i].velocity, refreshEnv);
       }
       else {
         // Serial.println("### voice isn't live");
-        voices[i].dx7_note->updateEnv(voices[i].midi_note, voices[i].velocity);
+        voices[i].dx7_note->updateEnv(patch(), voices[i].midi_note, voices[i].velocity);
       }
     }
     refreshVoice = false;
@@ -159,41 +516,78 @@ void Dexed::getSamples(uint16_t n_samples, int16_t* buffer)
   else if (refreshEnv)
   {
     for (i = 0; i < max_notes; i++)
-      voices[i].dx7_note->updateEnv(voices[i].midi_note, voices[i].velocity);
+      voices[i].dx7_note->updateEnv(patch(), voices[i].midi_note, voices[i].velocity);
     refreshEnv = false;
   }
+}
+
+void Dexed::setPitchBend(int32_t bend)
+{
+  pitchBendTarget = bend;
+}
+
+// Sums the next _N_ samples of every live voice into mixbuf; offset is
+// the position in the getSamples call
+void Dexed::mixVoices(int32_t *mixbuf, uint16_t offset)
+{
+  uint8_t j, note;
+#ifdef USE_SIMPLE_COMPRESSOR
+  float s;
+  const double decayFactor = 0.99992;
+#endif
+
+  for (j = 0; j < _N_; ++j)
+    mixbuf[j] = 0;
+  pitchBend = glideBend(pitchBend, bendTarget, bendShift);
 
-  for (i = 0; i < n_samples; i += _N_)
+#ifdef VOICE_THREADS
+  if (thread_samples)
+  {
+    // already rendered by computeThreaded, summed in voice order
+    for (note = 0; note < max_notes; note++)
+    {
+      if (voices[note].live)
+      {
+        const int32_t *voiceout = threadout + note * thread_samples + offset - thread_offset;
+        for (j = 0; j < _N_; ++j)
+          mixbuf[j] += voiceout[j] >> MIX_HEADROOM;
+      }
+    }
+  }
+  else
+#endif
+#ifdef VOICE_BATCH
+  if (batchVoices)
+  {
+    computeBatched();
+    for (note = 0; note < max_notes; note++)
+    {
+      if (voices[note].live)
+      {
+        for (j = 0; j < _N_; ++j)
+          mixbuf[j] += voicebuf[note].get()[j] >> MIX_HEADROOM;
+      }
+    }
+  }
+  else
+#endif
   {
     AlignedBuf<int32_t, _N_> audiobuf;
 
-    for (uint8_t j = 0; j < _N_; ++j)
-    {
+    for (j = 0; j < _N_; ++j)
       audiobuf.get()[j] = 0;
-      sumbuf[i + j] = 0.0;
-    }
 
     for (note = 0; note < max_notes; note++)
     {
       if (voices[note].live)
       {
         // Serial.printf("Voice for note %d is live\n", note);
-        voices[note].dx7_note->compute(audiobuf.get(), engineMsfa);
+        voices[note].dx7_note->compute(patch(), pitchBend, audiobuf.get(), engineMsfa);
 
         for (j = 0; j < _N_; ++j)
         {
-          sumbuf[i + j] += signed_saturate_rshift(audiobuf.get()[j] >> 4, 24, 9) / 32768.0;
+          mixbuf[j] += audiobuf.get()[j] >> MIX_HEADROOM;
           audiobuf.get()[j] = 0;
-          /*
-                    int32_t val = audiobuf.get()[j];
-                    val = val >> 4;
-                    int32_t clip_val = val < -(1 << 24) ? 0x8000 : val >= (1 << 24) ? 0x7fff : val >> 9;
-                    float f = ((float) clip_val) / (float) 0x8000;
-                    if ( f > 1.0 ) f = 1.0;
-                    if ( f < -1.0 ) f = -1.0;
-                    sumbuf[j] += f;
-                    audiobuf.get()[j] = 0;
-          */
         }
       }
     }
@@ -201,9 +595,9 @@ void Dexed::getSamples(uint16_t n_samples, int16_t* buffer)
 
 #ifdef USE_SIMPLE_COMPRESSOR
   // mild compression
-  for (i = 0; i < n_samples; i++)
+  for (j = 0; j < _N_; j++)
   {
-    s = abs(sumbuf[i]);
+    s = abs(mixbuf[j]) / (float)MIX_FULL_SCALE;
     if (s > vuSignal)
       vuSignal = s;
     //else if (vuSignal > 0.001f)
@@ -213,39 +607,174 @@ void Dexed::getSamples(uint16_t n_samples, int16_t* buffer)
       vuSignal = 0.0;
   }
 #endif
-
-  //arm_scale_f32(sumbuf, 0.00015, sumbuf, AUDIO_BLOCK_SAMPLES);
-  arm_float_to_q15(sumbuf, buffer, n_samples);
 }
 
-bool Dexed::isIdle() {
-  return getNumNotesPlaying() == 0;
+#ifdef VOICE_BATCH
+void Dexed::setVoiceBatching(bool enable)
+{
+  batchVoices = enable;
 }
 
-bool Dexed::isReleasing() {
-  uint8_t op_carrier = engineMsfa->get_carrier_operators(algorithm); // look for carriers
-  uint8_t i;
+// Renders the next block of every live voice into voicebuf, up to
+// FM_LANES voices at a time
+void Dexed::computeBatched()
+{
+  bool done[_MAX_NOTES] = { false };
 
-  for (i = 0; i < max_notes; i++)
+  for (uint8_t note = 0; note < max_notes; note++)
   {
-    if (voices[i].live == true)
+    if (!voices[note].live || done[note])
+      continue;
+
+    Dx7Note *notes[FM_LANES];
+    int32_t *bufs[FM_LANES];
+    int n = 0;
+    for (uint8_t k = note; k < max_notes && n < FM_LANES; k++)
     {
-      memset(&voiceStatus, 0, sizeof(VoiceStatus));
-      voices[i].dx7_note->peekVoiceStatus(voiceStatus);
+      if (voices[k].live && !done[k] && voices[k].dx7_note->batchesWith(*voices[note].dx7_note))
+      {
+        notes[n] = voices[k].dx7_note;
+        bufs[n] = voicebuf[k].get();
+        memset(bufs[n++], 0, _N_ * sizeof(int32_t));
+        done[k] = true;
+      }
+    }
+    Dx7Note::computeLanes(patch(), pitchBend, bufs, notes, n, engineMsfa);
+  }
+}
+#endif
 
-      for (uint8_t op = 0; op < 4; op++)
+#ifdef VOICE_THREADS
+void Dexed::setRenderThreads(uint8_t n)
+{
+  delete pool;
+  pool = n > 1 ? new VoicePool(n) : NULL;
+}
+
+// Splits the live voices into tasks for the pool and renders n_samples of
+// a getSamples call from offset with it. Voices that batch together are kept together,
+// in chunks that still fill a few lanes, so that there are more tasks than
+// threads to steal.
+void Dexed::computeThreaded(uint16_t offset, uint16_t n_samples)
+{
+  thread_samples = 0;
+  thread_offset = offset;
+  if (!pool)
+    return;
+
+  bool done[_MAX_NOTES] = { false };
+  uint8_t n = 0;
+  ntasks = 0;
+  for (uint8_t note = 0; note < max_notes; note++)
+  {
+    if (!voices[note].live || done[note])
+      continue;
+
+    uint8_t group = n;
+    for (uint8_t k = note; k < max_notes; k++)
+    {
+      bool batches = true;
+#ifdef VOICE_BATCH
+      batches = batchVoices && voices[k].dx7_note->batchesWith(*voices[note].dx7_note);
+#endif
+      if (voices[k].live && !done[k] && (k == note || batches))
       {
-        if ((op_carrier & (1 << op)))
-        {
-          // this voice is a carrier!
-          if (voiceStatus.ampStep[op] == 3)
-            return true;
-        }
+        taskvoices[n++] = k;
+        done[k] = true;
       }
     }
+
+    int size = n - group;
+    int chunk = (size + 2 * pool->threads() - 1) / (2 * pool->threads());
+#ifdef VOICE_BATCH
+    chunk = constrain(max(chunk, (int)FmCore::kMinLanes), 1, FM_LANES);
+#endif
+    for (int start = group; start < n; start += chunk)
+      taskstart[ntasks++] = start;
   }
+  taskstart[ntasks] = n;
+  if (ntasks == 0)
+    return;
 
-  return false;
+  uint32_t size = (uint32_t)max_notes * n_samples;
+  if (size > threadout_size)
+  {
+    delete[] threadout;
+    threadout = new int32_t[size];
+    threadout_size = size;
+  }
+  thread_samples = n_samples;
+  pool->run(renderTask, this, ntasks);
+}
+
+void Dexed::renderTask(void *arg, int task, FmCore *core)
+{
+  Dexed *dexed = (Dexed *)arg;
+  int first = dexed->taskstart[task];
+  int n = dexed->taskstart[task + 1] - first;
+  Dx7Note *notes[_MAX_NOTES];
+  int32_t *bufs[_MAX_NOTES];
+  // the same glide as mixVoices will take block by block
+  int32_t bend = dexed->pitchBend;
+
+  for (int i = 0; i < dexed->thread_samples; i += _N_)
+  {
+    bend = glideBend(bend, dexed->bendTarget, dexed->bendShift);
+    for (int l = 0; l < n; l++)
+    {
+      uint8_t note = dexed->taskvoices[first + l];
+      notes[l] = dexed->voices[note].dx7_note;
+      bufs[l] = dexed->threadout + note * dexed->thread_samples + i;
+      memset(bufs[l], 0, _N_ * sizeof(int32_t));
+    }
+#ifdef VOICE_BATCH
+    if (dexed->batchVoices)
+    {
+      Dx7Note::computeLanes(dexed->patch(), bend, bufs, notes, n, core);
+      continue;
+    }
+#endif
+    for (int l = 0; l < n; l++)
+      notes[l]->compute(dexed->patch(), bend, bufs[l], core);
+  }
+}
+#endif
+
+bool Dexed::isIdle() {
+  return liveVoices == 0;
+}
+
+bool Dexed::isReleasing() {
+  return releasingVoices > 0;
+}
+
+// Counts the live voices once they have been rendered. A voice whose
+// carriers have all finished stops being live here, in the block where it
+// went silent, rather than when someone next asks.
+void Dexed::updateActivity()
+{
+  uint8_t op_carrier = engineMsfa->get_carrier_operators(algorithm); // look for carriers
+  uint8_t live = 0;
+  uint8_t releasing = 0;
+
+  for (uint8_t i = 0; i < max_notes; i++)
+  {
+    if (!voices[i].live)
+      continue;
+
+    VoiceActivity activity = voices[i].dx7_note->activity(op_carrier);
+    if (activity == VOICE_FINISHED)
+    {
+      // a held voice stays with the allocator until its keyup
+      voices[i].live = false;
+      continue;
+    }
+    live++;
+    if (activity == VOICE_RELEASING)
+      releasing++;
+  }
+  liveVoices = live;
+  releasingVoices = releasing;
 }
 
 void Dexed::updatePitchOnly(float pitch)
@@ -255,7 +784,7 @@ void Dexed::updatePitchOnly(float pitch)
   {
     if (voices[i].live)
     {
-      voices[i].dx7_note->updatePitchOnly(pitch);
+      voices[i].dx7_note->updatePitchOnly(patch(), pitch);
       voices[i].midi_note = (int)pitch;
     }
   }
@@ -269,7 +798,7 @@ void Dexed::freq(float pitch, uint8_t velo)
   {
     if (voices[i].keydown && voices[i].live)
     {
-      voices[i].dx7_note->update(algorithm, pitch, velo, false);
+      voices[i].dx7_note->update(patch(), algorithm, pitch, velo, false);
       voices[i].midi_note = (int)pitch;
       voices[i].velocity = velo;
       foundvoice = true;
@@ -289,50 +818,20 @@ void Dexed::keydown(int16_t pitch, uint8_t velo) {
 
   pitch -= TRANSPOSE_FIX;
 
-  uint8_t note = currentNote;
-  uint8_t keydown_counter = 0;
-
-  for (uint8_t i = 0; i <= max_notes; i++)
-  {
-    if (i == max_notes)
-    {
-      uint32_t min_timer = 0xffff;
-
-      // no free sound slot found, so use the oldest note slot
-      for (uint8_t n = 0; n < max_notes; n++)
-      {
-        if (voices[n].key_pressed_timer < min_timer)
-        {
-          min_timer = voices[n].key_pressed_timer;
-          note = n;
-        }
-      }
-      voices[note].keydown = false;
-      voices[note].live = false;
-      voices[note].key_pressed_timer = 0;
-      keydown_counter--;
-    }
-
-    if (!voices[note].keydown)
-    {
-      currentNote = (note + 1) % max_notes;
-      voices[note].midi_note = pitch;
-      voices[note].velocity = velo;
-      voices[note].keydown = true;
-      voices[note].dx7_note->init(algorithm, pitch, velo);
-      if (config.sync)
-        voices[note].dx7_note->oscSync();
-      voices[i].key_pressed_timer = millis();
-      keydown_counter++;
-      break;
-    }
-    else
-    {
-      keydown_counter++;
-    }
-    note = (note + 1) % max_notes;
-  }
+  // a free voice, or the oldest held one if they are all held
+  int8_t note = voiceAlloc.allocate();
+  if (note < 0)
+    return;
 
+  voices[note].midi_note = pitch;
+  voices[note].velocity = velo;
+  voices[note].keydown = true;
+  voices[note].dx7_note->init(patch(), algorithm, pitch, velo);
+  if (patch().config.sync)
+    voices[note].dx7_note->oscSync();
+  voices[note].key_pressed_timer = millis();
+  if (!voices[note].live)
+    liveVoices++;
   voices[note].live = true;
 }
 
@@ -347,6 +846,7 @@ void Dexed::keyup(int16_t pitch) {
     if ( voices[note].midi_note == pitch && voices[note].keydown ) {
       voices[note].keydown = false;
       voices[note].key_pressed_timer = 0;
+      voiceAlloc.release(note);
       break;
     }
   }
@@ -382,6 +882,9 @@ void Dexed::panic(void)
       }
     }
   }
+  voiceAlloc.reset(max_notes);
+  liveVoices = 0;
+  releasingVoices = 0;
 }
 
 void Dexed::notesOff(void) {
@@ -391,6 +894,9 @@ void Dexed::notesOff(void) {
       voices[i].live = false;
     }
   }
+  voiceAlloc.reset(max_notes);
+  liveVoices = 0;
+  releasingVoices = 0;
 }
 
 uint8_t Dexed::getMaxNotes(void)
@@ -400,46 +906,7 @@ uint8_t Dexed::getMaxNotes(void)
 
 uint8_t Dexed::getNumNotesPlaying(void)
 {
-  uint8_t op_carrier = engineMsfa->get_carrier_operators(algorithm); // look for carriers
-  uint8_t i;
-  uint8_t count_playing_voices = 0;
-
-  for (i = 0; i < max_notes; i++)
-  {
-    if (voices[i].live == true)
-    {
-      uint8_t op_amp = 0;
-      uint8_t op_carrier_num = 0;
-
-      memset(&voiceStatus, 0, sizeof(VoiceStatus));
-      voices[i].dx7_note->peekVoiceStatus(voiceStatus);
-
-      for (uint8_t op = 0; op < 4; op++)
-      {
-        if ((op_carrier & (1 << op)))
-        {
-          // this voice is a carrier!
-          op_carrier_num++;
-          if (voiceStatus.amp[op] <= VOICE_SILENCE_LEVEL && voiceStatus.ampStep[op] == 4)
-          {
-            // this voice produces no audio output
-            op_amp++;
-          }
-        }
-      }
-
-      if (op_amp == op_carrier_num)
-      {
-        // all carrier-operators are silent -> disable the voice
-        voices[i].live = false;
-        voices[i].keydown = false;
-        voices[i].dx7_note->keyup();
-      }
-      else
-        count_playing_voices++;
-    }
-  }
-  return (count_playing_voices);
+  return liveVoices;
 }
 
 void Dexed::setOPDrone(uint8_t op, bool set)
@@ -37,8 +37,14 @@
 #include "fm_op_kernel.h"
 #include "synth.h"
 #include "fenv.h"
+#include "freqlut.h"
 #include "aligned_buf.h"
 #include "dx7note.h"
+#include "event_queue.h"
+#include "param_queue.h"
+#include "voice_pool.h"
+#include "voice_alloc.h"
+#include "decimator.h"
 
 #define NUM_VOICE_PARAMETERS 156
 
@@ -52,6 +58,11 @@ struct ProcessorVoice {
   Dx7Note *dx7_note;
 };
 
+// Pool storage for ProcessorVoice::dx7_note
+struct alignas(VOICE_ALIGN) VoiceNote {
+  Dx7Note note;
+};
+
 // GLOBALS
 
 //==============================================================================
@@ -76,21 +87,77 @@ class Dexed
     void keydown(int16_t pitch, uint8_t velo);
     void freq(float fracpitch, uint8_t velo);
     void updatePitchOnly(float pitch);
+    // Bends every voice by bend (Q24 log frequency, 1 << 24 is an octave)
+    // without updating them; the voices glide to it over a few blocks.
+    // Queued bends overwrite it, so use one or the other, not both.
+    void setPitchBend(int32_t bend);
+    // The same, played at sample clock time (see sampleClock) rather than
+    // at the next block. The timing is block accurate, not sample
+    // accurate: the voices render whole blocks, so an event takes effect
+    // at the start of the block it falls in, up to a block early, or at
+    // the next one if that has gone. A block is _N_ output samples, or
+    // _N_ / the oversampling factor; a smaller LG_N times events more
+    // finely. Events are played in the order they were queued, and only
+    // one thread may queue them. False if the queue is full.
+    bool queueKeydown(uint32_t time, int16_t pitch, uint8_t velo);
+    bool queueKeyup(uint32_t time, int16_t pitch);
+    bool queueFreq(uint32_t time, float fracpitch, uint8_t velo);
+    bool queuePitchOnly(uint32_t time, float pitch);
+    bool queuePitchBend(uint32_t time, int32_t bend);
+    // Samples rendered so far, the time of the first sample of the next
+    // getSamples call
+    uint32_t sampleClock() { return sampleCount; }
     void panic(void);
     void notesOff(void);
 
     void setOPDrone(uint8_t op, bool set);
+    // Queues a change to one config field (a ParamId) for the next
+    // getSamples call; false if the queue is full. Only the control loop
+    // may call this.
+    bool setParam(uint8_t param, uint8_t op, float value);
+    // The field of config that a queued change sets
+    static void setField(configStruct &config, const ParamEvent &event);
+    // Publishes a copy of c, a whole patch, for the voices to take at the
+    // next getSamples call after the changes queued before it; false if
+    // the last one has not been taken yet. Only the control loop may call
+    // this.
+    bool setConfig(const configStruct &c);
+    // setConfig, taken straight away, for when nothing else is rendering
+    // (the host tools)
+    void loadConfig(const configStruct &c);
     void setAlgorithm(uint8_t algorithm);
     uint8_t getAlgorithm(void);
     uint8_t getCarrierCount(void);
     bool isIdle();
     bool isReleasing();
+    // Renders the voices at 2 or 4 times the sample rate and decimates
+    // the mix back down, so that folding and feedback alias less, for 2 or
+    // 4 times the voice rendering. 1, the default, renders at the sample
+    // rate. Stops every voice. Only this Dexed's rate changes, and only
+    // while it is not rendering: before audio starts, or on the Teensy
+    // through AudioSynthDexed, which holds off the audio interrupt.
+    void setOversampling(uint8_t factor);
+#ifdef VOICE_BATCH
+    // Voice per lane rendering, on by default; the output is the same
+    void setVoiceBatching(bool enable);
+#endif
+#ifdef VOICE_THREADS
+    // Render the voices on n threads, counting the caller (1, the default,
+    // renders on the calling thread only). The output is the same.
+    void setRenderThreads(uint8_t n);
+#endif
 
     ProcessorVoice voices[_MAX_NOTES];
 
   protected:
+    // setMaxNotes only changes how many of these are in use
+    VoiceNote notepool[_MAX_NOTES];
     uint8_t max_notes;
-    int16_t currentNote;
+    VoiceAllocator voiceAlloc;
+    // Counted by updateActivity after every getSamples call; keydown
+    // counts its voice straight away
+    uint8_t liveVoices;
+    uint8_t releasingVoices;
     float vuSignal;
     bool refreshVoice;
     bool refreshEnv;
@@ -98,9 +165,69 @@ class Dexed
     uint8_t algorithm;
     uint32_t xrun;
     uint16_t render_time_max;
-    VoiceStatus voiceStatus;
     FmCore* engineMsfa;
+    // The voices render from snapshot[activeSnapshot], which setParam
+    // changes edit in place; setConfig fills the other one, and its
+    // PARAM_CONFIG swaps them over while snapshotPending
+    ConfigSnapshot snapshot[2];
+    volatile uint8_t activeSnapshot;
+    volatile bool snapshotPending;
+    ParamQueue params;
+    // pitchBend glides to bendTarget, a copy of pitchBendTarget taken for
+    // each getSamples call, one step per _N_ block
+    volatile int32_t pitchBendTarget;
+    int32_t pitchBend;
+    int32_t bendTarget;
+    // the glide's shift for this block length and rate
+    uint8_t bendShift;
+    // The output rate; the voices render at 1 << oversampleShift times it,
+    // and decimator brings their mix back down
+    int sampleRate;
+    uint8_t oversampleShift;
+    // at the rate the voices render at
+    Freqlut freqlut;
+    EnvRate envRate;
+    Decimator decimator;
+    EventQueue events;
+    volatile uint32_t sampleCount;
+    // n_samples must be a multiple of _N_. Both versions convert the int32
+    // mix of mixSamples; the float one skips the final shift to Q15 (full
+    // scale is +/-1.0 and it is not clipped)
     void getSamples(uint16_t n_samples, int16_t* buffer);
+    void getSamples(uint16_t n_samples, float* buffer);
+    // The int32 mix of the next n_samples for getSamples, n_samples at
+    // most its chunk size
+    void mixSamples(uint16_t n_samples, int32_t* mix);
+    const ConfigSnapshot &patch() { return snapshot[activeSnapshot]; }
+    void initRate();
+    void applyParams();
+    void adoptConfig();
+    void updateVoices(const ConfigSnapshot &last);
+    void refreshVoices();
+    void playEvents(uint16_t end);
+    uint16_t nextEvent(uint16_t from, uint16_t n_samples);
+    void mixVoices(int32_t *mixbuf, uint16_t offset);
+    void updateActivity();
+#ifdef VOICE_BATCH
+    bool batchVoices;
+    AlignedBuf<int32_t, _N_> voicebuf[_MAX_NOTES];
+    void computeBatched();
+#endif
+#ifdef VOICE_THREADS
+    // A task renders taskvoices[taskstart[t]..taskstart[t + 1]) for the
+    // thread_samples of a getSamples call from thread_offset, up to the
+    // next queued event, into threadout
+    VoicePool *pool;
+    int32_t *threadout;
+    uint32_t threadout_size;
+    uint16_t thread_samples;
+    uint16_t thread_offset;
+    uint8_t ntasks;
+    uint8_t taskvoices[_MAX_NOTES];
+    uint8_t taskstart[_MAX_NOTES + 1];
+    void computeThreaded(uint16_t offset, uint16_t n_samples);
+    static void renderTask(void *arg, int task, FmCore *core);
+#endif
 };
 
 #endif
@@ -15,7 +15,7 @@
    See the License for the specific language governing permissions and
    limitations under the License.
 */
-#include <Arduino.h>
+#include "platform.h"
 
 #include <math.h>
 #include <stdlib.h>
@@ -94,37 +94,47 @@ const int32_t coarsemul[] = {
 #define DEF_DEPTH 0
 #define SENSITIVITY 7
 
-int32_t osc_freq(float midinote, int mode, int coarse, int fine, int detune) {
+// Coarse and fine as a log frequency offset, for ratio mode
+int32_t osc_ratio(int coarse, int fine) {
+  int32_t logfreq = coarsemul[coarse & 31];
+  if (fine) {
+    // (1 << 24) / log(2)
+    //logfreq += (int32_t)floor(24204406.323123 * log(1 + 0.01 * fine) + 0.5);
+    logfreq += (int32_t)floor(24204406.323123 * LOG_FUNC(1 + 0.01 * fine) + 0.5);
+  }
+  return logfreq;
+}
+
+// Ratio mode without coarse and fine: add osc_ratio for an operator
+int32_t note_logfreq(float midinote, int detune) {
   // TODO: pitch randomization
-  int32_t logfreq;
   int rounded = (int)midinote;
-  if (mode == 0) {  // ratio mode
-    logfreq = midinote_to_logfreq(rounded);
-    float f = midinote - (int)midinote;
-    if (f > 0) 
-    {
-      int32_t logfreq1 = midinote_to_logfreq(rounded + 1);
-      logfreq += f * (logfreq1 - logfreq);
-    }
+  int32_t logfreq = midinote_to_logfreq(rounded);
+  float f = midinote - (int)midinote;
+  if (f > 0) 
+  {
+    int32_t logfreq1 = midinote_to_logfreq(rounded + 1);
+    logfreq += f * (logfreq1 - logfreq);
+  }
 
-    if (detune) // detune from -7 to 7
-    {
-      // could use more precision, closer enough for now. those numbers comes from my DX7
-      //FRAC_NUM detuneRatio = 0.0209 * exp(-0.396 * (((float)logfreq) / (1 << 24))) / 7;
-      FRAC_NUM detuneRatio = 0.0209 * EXP_FUNC(-0.396 * (((float)logfreq) / (1 << 24))) / 7;
-      logfreq += detuneRatio * logfreq * detune;
-    }
+  if (detune) // detune from -7 to 7
+  {
+    // could use more precision, closer enough for now. those numbers comes from my DX7
+    //FRAC_NUM detuneRatio = 0.0209 * exp(-0.396 * (((float)logfreq) / (1 << 24))) / 7;
+    FRAC_NUM detuneRatio = 0.0209 * EXP_FUNC(-0.396 * (((float)logfreq) / (1 << 24))) / 7;
+    logfreq += detuneRatio * logfreq * detune;
+  }
 
-    logfreq += coarsemul[coarse & 31];
-    if (fine) {
-      // (1 << 24) / log(2)
-      //logfreq += (int32_t)floor(24204406.323123 * log(1 + 0.01 * fine) + 0.5);
-      logfreq += (int32_t)floor(24204406.323123 * LOG_FUNC(1 + 0.01 * fine) + 0.5);
-    }
+  // // This was measured at 7.213Hz per count at 9600Hz, but the exact
+  // // value is somewhat dependent on midinote. Close enough for now.
+  // //logfreq += 12606 * (detune -7);
+  return logfreq;
+}
 
-    // // This was measured at 7.213Hz per count at 9600Hz, but the exact
-    // // value is somewhat dependent on midinote. Close enough for now.
-    // //logfreq += 12606 * (detune -7);
+int32_t osc_freq(float midinote, int mode, int coarse, int fine, int detune) {
+  int32_t logfreq;
+  if (mode == 0) {  // ratio mode
+    logfreq = note_logfreq(midinote, detune) + osc_ratio(coarse, fine);
   } else {  // fixed mode
     // ((1 << 24) * log(10) / log(2) * .01) << 3
     logfreq = (4458616 * ((coarse & 3) * 100 + fine)) >> 3;
@@ -196,35 +206,70 @@ Dx7Note::Dx7Note() {
     params_[op].gain_out = 0;
     env_[op].setop(op);
   }
+  fb_buf_[0] = 0;
+  fb_buf_[1] = 0;
+  freqlut_ = NULL;
 }
 
-void Dx7Note::init(uint8_t algorithm, float midinote, int velocity) {
+void Dx7Note::setRate(const Freqlut *freqlut, const EnvRate *envrate) {
+  freqlut_ = freqlut;
+  for (int op = 0; op < 4; op++)
+    env_[op].setRate(envrate);
+}
+
+void ConfigSnapshot::derive() {
   for (int op = 0; op < 4; op++) {
-    int a = config.env[op].a;
-    int d = config.env[op].d;
-    int s = config.env[op].s;
-    int r = config.env[op].r;
-    int outlevel = min(100, config.level[op] * config.scale[op]);
-    outlevel = FEnv::scaleoutlevel(outlevel);
-    int level_scaling = ScaleLevel(midinote, BREAK_PT, DEF_DEPTH, DEF_DEPTH, DEF_DEPTH, DEF_DEPTH);
-    outlevel += level_scaling;
-    outlevel = min(127, outlevel);
-    outlevel = outlevel << 5;
-    outlevel += ScaleVelocity(velocity, SENSITIVITY);
-    outlevel = max(0, outlevel);
-
-    env_[op].init(a, d, s, r, env_[op].isDroning(), outlevel);
-
-    int mode = 0;
-    int coarse = (int)(config.coarse[op]);
     int fine = config.fold ? 0 : config.fine[op];
-    int detune = config.detune;
-    int32_t freq = osc_freq(midinote, mode, coarse, fine, detune);
-    opMode[op] = mode;
-    basepitch_[op] = freq;
+    ratio[op] = osc_ratio((int)config.coarse[op], fine);
+    fold[op] = config.fold ? config.fine[op] : 0;
+    int level = min(100, config.level[op] * config.scale[op]);
+    outlevel[op] = FEnv::scaleoutlevel(level);
+  }
+  int fb = config.feedback;
+#ifdef BIPOLAR_FEEDBACK
+  fb -= 50;
+  fb_factor = fb < 48.5 ? fb / 75.0 : 1.5;
+#else  
+  fb_factor = fb < 95 ? fb / 150.0 : 1.5;
+#endif  
+  if (semitoneDetune != config.detune) {
+    for (int note = 0; note < SNAPSHOT_NOTES; note++)
+      semitone[note] = note_logfreq(note, config.detune);
+    semitoneDetune = config.detune;
+  }
+}
+
+int32_t ConfigSnapshot::noteLogfreq(float midinote) const {
+  // negative, NaN or out of range: work it out in full
+  if (!(midinote >= 0 && midinote < SNAPSHOT_NOTES - 1))
+    return note_logfreq(midinote, config.detune);
+  int rounded = (int)midinote;
+  int32_t logfreq = semitone[rounded];
+  float f = midinote - rounded;
+  if (f > 0)
+    logfreq += f * (semitone[rounded + 1] - logfreq);
+  return logfreq;
+}
+
+// The key and velocity scaled output level of an operator
+static int noteOutlevel(const ConfigSnapshot &patch, int op, float midinote, int velocity) {
+  int outlevel = patch.outlevel[op];
+  int level_scaling = ScaleLevel(midinote, BREAK_PT, DEF_DEPTH, DEF_DEPTH, DEF_DEPTH, DEF_DEPTH);
+  outlevel += level_scaling;
+  outlevel = min(127, outlevel);
+  outlevel = outlevel << 5;
+  outlevel += ScaleVelocity(velocity, SENSITIVITY);
+  return max(0, outlevel);
+}
+
+void Dx7Note::init(const ConfigSnapshot &patch, uint8_t algorithm, float midinote, int velocity) {
+  for (int op = 0; op < 4; op++) {
+    const envvals &env = patch.config.env[op];
+    env_[op].init(env.a, env.d, env.s, env.r, env_[op].isDroning(), noteOutlevel(patch, op, midinote, velocity));
   }
+  updatePitchOnly(patch, midinote);
   algorithm_ = algorithm;
-  calcFeedback();
+  calcFeedback(patch);
 }
 
 void Dx7Note::setOPDrone(uint8_t op, bool set) {
@@ -236,7 +281,36 @@ void Dx7Note::setOPDrone(uint8_t op, bool set) {
   }
 }
 
-void Dx7Note::compute(int32_t *buf, FmCore* core) {
+void Dx7Note::compute(const ConfigSnapshot &patch, int32_t bend, int32_t *buf, FmCore* core) {
+  prepare(patch, bend);
+  core->render(buf, params_, algorithm_, fb_buf_, fb_factor_);
+}
+
+#ifdef VOICE_BATCH
+bool Dx7Note::batchesWith(const Dx7Note &other) const {
+  return algorithm_ == other.algorithm_ && fb_factor_ == other.fb_factor_;
+}
+
+void Dx7Note::computeLanes(const ConfigSnapshot &patch, int32_t bend, int32_t **bufs, Dx7Note **notes, int n, FmCore* core) {
+  if (n < FmCore::kMinLanes) {
+    for (int l = 0; l < n; l++)
+      notes[l]->compute(patch, bend, bufs[l], core);
+    return;
+  }
+  FmOpParams *params[FM_LANES];
+  int32_t *fb_bufs[FM_LANES];
+  for (int l = 0; l < n; l++) {
+    notes[l]->prepare(patch, bend);
+    params[l] = notes[l]->params_;
+    fb_bufs[l] = notes[l]->fb_buf_;
+  }
+  core->render_lanes(bufs, params, fb_bufs, n, notes[0]->algorithm_, notes[0]->fb_factor_);
+}
+#endif
+
+// Operator frequencies, envelope levels, waves and fold for the next block;
+// bend is added to every operator's log frequency
+void Dx7Note::prepare(const ConfigSnapshot &patch, int32_t bend) {
 #ifdef DEBUG
     int sum = 0;
     bool debugout = false;
@@ -252,7 +326,7 @@ void Dx7Note::compute(int32_t *buf, FmCore* core) {
     // if ( opMode[op] )
     //   params_[op].freq = Freqlut::lookup(basepitch + pitch_base);
     // else
-      params_[op].freq = Freqlut::lookup(basepitch);
+      params_[op].freq = freqlut_->lookup(basepitch + bend);
 
     uint32_t level = env_[op].getsample();
 #ifdef DEBUG
@@ -260,7 +334,8 @@ void Dx7Note::compute(int32_t *buf, FmCore* core) {
 #endif
 
     params_[op].level_in = level;
-    params_[op].fold = config.fold ? config.fine[op] : 0;
+    params_[op].wave = patch.config.wave[op];
+    params_[op].fold = patch.fold[op];
 #ifdef DEBUG
     sum += (level >> 16);
 #endif    
@@ -287,8 +362,6 @@ void Dx7Note::compute(int32_t *buf, FmCore* core) {
     }
   }
 #endif
-
-  core->render(buf, params_, algorithm_, fb_buf_, fb_factor_);
 }
 
 void Dx7Note::keyup() {
@@ -302,79 +375,60 @@ void Dx7Note::keyup() {
   }
 }
 
-void Dx7Note::updateEnv(float midinote, int velocity)
+void Dx7Note::updateOpPitch(const ConfigSnapshot &patch, int op)
 {
-  // Serial.println("In updateEnv");
-  for (int op = 0; op < 4; op++) {
-    int a = config.env[op].a;
-    int d = config.env[op].d;
-    int s = config.env[op].s;
-    int r = config.env[op].r;
-    int outlevel = min(100, config.level[op] * config.scale[op]);
-    outlevel = FEnv::scaleoutlevel(outlevel);
-    int level_scaling = ScaleLevel(midinote, BREAK_PT, DEF_DEPTH, DEF_DEPTH, DEF_DEPTH, DEF_DEPTH);
-    outlevel += level_scaling;
-    outlevel = min(127, outlevel);
-    outlevel = outlevel << 5;
-    outlevel += ScaleVelocity(velocity, SENSITIVITY);
-    outlevel = max(0, outlevel);
+  basepitch_[op] = notepitch_ + patch.ratio[op];
+  opMode[op] = 0;
+}
+
+void Dx7Note::updateOpEnv(const ConfigSnapshot &patch, int op, float midinote, int velocity, bool refreshEnv)
+{
+  const envvals &env = patch.config.env[op];
 #ifdef DEBUG    
-    Serial.printf("Update env op %d: %d %d %d %d (drone %d)\n", op, a, d, s, r, env_[op].isDroning());
+  Serial.printf("Update env op %d: %d %d %d %d (drone %d) %d\n", op, env.a, env.d, env.s, env.r, env_[op].isDroning(), refreshEnv);
 #endif    
-    env_[op].update(a, d, s, r, env_[op].isDroning(), outlevel, true);
-  }
+  env_[op].update(env.a, env.d, env.s, env.r, env_[op].isDroning(), noteOutlevel(patch, op, midinote, velocity), refreshEnv);
 }
 
-void Dx7Note::updatePitchOnly(float pitch)
+void Dx7Note::updateEnv(const ConfigSnapshot &patch, float midinote, int velocity)
 {
-  for (int op = 0; op < 4; op++) {
-    int coarse = (int)(config.coarse[op]);
-    int fine = config.fold ? 0 : config.fine[op];
-    basepitch_[op] = osc_freq(pitch, 0, coarse, fine, config.detune);
-  }
+  for (int op = 0; op < 4; op++)
+    updateOpEnv(patch, op, midinote, velocity, true);
 }
 
-void Dx7Note::update(uint8_t algorithm, float midinote, int velocity, bool refreshEnv) {
-  // Serial.println("In update");
-  for (int op = 0; op < 4; op++) {
-    int a = config.env[op].a;
-    int d = config.env[op].d;
-    int s = config.env[op].s;
-    int r = config.env[op].r;
-    int outlevel = min(100, config.level[op] * config.scale[op]);
-    int mode = 0;
-    int coarse = (int)(config.coarse[op]);
-    int fine = config.fold ? 0 : config.fine[op];
-    int detune = config.detune;
-    int32_t freq = osc_freq(midinote, mode, coarse, fine, detune);
-    basepitch_[op] = freq;
-    opMode[op] = mode;
-
-    outlevel = FEnv::scaleoutlevel(outlevel);
-    int level_scaling = ScaleLevel(midinote, BREAK_PT, DEF_DEPTH, DEF_DEPTH, DEF_DEPTH, DEF_DEPTH);
-    outlevel += level_scaling;
-    outlevel = min(127, outlevel);
-    outlevel = outlevel << 5;
-    outlevel += ScaleVelocity(velocity, SENSITIVITY);
-    outlevel = max(0, outlevel);
-#ifdef DEBUG    
-    Serial.printf("Refresh op %d: %d %d %d %d\n", op, a, d, s, r, refreshEnv);
-#endif    
-    env_[op].update(a, d, s, r, env_[op].isDroning(), outlevel, refreshEnv);
-  }
+void Dx7Note::updatePitchOnly(const ConfigSnapshot &patch, float pitch)
+{
+  notepitch_ = patch.noteLogfreq(pitch);
+  for (int op = 0; op < 4; op++)
+    updateOpPitch(patch, op);
+}
+
+void Dx7Note::update(const ConfigSnapshot &patch, uint8_t algorithm, float midinote, int velocity, bool refreshEnv) {
+  updatePitchOnly(patch, midinote);
+  for (int op = 0; op < 4; op++)
+    updateOpEnv(patch, op, midinote, velocity, refreshEnv);
   algorithm_ = algorithm;
-  calcFeedback();
+  calcFeedback(patch);
 }
 
-void Dx7Note::calcFeedback()
+void Dx7Note::calcFeedback(const ConfigSnapshot &patch)
 {
-  int fb = config.feedback;
-#ifdef BIPOLAR_FEEDBACK
-  fb -= 50;
-  fb_factor_ = fb < 48.5 ? fb / 75.0 : 1.5;
-#else  
-  fb_factor_ = fb < 95 ? fb / 150.0 : 1.5;
-#endif  
+  fb_factor_ = patch.fb_factor;
+}
+
+VoiceActivity Dx7Note::activity(uint8_t carriers) {
+  bool finished = true;
+  for (int op = 0; op < 4; op++) {
+    if (!(carriers & (1 << op)))
+      continue;
+    char step;
+    env_[op].getPosition(&step);
+    if (step == 3)
+      return VOICE_RELEASING;
+    if (step != 4 || Exp2::lookup(params_[op].level_in - (14 * (1 << 24))) > VOICE_SILENCE_LEVEL)
+      finished = false;
+  }
+  return finished ? VOICE_FINISHED : VOICE_PLAYING;
 }
 
 void Dx7Note::peekVoiceStatus(VoiceStatus &status) {
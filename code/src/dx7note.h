@@ -27,6 +27,7 @@
 #include <stdint.h>
 #include "fenv.h"
 #include "fm_core.h"
+#include "freqlut.h"
 
 struct VoiceStatus {
   uint32_t amp[4];
@@ -34,27 +35,76 @@ struct VoiceStatus {
   char pitchStep;
 };
 
+enum VoiceActivity {
+  VOICE_PLAYING,
+  VOICE_RELEASING,
+  VOICE_FINISHED
+};
+
+// Log frequency (Q24, 1 << 24 is an octave) of a note, and an operator's
+// offset from it in ratio mode; together they are osc_freq
+int32_t note_logfreq(float midinote, int detune);
+int32_t osc_ratio(int coarse, int fine);
+// An operator's log frequency in ratio (mode 0) or fixed mode
+int32_t osc_freq(float midinote, int mode, int coarse, int fine, int detune);
+
+// Whole notes from 0 that ConfigSnapshot keeps the detuned pitch of
+#define SNAPSHOT_NOTES 129
+
+// A copy of the config that the voices render from, with the values they
+// derive from it worked out once by derive() rather than per voice.
+struct ConfigSnapshot {
+  configStruct config;
+  int32_t ratio[4];     // coarse and fine as a log frequency offset
+  int16_t fold[4];      // FmOpParams::fold
+  int outlevel[4];      // before key and velocity scaling
+  float fb_factor;
+  // note_logfreq of each whole note at semitoneDetune, which derive()
+  // only works out again when config.detune changes
+  int32_t semitone[SNAPSHOT_NOTES];
+  int semitoneDetune;
+
+  ConfigSnapshot() : semitoneDetune(-1000) {}
+  void derive();
+  // note_logfreq at config.detune, interpolated between whole notes; the
+  // same as note_logfreq for whole notes or no detune
+  int32_t noteLogfreq(float midinote) const;
+};
+
 class Dx7Note {
   public:
     Dx7Note();
-    void init(uint8_t algorithm, float midinote, int velocity);
+    // The engine's frequency table and envelope rate, which the note keeps
+    // pointers to; set before the first init
+    void setRate(const Freqlut *freqlut, const EnvRate *envrate);
+    void init(const ConfigSnapshot &patch, uint8_t algorithm, float midinote, int velocity);
 
     // Note: this _adds_ to the buffer. Interesting question whether it's
-    // worth it...
-    void compute(int32_t *buf, FmCore* core);
+    // worth it... bend is a pitch offset in Q24 log frequency.
+    void compute(const ConfigSnapshot &patch, int32_t bend, int32_t *buf, FmCore* core);
+#ifdef VOICE_BATCH
+    // compute() for n <= FM_LANES notes at once, note l adding to bufs[l].
+    // All the notes must batchesWith notes[0].
+    static void computeLanes(const ConfigSnapshot &patch, int32_t bend, int32_t **bufs, Dx7Note **notes, int n, FmCore* core);
+    bool batchesWith(const Dx7Note &other) const;
+#endif
 
     void keyup();
 
-    // TODO: some way of indicating end-of-note. Maybe should be a return
-    // value from the compute method? (Having a count return from keyup
-    // is also tempting, but if there's a dynamic parameter change after
-    // keyup, that won't work.
+    // End of note, checked after compute(): VOICE_RELEASING if any of the
+    // carriers (bit op set) is releasing, VOICE_FINISHED once they have
+    // all finished and are below VOICE_SILENCE_LEVEL.
+    VoiceActivity activity(uint8_t carriers);
 
     // PG:add the update
-    void update(uint8_t algorithm, float midinote, int velocity, bool refreshEnv);
+    void update(const ConfigSnapshot &patch, uint8_t algorithm, float midinote, int velocity, bool refreshEnv);
     void setOPDrone(uint8_t op, bool set);
-    void updatePitchOnly(float pitch);
-    void updateEnv(float midinote, int velocity);
+    void updatePitchOnly(const ConfigSnapshot &patch, float pitch);
+    void updateEnv(const ConfigSnapshot &patch, float midinote, int velocity);
+    // The parts of update() for one operator, after a config change
+    void updateOpPitch(const ConfigSnapshot &patch, int op);
+    void updateOpEnv(const ConfigSnapshot &patch, int op, float midinote, int velocity, bool refreshEnv);
+    void calcFeedback(const ConfigSnapshot &patch);
     void peekVoiceStatus(VoiceStatus &status);
     void transferState(Dx7Note& src);
     void transferSignal(Dx7Note &src);
@@ -62,14 +112,16 @@ class Dx7Note {
 
   private:
     FEnv env_[4];
+    const Freqlut *freqlut_;
     FmOpParams params_[4];
+    int32_t notepitch_;   // note_logfreq, which basepitch_ adds ratio to
     int32_t basepitch_[4];
     int32_t fb_buf_[2];
     float fb_factor_;
     int32_t opMode[4];
     int algorithm_;
 
-    void calcFeedback();
+    void prepare(const ConfigSnapshot &patch, int32_t bend);
 };
 
 #endif
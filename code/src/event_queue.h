@@ -0,0 +1,40 @@
+/*
+   Timed note events from the control side to the audio thread.
+
+   A NoteEvent carries the sample clock time it should be played at; Dexed
+   plays the queued events as getSamples reaches them, between its _N_
+   sample blocks.
+*/
+
+#ifndef EVENT_QUEUE_H
+#define EVENT_QUEUE_H
+
+#include <stdint.h>
+
+#include "spsc_queue.h"
+
+enum EventType {
+  EVENT_KEYDOWN,
+  EVENT_KEYUP,
+  EVENT_FREQ,
+  EVENT_PITCH,
+  EVENT_PITCH_BEND
+};
+
+struct NoteEvent {
+  uint32_t time;
+  uint8_t type;
+  uint8_t velocity;
+  // the note for key and pitch events, the bend (Q24) for EVENT_PITCH_BEND
+  union {
+    float pitch;
+    int32_t bend;
+  };
+};
+
+// A few blocks of playing and gate changes
+#define EVENT_QUEUE_SIZE 64
+
+typedef SpscQueue<NoteEvent, EVENT_QUEUE_SIZE> EventQueue;
+
+#endif
@@ -16,43 +16,40 @@
 
 #define _USE_MATH_DEFINES
 #include <math.h>
+#include "platform.h"
 
 #include "synth.h"
 #include "exp2.h"
 
-//#include <stdio.h>
+// The tables are read once per block, so on the Teensy they stay in flash
 
-#ifdef _MSC_VER
-#define exp2(arg) pow(2.0, arg)
-#endif
-
-int32_t exp2tab[EXP2_N_SAMPLES << 1];
-
-void Exp2::init() {
-  FRAC_NUM inc = exp2(1.0 / EXP2_N_SAMPLES);
+static constexpr ConstTable<int32_t, EXP2_N_SAMPLES << 1> exp2table() {
+  ConstTable<int32_t, EXP2_N_SAMPLES << 1> tab = {};
+  FRAC_NUM inc = ConstMath::exp(M_LN2 / EXP2_N_SAMPLES);
   FRAC_NUM y = 1 << 30;
   for (int i = 0; i < EXP2_N_SAMPLES; i++) {
-    exp2tab[(i << 1) + 1] = (int32_t)floor(y + 0.5);
+    tab.v[(i << 1) + 1] = ConstMath::floor(y + 0.5);
     y *= inc;
   }
   for (int i = 0; i < EXP2_N_SAMPLES - 1; i++) {
-    exp2tab[i << 1] = exp2tab[(i << 1) + 3] - exp2tab[(i << 1) + 1];
+    tab.v[i << 1] = tab.v[(i << 1) + 3] - tab.v[(i << 1) + 1];
   }
-  exp2tab[(EXP2_N_SAMPLES << 1) - 2] = (1U << 31) - exp2tab[(EXP2_N_SAMPLES << 1) - 1];
+  tab.v[(EXP2_N_SAMPLES << 1) - 2] = (1U << 31) - tab.v[(EXP2_N_SAMPLES << 1) - 1];
+  return tab;
 }
 
-int32_t tanhtab[TANH_N_SAMPLES << 1];
+constexpr ConstTable<int32_t, EXP2_N_SAMPLES << 1> exp2tab PROGMEM = exp2table();
 
-static FRAC_NUM dtanh(FRAC_NUM y) {
+static constexpr FRAC_NUM dtanh(FRAC_NUM y) {
   return 1 - y * y;
 }
 
-void Tanh::init() {
+static constexpr ConstTable<int32_t, TANH_N_SAMPLES << 1> tanhtable() {
+  ConstTable<int32_t, TANH_N_SAMPLES << 1> tab = {};
   FRAC_NUM step = 4.0 / TANH_N_SAMPLES;
   FRAC_NUM y = 0;
   for (int i = 0; i < TANH_N_SAMPLES; i++) {
-    tanhtab[(i << 1) + 1] = (1 << 24) * y + 0.5;
-    //printf("%d\n", tanhtab[(i << 1) + 1]);
+    tab.v[(i << 1) + 1] = (1 << 24) * y + 0.5;
     // Use a basic 4th order Runge-Kutte to compute tanh from its
     // differential equation.
     FRAC_NUM k1 = dtanh(y);
@@ -63,8 +60,11 @@ void Tanh::init() {
     y += dy;
   }
   for (int i = 0; i < TANH_N_SAMPLES - 1; i++) {
-    tanhtab[i << 1] = tanhtab[(i << 1) + 3] - tanhtab[(i << 1) + 1];
+    tab.v[i << 1] = tab.v[(i << 1) + 3] - tab.v[(i << 1) + 1];
   }
   int32_t lasty = (1 << 24) * y + 0.5;
-  tanhtab[(TANH_N_SAMPLES << 1) - 2] = lasty - tanhtab[(TANH_N_SAMPLES << 1) - 1];
+  tab.v[(TANH_N_SAMPLES << 1) - 2] = lasty - tab.v[(TANH_N_SAMPLES << 1) - 1];
+  return tab;
 }
+
+constexpr ConstTable<int32_t, TANH_N_SAMPLES << 1> tanhtab PROGMEM = tanhtable();
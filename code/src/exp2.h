@@ -14,12 +14,12 @@
    limitations under the License.
 */
 
+#include "const_table.h"
+
 class Exp2 {
   public:
     Exp2();
 
-    static void init();
-
     // Q24 in, Q24 out
     static int32_t lookup(int32_t x);
 };
@@ -29,7 +29,7 @@ class Exp2 {
 
 #define EXP2_INLINE
 
-extern int32_t exp2tab[EXP2_N_SAMPLES << 1];
+extern const ConstTable<int32_t, EXP2_N_SAMPLES << 1> exp2tab;
 
 #ifdef EXP2_INLINE
 inline
@@ -47,8 +47,6 @@ int32_t Exp2::lookup(int32_t x) {
 
 class Tanh {
   public:
-    static void init();
-
     // Q24 in, Q24 out
     static int32_t lookup(int32_t x);
 };
@@ -56,7 +54,7 @@ class Tanh {
 #define TANH_LG_N_SAMPLES 10
 #define TANH_N_SAMPLES (1 << TANH_LG_N_SAMPLES)
 
-extern int32_t tanhtab[TANH_N_SAMPLES << 1];
+extern const ConstTable<int32_t, TANH_N_SAMPLES << 1> tanhtab;
 
 inline
 int32_t Tanh::lookup(int32_t x) {
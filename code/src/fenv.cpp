@@ -17,7 +17,7 @@
 
 //using namespace std;
 
-#include <Arduino.h>
+#include "platform.h"
 
 #include <stdlib.h>
 #include <math.h>
@@ -37,7 +37,7 @@
 
 #define CHECK (CHK3 || CHK2)
 
-uint32_t FEnv::sr_multiplier = 44100 >> 5;
+const EnvRate FEnv::defaultRate = { 44100 >> LG_N, 1.0f };
 
 const int levellut[] = {
   0, 5, 9, 13, 17, 20, 23, 25, 27, 29, 31, 33, 35, 37, 39, 41, 42, 43, 45, 46
@@ -45,8 +45,22 @@ const int levellut[] = {
 
 static const char *adsr[] = {"A", "D", "S", "R", "-"};
 
-void FEnv::init_sr(double sampleRate) {
-  sr_multiplier = (int)sampleRate >> 6; // converts it to seconds
+static constexpr ConstTable<int32_t, (1 << ENV_ATTACK_LG_N) + 1> attacktable() {
+  ConstTable<int32_t, (1 << ENV_ATTACK_LG_N) + 1> tab = {};
+  for (int i = 0; i <= (1 << ENV_ATTACK_LG_N); i++)
+    tab.v[i] = ConstMath::floor(ConstMath::sqrt(0.4 + 0.6 * i / (1 << ENV_ATTACK_LG_N)) * ENV_ONE + 0.5);
+  return tab;
+}
+
+constexpr ConstTable<int32_t, (1 << ENV_ATTACK_LG_N) + 1> FEnv::attacktab PROGMEM = attacktable();
+
+void EnvRate::init(double sampleRate) {
+  multiplier = (int)(sampleRate / _N_ + 0.5);
+  scale = sampleRate / 44100;
+}
+
+int32_t FEnv::blocks(int32_t samples) {
+  return max(1, (int32_t)(samples * rate_->scale) >> LG_N);
 }
 
 // max durations in seconds
@@ -61,13 +75,13 @@ void FEnv::calcCounts() {
   int sustain = s_; // level (0-99)
   float release = r_ * RMAX; // seconds
   // attack is 0 to 99 in "attack" millis => attack * sampleRate
-  counts_[0] = attack * sr_multiplier;
-  counts_[1] = sustain >= 0.9999 ? 0 : decay * sr_multiplier;
+  counts_[0] = attack * rate_->multiplier;
+  counts_[1] = sustain >= 0.9999 ? 0 : decay * rate_->multiplier;
   counts_[2] = 2147483647 - 100;  // avoid overflow
-  counts_[3] = drone_ ? counts_[2] : release * sr_multiplier;
+  counts_[3] = drone_ ? counts_[2] : release * rate_->multiplier;
 
   minlevel = 0;
-  maxlevel = op_ < 4 ? 1.0 : 0;
+  maxlevel = op_ < 4 ? ENV_ONE : 0;
 #ifdef DEBUG
   if (CHECK) 
     Serial.printf("### calcCounts %d [outlevel=%d]: ADSR=%.3f %.3f %.3f %.3f => %.2f %.2f %d %.2f [%d %d - %d]\n", 
@@ -83,7 +97,7 @@ void FEnv::init(const int a, const int d, const int s, const int r, bool drone,
   drone_ = drone;
   
   outlevel_ = ol;
-  outlevelfactor_ = 1;
+  outlevelfactor_ = 1 << 16;
   outleveldiff_ = 0;
   tempoutlevel_ = ol;
 
@@ -112,19 +126,26 @@ bool FEnv::debugenv() {
 }
 
 int32_t FEnv::getsample() {
+    // 0.4 + 0.6 * level, cut to 0 below 0.41
+    const int32_t kFloor = (int32_t)(0.4 * ENV_ONE);
+    const int32_t kScale = (int32_t)(0.6 * ENV_ONE);
+    const int32_t kCut = (int32_t)(0.41 * ENV_ONE);
+    const int kFrac = 28 - ENV_ATTACK_LG_N;
+
     if (drone_ || down_ || ix_ == 3)
     {
       count_++;
 #ifdef DEBUG
       if (CHECK && count_ % 200 == 0)
-        Serial.printf("%d %s: %d/%d\t%f/%f\n", op_, adsr[ix_], count_, counts_[ix_], level_, targetlevel_);
+        Serial.printf("%d %s: %d/%d\t%f/%f\n", op_, adsr[ix_], count_, counts_[ix_],
+          (float)level_ / ENV_ONE, (float)targetlevel_ / ENV_ONE);
 #endif        
 
       if (ix_ != 2 && count_ > counts_[ix_])
       {
         advance(ix_ + 1);
       }
-      else if (ix_ == 2 && inc_ && abs(level_ - targetlevel_) < inc_) {
+      else if (ix_ == 2 && inc_ && abs(level_ - targetlevel_) < abs(inc_)) {
         level_ = targetlevel_;
         inc_ = 0;
       }
@@ -142,28 +163,36 @@ int32_t FEnv::getsample() {
         }
       }
 
-      float flevel = level_ * 0.6 + 0.4;
+      int32_t flevel;
       if (ix_ == 0)
-        flevel = sqrt(flevel);
-      if (flevel < 0.41)
+      {
+        int32_t i = level_ >> kFrac;
+        int32_t frac = level_ & ((1 << kFrac) - 1);
+        int32_t y0 = attacktab[i];
+        int32_t dy = i < (1 << ENV_ATTACK_LG_N) ? attacktab[i + 1] - y0 : 0;
+        flevel = y0 + (((int64_t)dy * frac) >> kFrac);
+      }
+      else
+        flevel = kFloor + (((int64_t)level_ * kScale) >> 28);
+      if (flevel < kCut)
         flevel = 0;
-      float outflevel;
+      int outlevel;
 
-      if (outlevelfactor_ >= 1)
+      if (outlevelfactor_ >= (1 << 16))
       {
         outlevel_ += outleveldiff_;
         outleveldiff_ = 0;
-        outflevel = flevel * outlevel_;
+        outlevel = outlevel_;
       }
       else
       {
         outlevelfactor_ += outlevelfactordelta_;
-        tempoutlevel_ = (int)(outlevel_ + outlevelfactor_ * outleveldiff_ + 0.5);
-        outflevel = flevel * tempoutlevel_;
+        tempoutlevel_ = outlevel_ + ((outlevelfactor_ * outleveldiff_ + (1 << 15)) >> 16);
+        outlevel = tempoutlevel_;
       }
-        
-      int32_t outlevel = (int32_t)(outflevel * (1 << 16));
-      return outlevel;
+
+      // microsteps in Q16
+      return ((int64_t)flevel * outlevel) >> (28 - 16);
     }
     else
     {
@@ -201,7 +230,7 @@ int FEnv::convertLevel(int level)
   return level;
 }
 
-float FEnv::constrainlevel(float level) {
+int32_t FEnv::constrainlevel(int32_t level) {
   return level >= maxlevel ? maxlevel : (level < minlevel ? minlevel : level);
 }
 
@@ -223,7 +252,8 @@ void FEnv::advance(int newix) {
     }
     count_ = 0;
   }
-  float startlevel = 0;
+  int32_t sustain = (int32_t)(s_ * ENV_ONE);
+  int32_t startlevel = 0;
   switch (ix_)
   {
     case 0: // ATTACK
@@ -235,14 +265,14 @@ void FEnv::advance(int newix) {
         startlevel = level_;
       else
         startlevel = maxlevel;
-      targetlevel_ = s_;
+      targetlevel_ = sustain;
       break;
     case 2: // SUSTAIN
       if (updateonly)
         startlevel = level_;
       else
-        startlevel = s_;
-      targetlevel_ = s_;
+        startlevel = sustain;
+      targetlevel_ = sustain;
       break;
     case 3: // RELEASE
       startlevel = level_;
@@ -261,19 +291,20 @@ void FEnv::advance(int newix) {
   if (ix_ == 4 || (ix_ == 3 && drone_))
     inc_ = 0;
   else if (ix_ == 2)
-    inc_ = (targetlevel_ - startlevel) / 64;
+    inc_ = (targetlevel_ - startlevel) / blocks(4096);
   else
     inc_ = (targetlevel_ - level_) / counts_[ix_];
 #ifdef DEBUG
   if (CHECK) 
     Serial.printf("### Advancing %d to %s [%f => %f %f] %.3fs %d\n", 
-      op_, adsr[ix_], level_, targetlevel_, inc_, millis() / 1000.0, outlevel_);
+      op_, adsr[ix_], (float)level_ / ENV_ONE, (float)targetlevel_ / ENV_ONE,
+      (float)inc_ / ENV_ONE, millis() / 1000.0, outlevel_);
 #endif      
 }
 
 void FEnv::drone(bool set) {
   drone_ = set;
-  counts_[3] = drone_ ? counts_[2] : r_ * sr_multiplier;
+  counts_[3] = drone_ ? counts_[2] : r_ * rate_->multiplier;
   ix_ = -1;
   advance(drone_ || down_ ? 2 : 4);
 }
@@ -297,13 +328,15 @@ void FEnv::update(const int a, const int d, const int s, const int r, bool drone
 
   if (abs(outleveldiff_) > 12)
   {
-    outlevelfactordelta_ = 1.0f / max(1, min(8 * 64, ceil(abs(outleveldiff_) / 4)));
+    // up to 8 * 64 blocks of 64 samples at 44.1 kHz
+    int steps = blocks(min(8 * 64, abs(outleveldiff_) / 4) << 6);
+    outlevelfactordelta_ = ((1 << 16) + steps - 1) / steps;
     outlevelfactor_ = 0;
     outlevel_ = tempoutlevel_;
   }
   else
   {
-    outlevelfactor_ = 1.0f;
+    outlevelfactor_ = 1 << 16;
     outlevelfactordelta_ = 0;
     tempoutlevel_ = ol;
     outlevel_ = ol;
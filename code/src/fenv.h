@@ -19,9 +19,26 @@
 #define __FENV_H
 
 #include "synth.h"
+#include "const_table.h"
 
 // DX7 envelope generation
 
+#define ENV_ONE (1 << 28)
+#define ENV_ATTACK_LG_N 8
+
+// The rate an engine's envelopes advance at, one step per block of its
+// voices. Each Dexed has its own, so that it can render at any rate.
+struct EnvRate {
+  // PG: This code is normalized to 44100, need to put a multiplier
+  // if we are not using 44100.
+  uint32_t multiplier;  // blocks per second, converts counts to seconds
+  // The sample rate over 44100, for the glides tuned in samples at 44.1
+  // kHz: FEnv::blocks() is how many blocks last as long as samples did there
+  float scale;
+
+  void init(double sample_rate);
+};
+
 class FEnv {
   public:
     void setop(int op) { op_ = op; }
@@ -41,6 +58,8 @@ class FEnv {
     // value. First, the # of outputs scaling needs to be applied. Also,
     // modulation.
     // Then, of course, log to linear.
+    // A few integer adds per block: the segment slope is worked out by
+    // advance() and the attack curve comes from a table.
     int32_t getsample();
 
     void keydown(bool down);
@@ -50,7 +69,9 @@ class FEnv {
     bool isDroning();
     void silence(bool release);
 
-    static void init_sr(double sample_rate);
+    // The rate counts are taken at, from the next init or update; until
+    // then it is 44.1 kHz
+    void setRate(const EnvRate *rate) { rate_ = rate; }
     void transfer(FEnv &src);
 
     bool debugenv();
@@ -58,34 +79,37 @@ class FEnv {
   private:
 
     int convertLevel(int level);
-    float constrainlevel(float level);
+    int32_t constrainlevel(int32_t level);
     void calcCounts();
     void advance(int newix);
 
-    // PG: This code is normalized to 44100, need to put a multiplier
-    // if we are not using 44100.
-    static uint32_t sr_multiplier;
+    static const EnvRate defaultRate;
+    const EnvRate *rate_ = &defaultRate;
+    int32_t blocks(int32_t samples);
+
+    // sqrt(0.4 + 0.6 * level) for the attack, indexed by the top
+    // ENV_ATTACK_LG_N bits of level and interpolated
+    static const ConstTable<int32_t, (1 << ENV_ATTACK_LG_N) + 1> attacktab;
 
     int op_;
     
     float a_, d_, s_, r_;
     bool drone_ = false;
     int outlevel_;
-    // Level is stored so that 2^24 is one doubling, ie 16 more bits than
-    // the DX7 itself (fraction is stored in level rather than separate
-    // counter)
-    float level_ = 0;
-    float targetlevel_;
+    // Envelope position, 0 to ENV_ONE (Q28), and its change per block
+    int32_t level_ = 0;
+    int32_t targetlevel_;
     int ix_ = 4;
-    float inc_;
+    int32_t inc_;
     int tempoutlevel_;
     int outleveldiff_ = 0;
-    float outlevelfactor_;
-    float outlevelfactordelta_ = 1.0f / 8;
+    // Progress of a glide to a new outlevel, Q16
+    int32_t outlevelfactor_;
+    int32_t outlevelfactordelta_ = 1 << 13;
     int count_ = 0;
     int counts_[4];
-    float minlevel;
-    float maxlevel; 
+    int32_t minlevel;
+    int32_t maxlevel; 
 
     bool down_ = false;
 };
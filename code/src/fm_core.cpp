@@ -15,7 +15,7 @@
 */
 
 //using namespace std;
-#include "Arduino.h"
+#include "platform.h"
 #include <string>  
 #include <iostream> 
 #include <sstream>   
@@ -30,31 +30,38 @@
 // 4-op feedback op 4 algorithms: fb4[] = {1, 14, 7, 13, 5, 22, 31, 32};
 // create 4-op feedback op 2 equivalents: fb2[] = {2, 14, 7, 13, 5, 22, 31, 32};
 
-const FmAlgorithm FmCore::algorithms[] = {
+// Operator flags in render order. Each entry generates both the algorithms[]
+// table and a compiled render program.
+#define FM_ALGORITHMS(ALG) \
+  /* version 2 algorithms */ \
+  /* op-4 feedback versions */ \
+  ALG(0xc1, 0x11, 0x11, 0x14) /* 1 */ \
+  ALG(0xc1, 0x05, 0x11, 0x14) /* 14 */ \
+  ALG(0xc1, 0x11, 0x05, 0x14) /* 7 */ \
+  ALG(0xc1, 0x05, 0x05, 0x14) /* 13 */ \
+  ALG(0xc1, 0x14, 0x01, 0x14) /* 5 */ \
+  ALG(0xc4, 0x01, 0x11, 0x14) /* 28       (3->2->1) (4) */ \
+  ALG(0xc1, 0x14, 0x14, 0x14) /* 22 */ \
+  ALG(0xc1, 0x14, 0x14, 0x04) /* 25       (1) (4->[2,3]) */ \
+  ALG(0xc1, 0x14, 0x04, 0x04) /* 31 */ \
+  ALG(0xc4, 0x04, 0x04, 0x04) /* 32 */ \
+  /* op-2 feedback versions */ \
+  ALG(0x01, 0x11, 0xd1, 0x14) /* alt 1 */ \
+  ALG(0x01, 0x05, 0xd1, 0x14) /* alt 14 */ \
+  ALG(0x01, 0x11, 0xc5, 0x14) /* alt 8 */ \
+  ALG(0x01, 0x05, 0xc5, 0x14) /* alt 13 */ \
+  ALG(0x01, 0x14, 0xc1, 0x14) /* alt 5 */ \
+  ALG(0x04, 0x01, 0xd1, 0x14) /* alt 28   (3->2->1) (4) */ \
+  ALG(0x01, 0x14, 0xd4, 0x14) /* alt 22 */ \
+  ALG(0x01, 0x14, 0xd4, 0x04) /* alt 25   (1) (4->[2,3]) */ \
+  ALG(0x01, 0x14, 0xc4, 0x04) /* alt 31 */ \
+  ALG(0x04, 0x04, 0xc4, 0x04) /* alt 32 */
+
+#define ALG_TABLE(f0, f1, f2, f3) { { f0, f1, f2, f3 } },
+#define ALG_PROGRAM(f0, f1, f2, f3) &FmCore::render_program<f0, f1, f2, f3>,
 
-// version 2 algorithms
-// op-4 feedback versions  
-{ { 0xc1, 0x11, 0x11, 0x14 } }, // 1
-{ { 0xc1, 0x05, 0x11, 0x14 } }, // 14
-{ { 0xc1, 0x11, 0x05, 0x14 } }, // 7
-{ { 0xc1, 0x05, 0x05, 0x14 } }, // 13
-{ { 0xc1, 0x14, 0x01, 0x14 } }, // 5
-{ { 0xc4, 0x01, 0x11, 0x14 } }, // 28       (3->2->1) (4)
-{ { 0xc1, 0x14, 0x14, 0x14 } }, // 22
-{ { 0xc1, 0x14, 0x14, 0x04 } }, // 25       (1) (4->[2,3])
-{ { 0xc1, 0x14, 0x04, 0x04 } }, // 31
-{ { 0xc4, 0x04, 0x04, 0x04 } }, // 32
-// op-2 feedback versions  
-{ { 0x01, 0x11, 0xd1, 0x14 } }, // alt 1
-{ { 0x01, 0x05, 0xd1, 0x14 } }, // alt 14
-{ { 0x01, 0x11, 0xc5, 0x14 } }, // alt 8
-{ { 0x01, 0x05, 0xc5, 0x14 } }, // alt 13
-{ { 0x01, 0x14, 0xc1, 0x14 } }, // alt 5
-{ { 0x04, 0x01, 0xd1, 0x14 } }, // alt 28   (3->2->1) (4)
-{ { 0x01, 0x14, 0xd4, 0x14 } }, // alt 22
-{ { 0x01, 0x14, 0xd4, 0x04 } }, // alt 25   (1) (4->[2,3])
-{ { 0x01, 0x14, 0xc4, 0x04 } }, // alt 31
-{ { 0x04, 0x04, 0xc4, 0x04 } }, // alt 32
+const FmAlgorithm FmCore::algorithms[] = {
+FM_ALGORITHMS(ALG_TABLE)
 
   // // original 32 algorithms
   // //        6     5     4     3     2     1
@@ -92,6 +99,10 @@ const FmAlgorithm FmCore::algorithms[] = {
   // { { 0xc4, 0x04, 0x04, 0x04, 0x04, 0x04 } }, // 32
 };
 
+const FmCore::RenderProgram FmCore::programs[] = {
+FM_ALGORITHMS(ALG_PROGRAM)
+};
+
 int n_out(const FmAlgorithm &alg) {
   int count = 0;
   for (int i = 0; i < 4; i++) {
@@ -161,57 +172,160 @@ void FmCore::dump() {
 // #endif
 }
 
-void FmCore::render(int32_t *output, FmOpParams *params, int algorithm, int32_t *fb_buf, float fb_factor) {
+// One operator of a render program. The routing comes from the flags
+// template argument, so only the level threshold skip (and has_contents,
+// which depends on it) is decided at run time.
+template<int flags>
+inline void FmCore::render_op(int32_t *output, FmOpParams &param, bool *has_contents,
+                              int32_t *fb_buf, float fb_factor, bool fb_on) {
   const int kLevelThresh = 1120;
-  const FmAlgorithm alg = algorithms[algorithm];
+  const int inbus = (flags >> 4) & 3;
+  const int outbus = flags & 3;
+  const bool fb = (flags & 0xc0) == 0xc0;
+  bool add = (flags & OUT_BUS_ADD) != 0;
+  int32_t *outptr = (outbus == 0) ? output : buf_[(outbus - 1) & 1].get();
+  int32_t gain1 = param.gain_out;
+  int32_t gain2 = Exp2::lookup(param.level_in - (14 * (1 << 24)));
+  param.gain_out = gain2;
+
+  wavetype wave = param.wave;
+
+  if (gain1 >= kLevelThresh || gain2 >= kLevelThresh) {
+    if (!has_contents[outbus]) {
+      add = false;
+    }
+    if (inbus == 0 || !has_contents[inbus]) {
+      // todo: more than one op in a feedback loop
+      if (fb && fb_on) {
+        FmOpKernel::compute_fb(outptr, param.phase, param.freq, 
+                               wave, param.fold, gain1, gain2,
+                               fb_buf, fb_factor, add);
+      } else {
+        FmOpKernel::compute_pure(outptr, param.phase, param.freq, wave,
+                                 param.fold, gain1, gain2, add);
+      }
+    } else {
+      if (fb && fb_on) {
+        FmOpKernel::compute_fb(outptr, param.phase, param.freq, 
+                               wave, param.fold, gain1, gain2,
+                               fb_buf, fb_factor, true);
+      }
+      FmOpKernel::compute(outptr, buf_[(inbus - 1) & 1].get(),
+                          param.phase, param.freq, wave,
+                          param.fold, gain1, gain2, add);
+    }
+    has_contents[outbus] = true;
+  } else if (!add) {
+    has_contents[outbus] = false;
+  }
+  param.phase += param.freq << LG_N;
+}
+
+template<int f0, int f1, int f2, int f3>
+void FmCore::render_program(int32_t *output, FmOpParams *params, int32_t *fb_buf, float fb_factor) {
   bool has_contents[3] = { true, false, false };
+  bool fb_on = abs(fb_factor) > 0.01;
+  render_op<f0>(output, params[0], has_contents, fb_buf, fb_factor, fb_on);
+  render_op<f1>(output, params[1], has_contents, fb_buf, fb_factor, fb_on);
+  render_op<f2>(output, params[2], has_contents, fb_buf, fb_factor, fb_on);
+  render_op<f3>(output, params[3], has_contents, fb_buf, fb_factor, fb_on);
+}
+
+void FmCore::render(int32_t *output, FmOpParams *params, int algorithm, int32_t *fb_buf, float fb_factor) {
+  (this->*programs[algorithm])(output, params, fb_buf, fb_factor);
+}
+
+#ifdef VOICE_BATCH
+// Each voice follows render() exactly, with its own buses and level
+// threshold skip. The other operators are already vectorised across
+// samples, but the feedback operator is a sample by sample recurrence, so
+// when enough voices need it, it is run with one voice per lane.
+void FmCore::render_lanes(int32_t **outputs, FmOpParams **params, int32_t **fb_bufs, int n,
+                          int algorithm, float fb_factor) {
+  const int kLevelThresh = 1120;
+  const FmAlgorithm &alg = algorithms[algorithm];
+  AlignedBuf<int32_t, _N_ * FM_LANES, 32> fbout;
+  bool has_contents[FM_LANES][3];
+  for (int l = 0; l < n; l++) {
+    has_contents[l][0] = true;
+    has_contents[l][1] = has_contents[l][2] = false;
+  }
+
   for (int op = 0; op < 4; op++) {
     int flags = alg.ops[op];
-    bool add = (flags & OUT_BUS_ADD) != 0;
-    FmOpParams &param = params[op];
     int inbus = (flags >> 4) & 3;
     int outbus = flags & 3;
-    int32_t *outptr = (outbus == 0) ? output : buf_[outbus - 1].get();
-    int32_t gain1 = param.gain_out;
-    int32_t gain2 = Exp2::lookup(param.level_in - (14 * (1 << 24)));
-    param.gain_out = gain2;
+    bool fb = (flags & 0xc0) == 0xc0 && abs(fb_factor) > 0.01;
+    // the wave and fold come from the config, so are the same for every voice
+    wavetype wave = params[0][op].wave;
 
-    wavetype wave = config.wave[op];
+    int32_t phase[FM_LANES], freq[FM_LANES], gain1[FM_LANES], gain2[FM_LANES];
+    bool active[FM_LANES];
+    int nactive = 0;
+    for (int l = 0; l < FM_LANES; l++) {
+      if (l < n) {
+        FmOpParams &param = params[l][op];
+        phase[l] = param.phase;
+        freq[l] = param.freq;
+        gain1[l] = param.gain_out;
+        gain2[l] = Exp2::lookup(param.level_in - (14 * (1 << 24)));
+        param.gain_out = gain2[l];
+        param.phase += param.freq << LG_N;
+      } else {
+        phase[l] = freq[l] = gain1[l] = gain2[l] = 0;
+      }
+      active[l] = l < n && (gain1[l] >= kLevelThresh || gain2[l] >= kLevelThresh);
+      nactive += active[l];
+    }
 
-    if (gain1 >= kLevelThresh || gain2 >= kLevelThresh) {
-      if (!has_contents[outbus]) {
-        add = false;
+    bool fb_lanes = fb && nactive >= kMinLanes;
+    if (fb_lanes) {
+      int32_t y0[FM_LANES], y[FM_LANES];
+      for (int l = 0; l < FM_LANES; l++) {
+        y0[l] = l < n ? fb_bufs[l][0] : 0;
+        y[l] = l < n ? fb_bufs[l][1] : 0;
       }
-      if (inbus == 0 || !has_contents[inbus]) {
-        // todo: more than one op in a feedback loop
-        if ((flags & 0xc0) == 0xc0 && abs(fb_factor) > 0.01) {
-          // cout << op << " fb " << inbus << outbus << add << endl;
-          FmOpKernel::compute_fb(outptr, param.phase, param.freq, 
-                                 wave, param.fold, gain1, gain2,
-                                 fb_buf, fb_factor, add);
-        } else {
-          // cout << op << " pure " << inbus << outbus << add << endl;
-          FmOpKernel::compute_pure(outptr, param.phase, param.freq, wave,
-                                   param.fold, gain1, gain2, add);
-        }
-      } else {
-        if ((flags & 0xc0) == 0xc0 && abs(fb_factor) > 0.01) {
-          // cout << op << " fb " << inbus << outbus << add << endl;
-          FmOpKernel::compute_fb(outptr, param.phase, param.freq, 
-                                 wave, param.fold, gain1, gain2,
-                                 fb_buf, fb_factor, has_contents[inbus]);
-          outptr = (outbus == 0) ? output : buf_[outbus - 1].get();                                 
+      FmOpKernel::compute_fb_lanes(fbout.get(), phase, freq, wave, params[0][op].fold,
+                                   gain1, gain2, y0, y, fb_factor);
+      for (int l = 0; l < n; l++) {
+        if (active[l]) {
+          fb_bufs[l][0] = y0[l];
+          fb_bufs[l][1] = y[l];
         }
+      }
+    }
 
-        // cout << op << " normal " << inbus << outbus << " " << param.freq << add << endl;
-        FmOpKernel::compute(outptr, buf_[inbus - 1].get(),
-                            param.phase, param.freq, wave,
-                            param.fold, gain1, gain2, add);
+    for (int l = 0; l < n; l++) {
+      bool add = (flags & OUT_BUS_ADD) != 0;
+      int16_t fold = params[l][op].fold;
+      int32_t *outptr = (outbus == 0) ? outputs[l] : buf_lanes_[outbus - 1].get() + l * _N_;
+
+      if (active[l]) {
+        if (!has_contents[l][outbus]) {
+          add = false;
+        }
+        if (fb) {
+          bool fbadd = (inbus == 0 || !has_contents[l][inbus]) ? add : true;
+          if (fb_lanes) {
+            const int32_t *src = fbout.get() + l;
+            for (int i = 0; i < _N_; i++)
+              outptr[i] = (fbadd ? outptr[i] : 0) + src[i * FM_LANES];
+          } else {
+            FmOpKernel::compute_fb(outptr, phase[l], freq[l], wave, fold, gain1[l], gain2[l],
+                                   fb_bufs[l], fb_factor, fbadd);
+          }
+        }
+        if (inbus != 0 && has_contents[l][inbus]) {
+          FmOpKernel::compute(outptr, buf_lanes_[inbus - 1].get() + l * _N_,
+                              phase[l], freq[l], wave, fold, gain1[l], gain2[l], add);
+        } else if (!fb) {
+          FmOpKernel::compute_pure(outptr, phase[l], freq[l], wave, fold, gain1[l], gain2[l], add);
+        }
+        has_contents[l][outbus] = true;
+      } else if (!add) {
+        has_contents[l][outbus] = false;
       }
-      has_contents[outbus] = true;
-    } else if (!add) {
-      has_contents[outbus] = false;
     }
-    param.phase += param.freq << LG_N;
   }
 }
+#endif
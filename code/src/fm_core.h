@@ -51,9 +51,31 @@ class FmCore {
     static void dump();
     uint8_t get_carrier_operators(uint8_t algorithm);
     virtual void render(int32_t *output, FmOpParams *params, int algorithm, int32_t *fb_buf, float fb_factor);
+#ifdef VOICE_BATCH
+    // render() for n <= FM_LANES voices sharing algorithm and fb_factor,
+    // voice l adding to outputs[l]. Bit identical to calling render() for
+    // each voice.
+    void render_lanes(int32_t **outputs, FmOpParams **params, int32_t **fb_bufs, int n,
+                      int algorithm, float fb_factor);
+    // Below this many voices the padded lanes cost more than they save
+    static const int kMinLanes = 3;
+#endif
   protected:
+    typedef void (FmCore::*RenderProgram)(int32_t *output, FmOpParams *params, int32_t *fb_buf, float fb_factor);
+
+    template<int flags>
+    void render_op(int32_t *output, FmOpParams &param, bool *has_contents,
+                   int32_t *fb_buf, float fb_factor, bool fb_on);
+    // render() with the routing of one algorithm compiled in
+    template<int f0, int f1, int f2, int f3>
+    void render_program(int32_t *output, FmOpParams *params, int32_t *fb_buf, float fb_factor);
+
     AlignedBuf<int32_t, _N_>buf_[2];
+#ifdef VOICE_BATCH
+    AlignedBuf<int32_t, _N_ * FM_LANES>buf_lanes_[2];
+#endif
     const static FmAlgorithm algorithms[2 * N_ALGS];
+    const static RenderProgram programs[2 * N_ALGS];
 };
 
 #endif
@@ -13,7 +13,7 @@
    See the License for the specific language governing permissions and
    limitations under the License.
 */
-#include <Arduino.h>
+#include "platform.h"
 
 #include <math.h>
 #include <cstdlib>
@@ -25,7 +25,7 @@
 #include "fm_op_kernel.h"
 
 // wavefolders for the all operators are carriers algorithm 
-int32_t calcfold(int32_t v, float foldamount) {
+int32_t Fold::reference(int32_t v, float foldamount) {
   const long thresh = 1 << 24;
   
   if (foldamount > 0)
@@ -47,129 +47,524 @@ int32_t calcfold(int32_t v, float foldamount) {
   return v;
 }
 
-int32_t getRaw(int32_t phase, wavetype wave, int32_t fold) {
+int32_t Fold::gain(int16_t fold) {
+  // foldamount = MAXFOLD * fold / 200, in Q24
+  int32_t amount = ((int64_t)fold * (int64_t)(MAXFOLD * (1 << 24))) / 200;
+  return fold > 0 ? ((1 << 24) + amount) >> 1 : amount >> 1;
+}
+
+// Raw waveform lookup. The wave type is a template parameter so the switch
+// is resolved at compile time and the inner loops below reduce to a table
+// lookup and multiply; foldgain and the band-limited table (tab, for the
+// triangle and square) are worked out once per block.
+template<wavetype wave>
+inline int32_t getRaw(int32_t phase, int32_t foldgain, const int16_t *tab) {
   switch (wave) {
     case SIN:
     default:
       return Sin::lookup(phase);
     case TRI:
-      return Tri::lookup(phase);
+      return Tri::lookup(phase, tab);
     case SQR:
-      return Sqr::lookup(phase);
+      return Sqr::lookup(phase, tab);
     case SINFOLD:
-    {
-      float foldamount = MAXFOLD * fold / 200.0;
-      return calcfold(Sin::lookup(phase), foldamount);
-    }
+      return Fold::apply(Sin::lookup(phase), foldgain);
     case TRIFOLD:
-    {
-      float foldamount = MAXFOLD * fold / 200.0;
-      return calcfold(Tri::lookup(phase), foldamount);
-    }
+      return Fold::apply(Tri::lookup(phase, tab), foldgain);
   }
 }
 
-void FmOpKernel::compute(int32_t *output, const int32_t *input,
-                         int32_t phase0, int32_t freq, wavetype wave,
-                         int16_t fold, int32_t gain1, int32_t gain2, bool add) {
+// The band-limited table for an operator at freq, NULL for the sine waves.
+// The choice ignores the modulation, so heavily modulated operators still
+// alias.
+static const int16_t *waveTable(wavetype wave, int32_t freq) {
+  switch (wave) {
+    case TRI:
+    case TRIFOLD:
+      return Tri::table(freq);
+    case SQR:
+      return Sqr::table(freq);
+    default:
+      return NULL;
+  }
+}
+
+template<wavetype wave, bool add>
+static void compute_block(int32_t *output, const int32_t *input,
+                          int32_t phase0, int32_t freq, int32_t foldgain,
+                          const int16_t *tab, int32_t gain1, int32_t gain2) {
   int32_t dgain = (gain2 - gain1 + (_N_ >> 1)) >> LG_N;
   int32_t gain = gain1;
   int32_t phase = phase0;
-  if (add) {
-    for (int i = 0; i < _N_; i++) {
-      gain += dgain;
-      int32_t y = getRaw(phase + input[i], wave, fold);
-      int32_t y1 = ((int64_t)y * (int64_t)gain) >> 24;
+  for (int i = 0; i < _N_; i++) {
+    gain += dgain;
+    int32_t y = getRaw<wave>(phase + input[i], foldgain, tab);
+    int32_t y1 = ((int64_t)y * (int64_t)gain) >> 24;
+    if (add)
       output[i] += y1;
-      phase += freq;
-    }
-  } else {
-    for (int i = 0; i < _N_; i++) {
-      gain += dgain;
-      int32_t y = getRaw(phase + input[i], wave, fold);
-      int32_t y1 = ((int64_t)y * (int64_t)gain) >> 24;
+    else
       output[i] = y1;
-      phase += freq;
-    }
+    phase += freq;
   }
 }
 
-void FmOpKernel::compute_pure(int32_t *output, int32_t phase0, 
-                              int32_t freq, wavetype wave,
-                              int16_t fold, int32_t gain1, int32_t gain2, bool add) {
+template<wavetype wave, bool add>
+static void compute_pure_block(int32_t *output, int32_t phase0, int32_t freq,
+                               int32_t foldgain, const int16_t *tab,
+                               int32_t gain1, int32_t gain2) {
   int32_t dgain = (gain2 - gain1 + (_N_ >> 1)) >> LG_N;
   int32_t gain = gain1;
   int32_t phase = phase0;
-  if (add) {
-    for (int i = 0; i < _N_; i++) {
-      gain += dgain;
-      int32_t y = getRaw(phase, wave, fold);
-      int32_t y1 = ((int64_t)y * (int64_t)gain) >> 24;
+  for (int i = 0; i < _N_; i++) {
+    gain += dgain;
+    int32_t y = getRaw<wave>(phase, foldgain, tab);
+    int32_t y1 = ((int64_t)y * (int64_t)gain) >> 24;
+    if (add)
       output[i] += y1;
-      phase += freq;
-    }
-  } else {
-    for (int i = 0; i < _N_; i++) {
-      gain += dgain;
-      int32_t y = getRaw(phase, wave, fold);
-      int32_t y1 = ((int64_t)y * (int64_t)gain) >> 24;
+    else
       output[i] = y1;
-      phase += freq;
-    }
+    phase += freq;
   }
 }
 
-#define noDOUBLE_ACCURACY
-#define HIGH_ACCURACY
-
-void FmOpKernel::compute_fb(int32_t *output, int32_t phase0, int32_t freq, 
-                            wavetype wave, int16_t fold, int32_t gain1, int32_t gain2,
-                            int32_t *fb_buf, float fb_factor, bool add) {
+template<wavetype wave, bool add>
+static void compute_fb_block(int32_t *output, int32_t phase0, int32_t freq,
+                             int32_t foldgain, const int16_t *tab, int32_t gain1, int32_t gain2,
+                             int32_t *fb_buf, float fb_factor, bool sq) {
   int32_t dgain = (gain2 - gain1 + (_N_ >> 1)) >> LG_N;
   int32_t gain = gain1;
   int32_t phase = phase0;
   int32_t y0 = fb_buf[0];
   int32_t y = fb_buf[1];
-  bool sq = fb_factor < 0;
-  if (sq)
-    fb_factor = -fb_factor / 1.5;
-  if (fold > 0)
-    fb_factor /= (1.0 + fold / 3);   // reduce the effect of feedback when folding
-  if (add) {
-    for (int i = 0; i < _N_; i++) { 
-      gain += dgain;
-      // int32_t avg_sample = (y0 + y) >> 1;
-      // int32_t avg_sample = y0 + (sq ? ((int64_t)y * (int64_t)y) >> 24 : y) >> 1;
-      int32_t avg_sample = (y0 + y) >> 1;
-      if (sq)
-        avg_sample = ((int64_t)avg_sample * (int64_t)avg_sample) >> 24;
-      int32_t scaled_fb = avg_sample * fb_factor;
-      // scaled_fb = ((int64_t)scaled_fb * (int64_t)scaled_fb) >> 24;
-      y0 = y;
-      y = getRaw(phase + scaled_fb, wave, fold);
-      // y = ((int64_t)y * (int64_t)gain) >> 24;
-      // output[i] += y;
+  for (int i = 0; i < _N_; i++) {
+    gain += dgain;
+    // int32_t avg_sample = y0 + (sq ? ((int64_t)y * (int64_t)y) >> 24 : y) >> 1;
+    int32_t avg_sample = (y0 + y) >> 1;
+    if (sq)
+      avg_sample = ((int64_t)avg_sample * (int64_t)avg_sample) >> 24;
+    int32_t scaled_fb = avg_sample * fb_factor;
+    // scaled_fb = ((int64_t)scaled_fb * (int64_t)scaled_fb) >> 24;
+    y0 = y;
+    y = getRaw<wave>(phase + scaled_fb, foldgain, tab);
+    if (add)
       output[i] += ((int64_t)y * (int64_t)gain) >> 24;
-      phase += freq;
-    }
-  } else {
-    for (int i = 0; i < _N_; i++) {
-      gain += dgain;
-      // int32_t avg_sample = (y0 + y) >> 1;
-      // int32_t avg_sample = y0 + (sq ? ((int64_t)y * (int64_t)y) >> 24 : y) >> 1;
-      int32_t avg_sample = (y0 + y) >> 1;
+    else
+      output[i] = ((int64_t)y * (int64_t)gain) >> 24;
+    phase += freq;
+  }
+  fb_buf[0] = y0;
+  fb_buf[1] = y;
+}
+
+// Voice per lane feedback: lane l belongs to a different voice, output is
+// stored [sample][lane] and always overwritten. The arithmetic per lane is
+// exactly that of compute_fb_block. Each lane reads its own band-limited
+// table, tabs[l].
+template<wavetype wave>
+static void compute_fb_lanes_block(int32_t *output, const int32_t *phase0, const int32_t *freq,
+                                   int32_t foldgain, const int16_t *const *tabs,
+                                   const int32_t *gain1, const int32_t *gain2,
+                                   int32_t *fb_buf0, int32_t *fb_buf1, float fb_factor, bool sq) {
+  int32_t dgain[FM_LANES], gain[FM_LANES], phase[FM_LANES];
+  for (int l = 0; l < FM_LANES; l++) {
+    dgain[l] = (gain2[l] - gain1[l] + (_N_ >> 1)) >> LG_N;
+    gain[l] = gain1[l];
+    phase[l] = phase0[l];
+  }
+  for (int i = 0; i < _N_; i++) {
+    for (int l = 0; l < FM_LANES; l++) {
+      gain[l] += dgain[l];
+      int32_t avg_sample = (fb_buf0[l] + fb_buf1[l]) >> 1;
       if (sq)
         avg_sample = ((int64_t)avg_sample * (int64_t)avg_sample) >> 24;
       int32_t scaled_fb = avg_sample * fb_factor;
-      // scaled_fb = ((int64_t)scaled_fb * (int64_t)scaled_fb) >> 24;
-      y0 = y;
-      y = getRaw(phase + scaled_fb, wave, fold);
-      // y = ((int64_t)y * (int64_t)gain) >> 24;
-      // output[i] = y;
-      output[i] = ((int64_t)y * (int64_t)gain) >> 24;
-      phase += freq;
+      fb_buf0[l] = fb_buf1[l];
+      fb_buf1[l] = getRaw<wave>(phase[l] + scaled_fb, foldgain, tabs[l]);
+      output[i * FM_LANES + l] = ((int64_t)fb_buf1[l] * (int64_t)gain[l]) >> 24;
+      phase[l] += freq[l];
     }
   }
-  fb_buf[0] = y0;
-  fb_buf[1] = y;
-}
\ No newline at end of file
+}
+
+// Vectorised versions of compute and compute_pure for the plain wave types.
+// Lanes hold consecutive samples: phase and gain are stepped by 8 (or 4)
+// samples at a time and each 64 bit multiply-shift is done per lane pair, so
+// the results are bit identical to the scalar kernels above. The folding
+// waves and compute_fb (a sample by sample recurrence) stay scalar.
+//
+// The Teensy 4 (Cortex-M7) has neither MVE/Helium nor a 32 bit lane SIMD
+// unit, so only host builds get a vector path: AVX2 on x86-64, selected at
+// run time by CPU feature, and NEON on AArch64.
+
+#if defined(__x86_64__) && defined(__GNUC__)
+
+#define FMOP_KERNEL_AVX2
+#include <immintrin.h>
+
+#define AVX2_TARGET __attribute__((target("avx2")))
+
+static bool cpuHasAvx2() {
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2");
+}
+
+static const bool have_avx2 = cpuHasAvx2();
+
+// Low 32 bits of ((int64_t)a * b) >> shift in each lane
+template<int shift>
+AVX2_TARGET static inline __m256i mulshift_avx2(__m256i a, __m256i b) {
+  __m256i even = _mm256_srli_epi64(_mm256_mul_epi32(a, b), shift);
+  __m256i odd = _mm256_mul_epi32(_mm256_srli_epi64(a, 32), _mm256_srli_epi64(b, 32));
+  odd = _mm256_slli_epi64(_mm256_srli_epi64(odd, shift), 32);
+  return _mm256_blend_epi32(even, odd, 0xaa);
+}
+
+// y0 + (y1 - y0) * lowbits, interpolating the 16 bit table entries y0 (low
+// half) and y1 (high half) of each lane
+AVX2_TARGET static inline __m256i interpolate_avx2(__m256i pair, __m256i lowbits) {
+  const int SHIFT = 24 - SIN_LG_N_SAMPLES;
+  __m256i y0 = _mm256_srai_epi32(_mm256_slli_epi32(pair, 16), 16 - BL_SHIFT);
+  __m256i y1 = _mm256_srai_epi32(_mm256_and_si256(pair, _mm256_set1_epi32(0xffff0000)), 16 - BL_SHIFT);
+  return _mm256_add_epi32(y0, mulshift_avx2<SHIFT>(_mm256_sub_epi32(y1, y0), lowbits));
+}
+
+// tab is the band-limited table of the triangle or square. Its entries are
+// 16 bit, so one 32 bit gather reads an entry and the next one.
+template<wavetype wave>
+AVX2_TARGET static inline __m256i lookup_avx2(__m256i phase, const int16_t *tab) {
+  const int SHIFT = 24 - SIN_LG_N_SAMPLES;
+  __m256i lowbits = _mm256_and_si256(phase, _mm256_set1_epi32((1 << SHIFT) - 1));
+  if (wave == SIN) {
+    __m256i ix = _mm256_and_si256(_mm256_srai_epi32(phase, SHIFT - 1),
+                                  _mm256_set1_epi32((SIN_N_SAMPLES - 1) << 1));
+    __m256i dy = _mm256_i32gather_epi32(sintab, ix, 4);
+    __m256i y0 = _mm256_i32gather_epi32(sintab + 1, ix, 4);
+    return _mm256_add_epi32(y0, mulshift_avx2<SHIFT>(dy, lowbits));
+  }
+  __m256i ix = _mm256_and_si256(_mm256_srai_epi32(phase, SHIFT), _mm256_set1_epi32(SIN_N_SAMPLES - 1));
+  return interpolate_avx2(_mm256_i32gather_epi32((const int *)tab, ix, 2), lowbits);
+}
+
+// As lookup_avx2 with a table per lane, tabs[l], which may be in different
+// arrays, so the gathers take whole addresses four lanes at a time
+template<wavetype wave>
+AVX2_TARGET static inline __m256i lookup_lanes_avx2(__m256i phase, const int16_t *const *tabs) {
+  if (wave == SIN)
+    return lookup_avx2<wave>(phase, NULL);
+  const int SHIFT = 24 - SIN_LG_N_SAMPLES;
+  __m256i lowbits = _mm256_and_si256(phase, _mm256_set1_epi32((1 << SHIFT) - 1));
+  __m256i ix = _mm256_and_si256(_mm256_srai_epi32(phase, SHIFT), _mm256_set1_epi32(SIN_N_SAMPLES - 1));
+  __m256i lo = _mm256_add_epi64(_mm256_loadu_si256((const __m256i *)tabs),
+                                _mm256_slli_epi64(_mm256_cvtepi32_epi64(_mm256_castsi256_si128(ix)), 1));
+  __m256i hi = _mm256_add_epi64(_mm256_loadu_si256((const __m256i *)(tabs + 4)),
+                                _mm256_slli_epi64(_mm256_cvtepi32_epi64(_mm256_extracti128_si256(ix, 1)), 1));
+  __m256i pair = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm256_i64gather_epi32(NULL, lo, 1)),
+                                         _mm256_i64gather_epi32(NULL, hi, 1), 1);
+  return interpolate_avx2(pair, lowbits);
+}
+
+// input is NULL for compute_pure
+template<wavetype wave, bool add>
+AVX2_TARGET static void compute_avx2(int32_t *output, const int32_t *input,
+                                     int32_t phase0, int32_t freq, const int16_t *tab,
+                                     int32_t gain1, int32_t gain2) {
+  int32_t dgain = (gain2 - gain1 + (_N_ >> 1)) >> LG_N;
+  __m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+  __m256i phase = _mm256_add_epi32(_mm256_set1_epi32(phase0),
+                                   _mm256_mullo_epi32(lane, _mm256_set1_epi32(freq)));
+  __m256i gain = _mm256_add_epi32(_mm256_set1_epi32(gain1),
+                                  _mm256_mullo_epi32(_mm256_add_epi32(lane, _mm256_set1_epi32(1)),
+                                                     _mm256_set1_epi32(dgain)));
+  __m256i dphase = _mm256_set1_epi32((int32_t)((uint32_t)freq << 3));
+  __m256i dgain8 = _mm256_set1_epi32((int32_t)((uint32_t)dgain << 3));
+  for (int i = 0; i < _N_; i += 8) {
+    __m256i p = phase;
+    if (input)
+      p = _mm256_add_epi32(p, _mm256_loadu_si256((const __m256i *)(input + i)));
+    __m256i y = mulshift_avx2<24>(lookup_avx2<wave>(p, tab), gain);
+    if (add)
+      y = _mm256_add_epi32(y, _mm256_loadu_si256((const __m256i *)(output + i)));
+    _mm256_storeu_si256((__m256i *)(output + i), y);
+    phase = _mm256_add_epi32(phase, dphase);
+    gain = _mm256_add_epi32(gain, dgain8);
+  }
+}
+
+// Voice per lane: one vector holds the same sample of FM_LANES voices, so
+// the feedback recurrence vectorises too.
+template<wavetype wave>
+AVX2_TARGET static void compute_fb_lanes_avx2(int32_t *output, const int32_t *phase0, const int32_t *freq,
+                                              const int16_t *const *tabs,
+                                              const int32_t *gain1, const int32_t *gain2,
+                                              int32_t *fb_buf0, int32_t *fb_buf1, float fb_factor, bool sq) {
+  __m256i gain = _mm256_loadu_si256((const __m256i *)gain1);
+  __m256i dgain = _mm256_srai_epi32(_mm256_add_epi32(_mm256_sub_epi32(_mm256_loadu_si256((const __m256i *)gain2), gain),
+                                                     _mm256_set1_epi32(_N_ >> 1)), LG_N);
+  __m256i phase = _mm256_loadu_si256((const __m256i *)phase0);
+  __m256i dphase = _mm256_loadu_si256((const __m256i *)freq);
+  __m256i y0 = _mm256_loadu_si256((const __m256i *)fb_buf0);
+  __m256i y = _mm256_loadu_si256((const __m256i *)fb_buf1);
+  __m256 factor = _mm256_set1_ps(fb_factor);
+  for (int i = 0; i < _N_; i++) {
+    gain = _mm256_add_epi32(gain, dgain);
+    __m256i avg_sample = _mm256_srai_epi32(_mm256_add_epi32(y0, y), 1);
+    if (sq)
+      avg_sample = mulshift_avx2<24>(avg_sample, avg_sample);
+    // same float rounding and truncation as avg_sample * fb_factor
+    __m256i scaled_fb = _mm256_cvttps_epi32(_mm256_mul_ps(_mm256_cvtepi32_ps(avg_sample), factor));
+    y0 = y;
+    y = lookup_lanes_avx2<wave>(_mm256_add_epi32(phase, scaled_fb), tabs);
+    _mm256_storeu_si256((__m256i *)(output + i * FM_LANES), mulshift_avx2<24>(y, gain));
+    phase = _mm256_add_epi32(phase, dphase);
+  }
+  _mm256_storeu_si256((__m256i *)fb_buf0, y0);
+  _mm256_storeu_si256((__m256i *)fb_buf1, y);
+}
+
+#define compute_simd compute_avx2
+#define HAVE_SIMD have_avx2
+
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+
+#define FMOP_KERNEL_NEON
+#include <arm_neon.h>
+
+// Low 32 bits of ((int64_t)a * b) >> shift in each lane
+template<int shift>
+static inline int32x4_t mulshift_neon(int32x4_t a, int32x4_t b) {
+  int64x2_t lo = vshrq_n_s64(vmull_s32(vget_low_s32(a), vget_low_s32(b)), shift);
+  int64x2_t hi = vshrq_n_s64(vmull_high_s32(a, b), shift);
+  return vcombine_s32(vmovn_s64(lo), vmovn_s64(hi));
+}
+
+static inline int32x4_t gather_neon(const int32_t *tab, int32x4_t ix) {
+  int32_t i[4], v[4];
+  vst1q_s32(i, ix);
+  v[0] = tab[i[0]];
+  v[1] = tab[i[1]];
+  v[2] = tab[i[2]];
+  v[3] = tab[i[3]];
+  return vld1q_s32(v);
+}
+
+static inline int32x4_t gather_neon(const int16_t *tab, int32x4_t ix) {
+  int32_t i[4], v[4];
+  vst1q_s32(i, ix);
+  v[0] = tab[i[0]];
+  v[1] = tab[i[1]];
+  v[2] = tab[i[2]];
+  v[3] = tab[i[3]];
+  return vld1q_s32(v);
+}
+
+template<wavetype wave>
+static inline int32x4_t lookup_neon(int32x4_t phase, const int16_t *tab) {
+  const int SHIFT = 24 - SIN_LG_N_SAMPLES;
+  int32x4_t lowbits = vandq_s32(phase, vdupq_n_s32((1 << SHIFT) - 1));
+  if (wave == SIN) {
+    int32x4_t ix = vandq_s32(vshrq_n_s32(phase, SHIFT - 1), vdupq_n_s32((SIN_N_SAMPLES - 1) << 1));
+    int32x4_t dy = gather_neon(sintab, ix);
+    int32x4_t y0 = gather_neon(sintab + 1, ix);
+    return vaddq_s32(y0, mulshift_neon<SHIFT>(dy, lowbits));
+  }
+  int32x4_t ix = vandq_s32(vshrq_n_s32(phase, SHIFT), vdupq_n_s32(SIN_N_SAMPLES - 1));
+  int32x4_t y0 = vshlq_n_s32(gather_neon(tab, ix), BL_SHIFT);
+  int32x4_t y1 = vshlq_n_s32(gather_neon(tab + 1, ix), BL_SHIFT);
+  return vaddq_s32(y0, mulshift_neon<SHIFT>(vsubq_s32(y1, y0), lowbits));
+}
+
+// input is NULL for compute_pure
+template<wavetype wave, bool add>
+static void compute_neon(int32_t *output, const int32_t *input,
+                         int32_t phase0, int32_t freq, const int16_t *tab,
+                         int32_t gain1, int32_t gain2) {
+  int32_t dgain = (gain2 - gain1 + (_N_ >> 1)) >> LG_N;
+  const int32_t lanes[4] = { 0, 1, 2, 3 };
+  int32x4_t lane = vld1q_s32(lanes);
+  int32x4_t phase = vmlaq_s32(vdupq_n_s32(phase0), lane, vdupq_n_s32(freq));
+  int32x4_t gain = vmlaq_s32(vdupq_n_s32(gain1), vaddq_s32(lane, vdupq_n_s32(1)), vdupq_n_s32(dgain));
+  int32x4_t dphase = vdupq_n_s32((int32_t)((uint32_t)freq << 2));
+  int32x4_t dgain4 = vdupq_n_s32((int32_t)((uint32_t)dgain << 2));
+  for (int i = 0; i < _N_; i += 4) {
+    int32x4_t p = phase;
+    if (input)
+      p = vaddq_s32(p, vld1q_s32(input + i));
+    int32x4_t y = mulshift_neon<24>(lookup_neon<wave>(p, tab), gain);
+    if (add)
+      y = vaddq_s32(y, vld1q_s32(output + i));
+    vst1q_s32(output + i, y);
+    phase = vaddq_s32(phase, dphase);
+    gain = vaddq_s32(gain, dgain4);
+  }
+}
+
+#define compute_simd compute_neon
+#define HAVE_SIMD true
+
+#endif
+
+// Folding with no fold amount is the plain waveform
+static wavetype effectiveWave(wavetype wave, int16_t fold) {
+  if (fold == 0) {
+    if (wave == SINFOLD)
+      return SIN;
+    if (wave == TRIFOLD)
+      return TRI;
+  }
+  return wave;
+}
+
+// Select the specialised kernel once per block
+#define DISPATCH_WAVE(wave, add, kernel, args) \
+  switch (wave) { \
+    case SIN: \
+    default: \
+      if (add) kernel<SIN, true> args; else kernel<SIN, false> args; \
+      break; \
+    case TRI: \
+      if (add) kernel<TRI, true> args; else kernel<TRI, false> args; \
+      break; \
+    case SQR: \
+      if (add) kernel<SQR, true> args; else kernel<SQR, false> args; \
+      break; \
+    case SINFOLD: \
+      if (add) kernel<SINFOLD, true> args; else kernel<SINFOLD, false> args; \
+      break; \
+    case TRIFOLD: \
+      if (add) kernel<TRIFOLD, true> args; else kernel<TRIFOLD, false> args; \
+      break; \
+  }
+
+// As DISPATCH_WAVE for kernels that always overwrite
+#define DISPATCH_WAVE_ONLY(wave, kernel, args) \
+  switch (wave) { \
+    case SIN: \
+    default: kernel<SIN> args; break; \
+    case TRI: kernel<TRI> args; break; \
+    case SQR: kernel<SQR> args; break; \
+    case SINFOLD: kernel<SINFOLD> args; break; \
+    case TRIFOLD: kernel<TRIFOLD> args; break; \
+  }
+
+#ifdef compute_simd
+// Returns false for the wave types without a vector kernel
+static bool dispatch_simd(int32_t *output, const int32_t *input,
+                          int32_t phase0, int32_t freq, wavetype wave,
+                          int32_t gain1, int32_t gain2, bool add) {
+  if (!HAVE_SIMD)
+    return false;
+  const int16_t *tab = waveTable(wave, freq);
+  switch (wave) {
+    case SIN:
+      if (add) compute_simd<SIN, true>(output, input, phase0, freq, tab, gain1, gain2);
+      else compute_simd<SIN, false>(output, input, phase0, freq, tab, gain1, gain2);
+      return true;
+    case TRI:
+      if (add) compute_simd<TRI, true>(output, input, phase0, freq, tab, gain1, gain2);
+      else compute_simd<TRI, false>(output, input, phase0, freq, tab, gain1, gain2);
+      return true;
+    case SQR:
+      if (add) compute_simd<SQR, true>(output, input, phase0, freq, tab, gain1, gain2);
+      else compute_simd<SQR, false>(output, input, phase0, freq, tab, gain1, gain2);
+      return true;
+    default:
+      return false;
+  }
+}
+#endif
+
+const char *FmOpKernel::simd_name() {
+#if defined(FMOP_KERNEL_AVX2)
+  return have_avx2 ? "avx2" : "scalar";
+#elif defined(FMOP_KERNEL_NEON)
+  return "neon";
+#else
+  return "scalar";
+#endif
+}
+
+void FmOpKernel::compute(int32_t *output, const int32_t *input,
+                         int32_t phase0, int32_t freq, wavetype wave,
+                         int16_t fold, int32_t gain1, int32_t gain2, bool add) {
+#ifdef compute_simd
+  if (dispatch_simd(output, input, phase0, freq, effectiveWave(wave, fold), gain1, gain2, add))
+    return;
+#endif
+  compute_scalar(output, input, phase0, freq, wave, fold, gain1, gain2, add);
+}
+
+void FmOpKernel::compute_pure(int32_t *output, int32_t phase0, 
+                              int32_t freq, wavetype wave,
+                              int16_t fold, int32_t gain1, int32_t gain2, bool add) {
+#ifdef compute_simd
+  if (dispatch_simd(output, NULL, phase0, freq, effectiveWave(wave, fold), gain1, gain2, add))
+    return;
+#endif
+  compute_pure_scalar(output, phase0, freq, wave, fold, gain1, gain2, add);
+}
+
+void FmOpKernel::compute_scalar(int32_t *output, const int32_t *input,
+                                int32_t phase0, int32_t freq, wavetype wave,
+                                int16_t fold, int32_t gain1, int32_t gain2, bool add) {
+  int32_t foldgain = Fold::gain(fold);
+  wave = effectiveWave(wave, fold);
+  DISPATCH_WAVE(wave, add, compute_block,
+                (output, input, phase0, freq, foldgain, waveTable(wave, freq), gain1, gain2));
+}
+
+void FmOpKernel::compute_pure_scalar(int32_t *output, int32_t phase0, 
+                                     int32_t freq, wavetype wave,
+                                     int16_t fold, int32_t gain1, int32_t gain2, bool add) {
+  int32_t foldgain = Fold::gain(fold);
+  wave = effectiveWave(wave, fold);
+  DISPATCH_WAVE(wave, add, compute_pure_block,
+                (output, phase0, freq, foldgain, waveTable(wave, freq), gain1, gain2));
+}
+
+#define noDOUBLE_ACCURACY
+#define HIGH_ACCURACY
+
+// Negative feedback factors select squared feedback
+static float fbScale(float fb_factor, int16_t fold, bool &sq) {
+  sq = fb_factor < 0;
+  if (sq)
+    fb_factor = -fb_factor / 1.5;
+  if (fold > 0)
+    fb_factor /= (1.0 + fold / 3);   // reduce the effect of feedback when folding
+  return fb_factor;
+}
+
+void FmOpKernel::compute_fb(int32_t *output, int32_t phase0, int32_t freq, 
+                            wavetype wave, int16_t fold, int32_t gain1, int32_t gain2,
+                            int32_t *fb_buf, float fb_factor, bool add) {
+  int32_t foldgain = Fold::gain(fold);
+  bool sq;
+  fb_factor = fbScale(fb_factor, fold, sq);
+  wave = effectiveWave(wave, fold);
+  DISPATCH_WAVE(wave, add, compute_fb_block,
+                (output, phase0, freq, foldgain, waveTable(wave, freq), gain1, gain2,
+                 fb_buf, fb_factor, sq));
+}
+
+void FmOpKernel::compute_fb_lanes(int32_t *output, const int32_t *phase0, const int32_t *freq,
+                                  wavetype wave, int16_t fold, const int32_t *gain1, const int32_t *gain2,
+                                  int32_t *fb_buf0, int32_t *fb_buf1, float fb_factor) {
+  bool sq;
+  fb_factor = fbScale(fb_factor, fold, sq);
+  wave = effectiveWave(wave, fold);
+  // every lane's band-limited table
+  const int16_t *tabs[FM_LANES];
+  for (int l = 0; l < FM_LANES; l++)
+    tabs[l] = waveTable(wave, freq[l]);
+#ifdef FMOP_KERNEL_AVX2
+  if (have_avx2 && (wave == SIN || wave == TRI || wave == SQR)) {
+    DISPATCH_WAVE_ONLY(wave, compute_fb_lanes_avx2,
+                       (output, phase0, freq, tabs, gain1, gain2, fb_buf0, fb_buf1, fb_factor, sq));
+    return;
+  }
+#endif
+  int32_t foldgain = Fold::gain(fold);
+  DISPATCH_WAVE_ONLY(wave, compute_fb_lanes_block,
+                     (output, phase0, freq, foldgain, tabs, gain1, gain2,
+                      fb_buf0, fb_buf1, fb_factor, sq));
+}
@@ -17,12 +17,16 @@
 #ifndef __FM_OP_KERNEL_H
 #define __FM_OP_KERNEL_H
 
+// Voices rendered together by the voice per lane path
+#define FM_LANES 8
+
 struct FmOpParams {
   int32_t level_in;      // value to be computed (from level to gain[0])
   int32_t gain_out;      // computed value (gain[1] to gain[0])
   int32_t freq;
   int32_t phase;
   int16_t fold;
+  wavetype wave;
 };
 
 class FmOpKernel {
@@ -43,6 +47,55 @@ class FmOpKernel {
     static void compute_fb(int32_t *output, int32_t phase0, int32_t freq, wavetype,
                            int16_t fold, int32_t gain1, int32_t gain2, 
                            int32_t *fb_buf, float fb_factor, bool add);
+
+    // compute and compute_pure use vectorised kernels where the platform
+    // has them; these are the portable versions they must match exactly.
+    static void compute_scalar(int32_t *output, const int32_t *input,
+                               int32_t phase0, int32_t freq, wavetype wave,
+                               int16_t fold, int32_t gain1, int32_t gain2, bool add);
+    static void compute_pure_scalar(int32_t *output, int32_t phase0, int32_t freq, wavetype wave,
+                                    int16_t fold, int32_t gain1, int32_t gain2, bool add);
+
+    // "avx2", "neon" or "scalar"
+    static const char *simd_name();
+
+    // Voice per lane compute_fb used by FmCore::render_lanes. Each of the
+    // FM_LANES lanes is a different voice with its own phase, freq, gains
+    // and feedback state (fb_buf0/fb_buf1 hold fb_buf[0]/fb_buf[1] of each
+    // voice). output is overwritten, interleaved as [sample][lane]; per lane
+    // the result matches compute_fb exactly.
+    static void compute_fb_lanes(int32_t *output, const int32_t *phase0, const int32_t *freq,
+                                 wavetype wave, int16_t fold, const int32_t *gain1, const int32_t *gain2,
+                                 int32_t *fb_buf0, int32_t *fb_buf1, float fb_factor);
+};
+
+// Wavefolder used by SINFOLD and TRIFOLD. The fold parameter (config.fine
+// while folding) is converted to a Q24 gain once per block so that apply()
+// needs integer arithmetic only; it must not be called with a fold of 0.
+class Fold {
+  public:
+    static int32_t gain(int16_t fold);
+
+    // Q24 in, Q24 out
+    static int32_t apply(int32_t v, int32_t gain);
+
+    // The original floating point folder, foldamount = MAXFOLD * fold / 200.
+    // Kept as the reference for apply().
+    static int32_t reference(int32_t v, float foldamount);
 };
 
+inline
+int32_t Fold::apply(int32_t v, int32_t gain) {
+  const int32_t one = 1 << 24;
+  int32_t x = ((int64_t)v * (int64_t)gain) >> 24;
+  // a negative fold amount softens the fold above full scale
+  if (gain < 0 && x > one)
+    x = one + (x - one) / 10;
+  // twice the distance to the nearest integer, rounding half away from zero
+  int32_t r = x >= 0 ? (x + (one >> 1)) & -one : -((-x + (one >> 1)) & -one);
+  int32_t d = x - r;
+  d = d < 0 ? -d : d;
+  return x > 0 ? d << 1 : -(d << 1);
+}
+
 #endif
@@ -16,39 +16,79 @@
 
 // Resolve frequency signal (1.0 in Q24 format = 1 octave) to phase delta.
 
-// The LUT is just a global, and we'll need the init function to be called before
-// use.
+// The LUT for FREQLUT_SAMPLE_RATE is generated at compile time; init
+// selects it, or one built in RAM for any other rate, and switches lookup
+// over to it with a single pointer store.
 
 #include <stdint.h>
 #include <math.h>
+#include "platform.h"
 
 #include "freqlut.h"
 #include "synth.h"
 
-#define LG_N_SAMPLES 10
-#define N_SAMPLES (1 << LG_N_SAMPLES)
-#define SAMPLE_SHIFT (24 - LG_N_SAMPLES)
+#define SAMPLE_SHIFT (24 - FREQLUT_LG_N_SAMPLES)
 
 #define MAX_LOGFREQ_INT 20
 
-int32_t lut[N_SAMPLES + 1];
-
-void Freqlut::init(FRAC_NUM sample_rate) {
+static constexpr FreqlutTable freqtable(FRAC_NUM sample_rate) {
+  FreqlutTable tab = {};
   FRAC_NUM y = (1LL << (24 + MAX_LOGFREQ_INT)) / sample_rate;
-  FRAC_NUM inc = pow(2, 1.0 / N_SAMPLES);
-  for (int i = 0; i < N_SAMPLES + 1; i++) {
-    lut[i] = (int32_t)floor(y + 0.5);
+  FRAC_NUM inc = ConstMath::exp(M_LN2 / FREQLUT_N_SAMPLES);
+  for (int i = 0; i < FREQLUT_N_SAMPLES + 1; i++) {
+    tab.v[i] = ConstMath::floor(y + 0.5);
     y *= inc;
   }
+  return tab;
+}
+
+static constexpr FreqlutTable lut PROGMEM = freqtable(FREQLUT_SAMPLE_RATE);
+
+Freqlut::Freqlut() : lut_(lut), nextslot_(0) {
+  for (int slot = 0; slot < FREQLUT_RAM_TABLES; slot++) {
+    ramrate_[slot] = 0;
+    ramlut_[slot] = NULL;
+  }
+}
+
+Freqlut::~Freqlut() {
+  for (int slot = 0; slot < FREQLUT_RAM_TABLES; slot++)
+    delete ramlut_[slot];
+}
+
+// A voice may be reading the current table, so init never writes that one.
+void Freqlut::init(FRAC_NUM sample_rate) {
+  const int32_t *next = lut;
+  if (sample_rate != FREQLUT_SAMPLE_RATE) {
+    int slot = 0;
+    while (slot < FREQLUT_RAM_TABLES && !(ramlut_[slot] && ramrate_[slot] == sample_rate))
+      slot++;
+    if (slot == FREQLUT_RAM_TABLES) {
+      // none for this rate: build one in the slot used longest ago
+      // (skipping the current table)
+      slot = nextslot_;
+      if (ramlut_[slot] && lut_ == *ramlut_[slot])
+        slot = (slot + 1) % FREQLUT_RAM_TABLES;
+      nextslot_ = (slot + 1) % FREQLUT_RAM_TABLES;
+      if (!ramlut_[slot])
+        ramlut_[slot] = new FreqlutTable;
+      *ramlut_[slot] = freqtable(sample_rate);
+      ramrate_[slot] = sample_rate;
+    }
+    next = *ramlut_[slot];
+  }
+  SynthMemoryBarrier();
+  lut_ = next;
 }
 
 // Note: if logfreq is more than 20.0, the results will be inaccurate. However,
 // that will be many times the Nyquist rate.
-int32_t Freqlut::lookup(int32_t logfreq) {
+int32_t Freqlut::lookup(int32_t logfreq) const {
   int ix = (logfreq & 0xffffff) >> SAMPLE_SHIFT;
 
-  int32_t y0 = lut[ix];
-  int32_t y1 = lut[ix + 1];
+  const int32_t *tab = lut_;
+  int32_t y0 = tab[ix];
+  int32_t y1 = tab[ix + 1];
   int lowbits = logfreq & ((1 << SAMPLE_SHIFT) - 1);
   int32_t y = y0 + ((((int64_t)(y1 - y0) * (int64_t)lowbits)) >> SAMPLE_SHIFT);
   int hibits = logfreq >> 24;
@@ -14,10 +14,45 @@
    limitations under the License.
 */
 
+#ifndef __FREQLUT_H
+#define __FREQLUT_H
+
 #include "synth.h"
+#include "const_table.h"
+
+#define FREQLUT_LG_N_SAMPLES 10
+#define FREQLUT_N_SAMPLES (1 << FREQLUT_LG_N_SAMPLES)
+
+// Sample rate the table is built for at compile time, SAMPLE_RATE in
+// synth_dexed.h on the Teensy. Other rates get a table built in RAM.
+#ifndef FREQLUT_SAMPLE_RATE
+#define FREQLUT_SAMPLE_RATE 44100
+#endif
+
+typedef ConstTable<int32_t, FREQLUT_N_SAMPLES + 1> FreqlutTable;
+
+// Tables built for other rates that a Freqlut keeps, for when its rate
+// changes back
+#define FREQLUT_RAM_TABLES 4
 
+// Each Dexed has its own, so that changing the rate of one leaves the
+// others alone.
 class Freqlut {
   public:
-    static void init(FRAC_NUM sample_rate);
-    static int32_t lookup(int32_t logfreq);
+    Freqlut();
+    ~Freqlut();
+
+    void init(FRAC_NUM sample_rate);
+    int32_t lookup(int32_t logfreq) const;
+
+  private:
+    Freqlut(const Freqlut &);
+    Freqlut &operator=(const Freqlut &);
+
+    const int32_t *volatile lut_;
+    FRAC_NUM ramrate_[FREQLUT_RAM_TABLES];
+    FreqlutTable *ramlut_[FREQLUT_RAM_TABLES];
+    int nextslot_;
 };
+
+#endif
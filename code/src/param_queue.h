@@ -0,0 +1,48 @@
+/*
+   Parameter changes from the control loop to the audio thread.
+
+   A ParamEvent sets one configStruct field, for operator op where the
+   field is per operator, in the snapshot the voices are rendering from.
+   PARAM_CONFIG marks where setConfig published a whole new snapshot, so
+   a patch load and the single changes around it are taken in the order
+   they were made. Dexed drains the queue at the start of a getSamples
+   call and refreshes only what the changed fields affect.
+*/
+
+#ifndef PARAM_QUEUE_H
+#define PARAM_QUEUE_H
+
+#include <stdint.h>
+
+#include "spsc_queue.h"
+
+enum ParamId {
+  PARAM_COARSE,
+  PARAM_FINE,
+  PARAM_WAVE,
+  PARAM_LEVEL,
+  PARAM_SCALE,
+  PARAM_ENV_A,
+  PARAM_ENV_D,
+  PARAM_ENV_S,
+  PARAM_ENV_R,
+  PARAM_DRONE,
+  PARAM_DETUNE,
+  PARAM_FOLD,
+  PARAM_FEEDBACK,
+  PARAM_SYNC,
+  PARAM_CONFIG
+};
+
+struct ParamEvent {
+  uint8_t param;
+  uint8_t op;
+  float value;
+};
+
+// Enough for every field of a configStruct to change at once
+#define PARAM_QUEUE_SIZE 64
+
+typedef SpscQueue<ParamEvent, PARAM_QUEUE_SIZE> ParamQueue;
+
+#endif
@@ -0,0 +1,112 @@
+/*
+   Platform layer for the CLFM engine.
+
+   On the Teensy this just pulls in the Arduino core and CMSIS-DSP. On a
+   host build (no ARDUINO define) it supplies the handful of Arduino/CMSIS
+   facilities the engine uses - Serial, millis(), constrain(), mixed type
+   min/max, PROGMEM, signed_saturate_rshift() and arm_float_to_q15() - so
+   the same sources can be compiled, profiled and sanitized on Linux.
+*/
+
+#ifndef PLATFORM_H
+#define PLATFORM_H
+
+#if defined(ARDUINO)
+
+#include <Arduino.h>
+#include <arm_math.h>
+
+#elif !defined(__circle__)
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <math.h>
+#include <chrono>
+#include <type_traits>
+
+#define DEC 10
+#define HEX 16
+
+// Teensy 4 keeps const data in RAM unless it is marked for flash
+#define PROGMEM
+
+// Debug output goes to stderr so that tools can use stdout for data
+class HostSerial {
+  public:
+    void print(const char *s) { fputs(s, stderr); }
+    void print(int v, int base = DEC) { fprintf(stderr, base == HEX ? "%x" : "%d", v); }
+    void print(double v) { fprintf(stderr, "%.2f", v); }
+    void println() { fputc('\n', stderr); }
+    template<typename T>
+    void println(T v) { print(v); println(); }
+    void printf(const char *fmt, ...) __attribute__((format(printf, 2, 3))) {
+      va_list args;
+      va_start(args, fmt);
+      vfprintf(stderr, fmt, args);
+      va_end(args);
+    }
+    void flush() { fflush(stderr); }
+};
+
+static HostSerial Serial;
+
+static inline uint32_t millis(void)
+{
+  static const auto start = std::chrono::steady_clock::now();
+  return (uint32_t)std::chrono::duration_cast<std::chrono::milliseconds>(
+           std::chrono::steady_clock::now() - start).count();
+}
+
+// The Teensy core provides min/max/constrain that accept mixed argument
+// types; synth.h only covers the single type case.
+template<typename A, typename B>
+inline typename std::common_type<A, B>::type min(const A& a, const B& b) {
+  return a < b ? a : b;
+}
+
+template<typename A, typename B>
+inline typename std::common_type<A, B>::type max(const A& a, const B& b) {
+  return a > b ? a : b;
+}
+
+template<typename T, typename L, typename H>
+inline T constrain(const T& amt, const L& low, const H& high) {
+  return amt < low ? (T)low : (amt > high ? (T)high : amt);
+}
+
+// Equivalent of the Cortex-M SSAT based helper in the Teensy core dspinst.h
+static inline int32_t signed_saturate_rshift(int32_t val, int bits, int rshift)
+{
+  int32_t out, max;
+
+  out = val >> rshift;
+  max = 1 << (bits - 1);
+  if (out >= 0)
+  {
+    if (out > max - 1) out = max - 1;
+  }
+  else
+  {
+    if (out < -max) out = -max;
+  }
+  return out;
+}
+
+typedef int16_t q15_t;
+
+// Matches the CMSIS-DSP reference (non rounding) implementation
+static inline void arm_float_to_q15(const float *pSrc, q15_t *pDst, uint32_t blockSize)
+{
+  for (uint32_t i = 0; i < blockSize; i++)
+  {
+    int32_t v = (int32_t)(pSrc[i] * 32768.0f);
+    pDst[i] = (q15_t)(v > 32767 ? 32767 : (v < -32768 ? -32768 : v));
+  }
+}
+
+#endif
+
+#endif
@@ -0,0 +1,57 @@
+/*
+   A lock free ring for one producer and one consumer (the audio
+   interrupt, or the rendering thread on a host). Each side only writes its
+   own index, and the barrier orders the item against the index that
+   publishes it.
+*/
+
+#ifndef SPSC_QUEUE_H
+#define SPSC_QUEUE_H
+
+#include "synth.h"
+
+template<typename T, unsigned size>
+class SpscQueue {
+  public:
+    SpscQueue() : read_(0), write_(0) {}
+
+    // Producer side; false if the queue is full
+    bool push(const T &item) {
+      unsigned w = write_;
+      if (w - read_ == size)
+        return false;
+      items_[w % size] = item;
+      SynthMemoryBarrier();
+      write_ = w + 1;
+      return true;
+    }
+
+    // Consumer side; the next item without taking it, false if the queue
+    // is empty
+    bool peek(T &item) {
+      unsigned r = read_;
+      if (r == write_)
+        return false;
+      SynthMemoryBarrier();
+      item = items_[r % size];
+      return true;
+    }
+
+    // Consumer side; false if the queue is empty
+    bool pop(T &item) {
+      if (!peek(item))
+        return false;
+      SynthMemoryBarrier();
+      read_ = read_ + 1;
+      return true;
+    }
+
+  private:
+    static_assert((size & (size - 1)) == 0, "size must be a power of 2");
+
+    T items_[size];
+    volatile unsigned read_;
+    volatile unsigned write_;
+};
+
+#endif
@@ -27,8 +27,28 @@
 
 #define _MAX_NOTES 16
 
+// Dexed keeps _MAX_NOTES voices in a static pool with each note on its own
+// cache lines (32 bytes on the Cortex-M7, 64 on most hosts)
+#if defined(ARDUINO)
+#define VOICE_ALIGN 32
+#else
+#define VOICE_ALIGN 64
+#endif
+
 #define CLFM_ALGOS
 
+// Render up to FM_LANES voices at once, one voice per SIMD lane. Only host
+// builds have a vector unit wide enough for it to pay off.
+#if !defined(ARDUINO)
+#define VOICE_BATCH
+#endif
+
+// Optional multithreaded voice rendering (Dexed::setRenderThreads), host
+// builds only
+#if !defined(ARDUINO)
+#define VOICE_THREADS
+#endif
+
 // This IS not be present on MSVC.
 // See http://stackoverflow.com/questions/126279/c99-stdint-h-header-and-ms-visual-studio
 #ifdef _MSC_VER
@@ -37,7 +57,16 @@ typedef unsigned __int32 uint32_t;
 typedef __int16 SInt16;
 #endif
 
+// The engine renders in blocks of _N_ samples, and envelopes, gain ramps
+// and queued events step once a block. A build can set LG_N from 4 to 7
+// (16 to 128 samples): smaller blocks time notes and control changes more
+// finely, for more per block overhead.
+#ifndef LG_N
 #define LG_N 6
+#endif
+#if LG_N < 4 || LG_N > 7
+#error "LG_N must be from 4 to 7"
+#endif
 #define _N_ (1 << LG_N)
 
 #if defined(__APPLE__)
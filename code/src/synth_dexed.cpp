@@ -47,6 +47,14 @@ void AudioSynthDexed::update(void)
     return;
   }
 
+  __disable_irq();
+  update_clock = sampleClock();
+  update_micros = micros();
+  __enable_irq();
+
+  if (update_hook)
+    update_hook();
+
   getSamples(AUDIO_BLOCK_SAMPLES, lblock->data);
 
   if (render_time > audio_block_time_us) // everything greater audio_block_time_us (2.9ms for buffer size of 128) is a buffer underrun!
@@ -60,6 +68,26 @@ void AudioSynthDexed::update(void)
 
   in_update = false;
 };
+
+void AudioSynthDexed::setOversampling(uint8_t factor)
+{
+  AudioNoInterrupts();
+  Dexed::setOversampling(factor);
+  AudioInterrupts();
+}
+
+uint32_t AudioSynthDexed::sampleTime(void)
+{
+  __disable_irq();
+  uint32_t clock = update_clock;
+  uint32_t elapsed = micros() - update_micros;
+  __enable_irq();
+
+  elapsed = (uint64_t)elapsed * sampleRate / 1000000;
+  if (elapsed >= AUDIO_BLOCK_SAMPLES)
+    elapsed = AUDIO_BLOCK_SAMPLES - 1; // the update is late
+  return clock + AUDIO_BLOCK_SAMPLES + elapsed;
+}
 #endif
 /*
   // https://www.musicdsp.org/en/latest/Effects/169-compressor.html#
@@ -30,7 +30,11 @@
 #endif
 #include <stdint.h>
 
+// The audio library's rate; a build for 48 or 96 kHz defines this and the
+// library's AUDIO_SAMPLE_RATE_EXACT to match
+#ifndef SAMPLE_RATE
 #define SAMPLE_RATE 44100
+#endif
 
 #define TRANSPOSE_FIX 24
 #define VOICE_SILENCE_LEVEL 1100
@@ -40,14 +44,38 @@
 //#define USE_SIMPLE_COMPRESSOR 1
 
 #if defined(TEENSYDUINO)
+#if AUDIO_BLOCK_SAMPLES % _N_
+#error "AUDIO_BLOCK_SAMPLES must be a multiple of the engine's block size _N_"
+#endif
+
 class AudioSynthDexed : public AudioStream, public Dexed
 {
   public:
 
-    AudioSynthDexed(uint8_t max_notes, uint16_t sample_rate) : AudioStream(0, NULL), Dexed(max_notes,sample_rate) { };
+    AudioSynthDexed(uint8_t max_notes, uint32_t sample_rate) : AudioStream(0, NULL), Dexed(max_notes,sample_rate),
+      audio_block_time_us(1000000ULL * AUDIO_BLOCK_SAMPLES / sample_rate) { };
+
+    // Called from the audio interrupt at the start of every update, before
+    // the block is rendered, for control inputs that should be read at
+    // block rate
+    void setUpdateHook(void (*hook)(void)) { update_hook = hook; };
+
+    // The sample clock time of now, for the queue methods: the time since
+    // the last update, in the block after the one it rendered. Events
+    // stamped with it play a fixed block late, at the point in the block
+    // where they happened, rather than all at the start of the next one.
+    uint32_t sampleTime(void);
+
+    // Dexed::setOversampling, with the audio interrupt held off while the
+    // voices and tables change
+    void setOversampling(uint8_t factor);
 
   protected:
-    const uint16_t audio_block_time_us = 1000000 / (SAMPLE_RATE / AUDIO_BLOCK_SAMPLES);
+    void (*volatile update_hook)(void) = NULL;
+    // sampleClock and micros at the start of the last update
+    volatile uint32_t update_clock = 0;
+    volatile uint32_t update_micros = 0;
+    const uint32_t audio_block_time_us;
     volatile bool in_update = false;
     void update(void);
 };
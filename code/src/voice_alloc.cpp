@@ -0,0 +1,55 @@
+#include "voice_alloc.h"
+
+VoiceAllocator::VoiceAllocator() {
+  reset(0);
+}
+
+void VoiceAllocator::reset(uint8_t n) {
+  free_.head = free_.tail = -1;
+  held_.head = held_.tail = -1;
+  if (n > _MAX_NOTES)
+    n = _MAX_NOTES;
+  for (uint8_t v = 0; v < n; v++)
+    pushBack(free_, v);
+}
+
+int8_t VoiceAllocator::allocate() {
+  int8_t voice;
+  if (free_.head >= 0) {
+    voice = free_.head;
+    unlink(free_, voice);
+  } else if (held_.head >= 0) {
+    voice = held_.head;
+    unlink(held_, voice);
+  } else {
+    return -1;
+  }
+  pushBack(held_, voice);
+  return voice;
+}
+
+void VoiceAllocator::release(uint8_t voice) {
+  unlink(held_, voice);
+  pushBack(free_, voice);
+}
+
+void VoiceAllocator::unlink(List &list, uint8_t voice) {
+  if (prev_[voice] >= 0)
+    next_[prev_[voice]] = next_[voice];
+  else
+    list.head = next_[voice];
+  if (next_[voice] >= 0)
+    prev_[next_[voice]] = prev_[voice];
+  else
+    list.tail = prev_[voice];
+}
+
+void VoiceAllocator::pushBack(List &list, uint8_t voice) {
+  next_[voice] = -1;
+  prev_[voice] = list.tail;
+  if (list.tail >= 0)
+    next_[list.tail] = voice;
+  else
+    list.head = voice;
+  list.tail = voice;
+}
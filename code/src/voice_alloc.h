@@ -0,0 +1,46 @@
+/*
+   Voice allocation for Dexed.
+
+   Every voice in use is on one of two lists: free voices, least recently
+   released first, and held voices, oldest key press first. A new note
+   takes the front of the free list, which is the voice most likely to have
+   finished its release, or steals the oldest held voice when every voice
+   is held. All operations are O(1), so a key press costs the same at any
+   polyphony.
+*/
+
+#ifndef VOICE_ALLOC_H
+#define VOICE_ALLOC_H
+
+#include <stdint.h>
+
+#include "synth.h"
+
+class VoiceAllocator {
+  public:
+    VoiceAllocator();
+
+    // Voices 0..n-1 in use, all free
+    void reset(uint8_t n);
+    // Voice for a new note, now the newest held voice, or -1 if there
+    // are no voices in use
+    int8_t allocate();
+    // A held voice has been released and becomes the newest free voice
+    void release(uint8_t voice);
+
+  private:
+    struct List {
+      int8_t head;
+      int8_t tail;
+    };
+
+    void unlink(List &list, uint8_t voice);
+    void pushBack(List &list, uint8_t voice);
+
+    List free_;
+    List held_;
+    int8_t next_[_MAX_NOTES];
+    int8_t prev_[_MAX_NOTES];
+};
+
+#endif
@@ -0,0 +1,99 @@
+#include "platform.h"
+
+#include "../CLFM.h"
+
+#include "voice_pool.h"
+
+#ifdef VOICE_THREADS
+
+VoicePool::VoicePool(int threads) : pending_(0), generation_(0), stop_(false), fn_(NULL), arg_(NULL) {
+  if (threads < 1)
+    threads = 1;
+  for (int w = 0; w < threads; w++)
+    workers_.push_back(new Worker);
+  for (int w = 1; w < threads; w++)
+    threads_.push_back(std::thread(&VoicePool::loop, this, w));
+}
+
+VoicePool::~VoicePool() {
+  {
+    std::lock_guard<std::mutex> lk(lock_);
+    stop_ = true;
+  }
+  wake_.notify_all();
+  for (size_t i = 0; i < threads_.size(); i++)
+    threads_[i].join();
+  for (size_t w = 0; w < workers_.size(); w++)
+    delete workers_[w];
+}
+
+void VoicePool::run(Task fn, void *arg, int ntasks) {
+  if (ntasks <= 0)
+    return;
+  fn_ = fn;
+  arg_ = arg;
+  // set before any task can be taken, as workers may still be looking
+  pending_ = ntasks;
+  int n = threads();
+  for (int t = 0; t < ntasks; t++) {
+    Worker *worker = workers_[t % n];
+    std::lock_guard<std::mutex> lk(worker->lock);
+    worker->tasks.push_back(t);
+  }
+  {
+    std::lock_guard<std::mutex> lk(lock_);
+    generation_++;
+  }
+  wake_.notify_all();
+
+  work(0);
+
+  std::unique_lock<std::mutex> lk(lock_);
+  done_.wait(lk, [this] { return pending_ == 0; });
+}
+
+bool VoicePool::pop(int w, int &task) {
+  int n = threads();
+  for (int i = 0; i < n; i++) {
+    Worker *worker = workers_[(w + i) % n];
+    std::lock_guard<std::mutex> lk(worker->lock);
+    if (worker->tasks.empty())
+      continue;
+    if (i == 0) {
+      task = worker->tasks.front();
+      worker->tasks.pop_front();
+    } else {
+      task = worker->tasks.back();
+      worker->tasks.pop_back();
+    }
+    return true;
+  }
+  return false;
+}
+
+void VoicePool::work(int w) {
+  int task;
+  while (pop(w, task)) {
+    fn_(arg_, task, &workers_[w]->core);
+    if (--pending_ == 0) {
+      std::lock_guard<std::mutex> lk(lock_);
+      done_.notify_all();
+    }
+  }
+}
+
+void VoicePool::loop(int w) {
+  uint32_t seen = 0;
+  for (;;) {
+    {
+      std::unique_lock<std::mutex> lk(lock_);
+      wake_.wait(lk, [this, seen] { return stop_ || generation_ != seen; });
+      if (stop_)
+        return;
+      seen = generation_;
+    }
+    work(w);
+  }
+}
+
+#endif
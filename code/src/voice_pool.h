@@ -0,0 +1,64 @@
+/*
+   A small work stealing thread pool for rendering voices on host builds.
+
+   run() queues tasks round robin on the workers' deques and returns once
+   all of them are done. Workers take tasks from the front of their own
+   deque and steal from the back of the others' when it runs dry; the
+   calling thread takes part as worker 0. Every worker owns an FmCore, as
+   its bus buffers are scratch state, so tasks must only share read only
+   data otherwise.
+*/
+
+#ifndef VOICE_POOL_H
+#define VOICE_POOL_H
+
+#include "synth.h"
+
+#ifdef VOICE_THREADS
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "fm_core.h"
+
+class VoicePool {
+  public:
+    typedef void (*Task)(void *arg, int task, FmCore *core);
+
+    // threads counts the calling thread
+    explicit VoicePool(int threads);
+    ~VoicePool();
+
+    int threads() const { return (int)workers_.size(); }
+    void run(Task fn, void *arg, int ntasks);
+
+  private:
+    struct Worker {
+      std::mutex lock;
+      std::deque<int> tasks;
+      FmCore core;
+    };
+
+    bool pop(int w, int &task);
+    void work(int w);
+    void loop(int w);
+
+    std::vector<Worker *> workers_;
+    std::vector<std::thread> threads_;
+    std::mutex lock_;
+    std::condition_variable wake_;
+    std::condition_variable done_;
+    std::atomic<int> pending_;
+    uint32_t generation_;
+    bool stop_;
+    Task fn_;
+    void *arg_;
+};
+
+#endif
+
+#endif
@@ -16,34 +16,37 @@
 
 #define _USE_MATH_DEFINES
 #include <math.h>
-#include <Arduino.h>
+#include "platform.h"
 
 #include "synth.h"
 #include "wavetables.h"
 
 #define R (1 << 29)
 
+// The wave tables are read every sample, so they are left in RAM on the
+// Teensy rather than marked PROGMEM, apart from the triangle and square
+// levels that step slowly enough for the cache (see BL_RAM_LEVELS)
+
 #ifdef SIN_DELTA
-int32_t sintab[SIN_N_SAMPLES << 1];
+static constexpr ConstTable<int32_t, SIN_N_SAMPLES << 1> sintable() {
+  ConstTable<int32_t, SIN_N_SAMPLES << 1> tab = {};
 #else
-int32_t sintab[SIN_N_SAMPLES + 1];
+static constexpr ConstTable<int32_t, SIN_N_SAMPLES + 1> sintable() {
+  ConstTable<int32_t, SIN_N_SAMPLES + 1> tab = {};
 #endif
-
-void Sin::init() {
   FRAC_NUM dphase = 2 * M_PI / SIN_N_SAMPLES;
-  //int32_t c = (int32_t)floor(cos(dphase) * (1 << 30) + 0.5);
-  int32_t c = (int32_t)floor(COS_FUNC(dphase) * (1 << 30) + 0.5);
-  //int32_t s = (int32_t)floor(sin(dphase) * (1 << 30) + 0.5);
-  int32_t s = (int32_t)floor(SIN_FUNC(dphase) * (1 << 30) + 0.5);
+  // cosf and sinf of a float argument, as on the Teensy
+  int32_t c = ConstMath::floor((FRAC_NUM)ConstMath::cos(dphase) * (1 << 30) + 0.5);
+  int32_t s = ConstMath::floor((FRAC_NUM)ConstMath::sin(dphase) * (1 << 30) + 0.5);
   int32_t u = 1 << 30;
   int32_t v = 0;
   for (int i = 0; i < SIN_N_SAMPLES / 2; i++) {
 #ifdef SIN_DELTA
-    sintab[(i << 1) + 1] = (v + 32) >> 6;
-    sintab[((i + SIN_N_SAMPLES / 2) << 1) + 1] = -((v + 32) >> 6);
+    tab.v[(i << 1) + 1] = (v + 32) >> 6;
+    tab.v[((i + SIN_N_SAMPLES / 2) << 1) + 1] = -((v + 32) >> 6);
 #else
-    sintab[i] = (v + 32) >> 6;
-    sintab[i + SIN_N_SAMPLES / 2] = -((v + 32) >> 6);
+    tab.v[i] = (v + 32) >> 6;
+    tab.v[i + SIN_N_SAMPLES / 2] = -((v + 32) >> 6);
 #endif
     int32_t t = ((int64_t)u * (int64_t)s + (int64_t)v * (int64_t)c + R) >> 30;
     u = ((int64_t)u * (int64_t)c - (int64_t)v * (int64_t)s + R) >> 30;
@@ -51,14 +54,17 @@ void Sin::init() {
   }
 #ifdef SIN_DELTA
   for (int i = 0; i < SIN_N_SAMPLES - 1; i++) {
-    sintab[i << 1] = sintab[(i << 1) + 3] - sintab[(i << 1) + 1];
+    tab.v[i << 1] = tab.v[(i << 1) + 3] - tab.v[(i << 1) + 1];
   }
-  sintab[(SIN_N_SAMPLES << 1) - 2] = -sintab[(SIN_N_SAMPLES << 1) - 1];
+  tab.v[(SIN_N_SAMPLES << 1) - 2] = -tab.v[(SIN_N_SAMPLES << 1) - 1];
 #else
-  sintab[SIN_N_SAMPLES] = 0;
+  tab.v[SIN_N_SAMPLES] = 0;
 #endif
+  return tab;
 }
 
+constexpr decltype(sintable()) sintab = sintable();
+
 #ifndef SIN_INLINE
 int32_t Sin::lookup(int32_t phase) {
   const int SHIFT = 24 - SIN_LG_N_SAMPLES;
@@ -143,57 +149,91 @@ int32_t Sin::compute10(int32_t phase) {
   return y;
 }
 
-int32_t tritab[SIN_N_SAMPLES + 1];
+// cos(2 pi i / SIN_N_SAMPLES), from the first eighth of a cycle, where the
+// Taylor series are accurate
+static constexpr ConstTable<double, SIN_N_SAMPLES> costable() {
+  ConstTable<double, SIN_N_SAMPLES> tab = {};
+  const int quarter = SIN_N_SAMPLES / 4;
+  for (int i = 0; i <= quarter; i++) {
+    double x = 2 * M_PI * i / SIN_N_SAMPLES;
+    double c = i == quarter ? 0 : (2 * i <= quarter ? ConstMath::cos(x) : ConstMath::sin(M_PI / 2 - x));
+    tab.v[i] = c;
+    tab.v[2 * quarter - i] = -c;
+    tab.v[2 * quarter + i] = -c;
+    if (i)
+      tab.v[4 * quarter - i] = c;
+  }
+  return tab;
+}
 
-void Tri::init() {
-  float v = -1;
-  float dv = 4.0 / SIN_N_SAMPLES;
-  for (int i = 0; i <= SIN_N_SAMPLES / 2; i++) {
-    tritab[i] = (int32_t)(v * (1 << 24));
-    tritab[SIN_N_SAMPLES - i] = tritab[i];
-    v += dv;
+// Levels first to first + levels - 1 of a wave with odd harmonics of
+// amplitude amp / h^power, in cosine phase, or sine phase when sine. Each
+// level is the one below it plus the harmonics it adds; the sums are kept
+// in double and each level rounded on its own.
+template<int first, int levels>
+static constexpr ConstTable<int16_t, levels * BL_TABLE_SIZE> bandlimited(double amp, int power, bool sine) {
+  ConstTable<int16_t, levels * BL_TABLE_SIZE> tab = {};
+  ConstTable<double, SIN_N_SAMPLES> costab = costable();
+  double sum[SIN_N_SAMPLES] = {};
+  // sin(x) is cos(x - pi / 2)
+  int quadrant = sine ? SIN_N_SAMPLES - SIN_N_SAMPLES / 4 : 0;
+
+  int h = 1;
+  for (int level = 0; level < first + levels; level++) {
+    int top = 1 << level;
+    if (top > SIN_N_SAMPLES / 2 - 1)
+      top = SIN_N_SAMPLES / 2 - 1;
+    for (; h <= top; h += 2) {
+      double a = power == 1 ? amp / h : amp / ((double)h * h);
+      for (int i = 0; i < SIN_N_SAMPLES; i++)
+        sum[i] += a * costab.v[(h * i + quadrant) & (SIN_N_SAMPLES - 1)];
+    }
+    if (level < first)
+      continue;
+    int base = (level - first) * BL_TABLE_SIZE;
+    for (int i = 0; i < SIN_N_SAMPLES; i++) {
+      int32_t y = ConstMath::round(sum[i] * (1 << 15));
+      tab.v[base + i] = y > 32767 ? 32767 : (y < -32767 ? -32767 : y);
+    }
+    tab.v[base + SIN_N_SAMPLES] = tab.v[base];
   }
+  return tab;
 }
 
+// -1 at phase 0 and +1 at half a cycle, as the naive table was; the
+// partial sums stay inside that
+#define TRI_AMP (-8 / (M_PI * M_PI))
+constexpr BandLimitedRam tritab = bandlimited<0, BL_RAM_LEVELS>(TRI_AMP, 2, false);
+constexpr BandLimitedFlash tritab_flash PROGMEM =
+  bandlimited<BL_RAM_LEVELS, BL_LEVELS - BL_RAM_LEVELS>(TRI_AMP, 2, false);
+
 #ifndef SIN_INLINE
-int32_t Tri::lookup(int32_t phase) {
+int32_t Tri::lookup(int32_t phase, const int16_t *tab) {
   const int SHIFT = 24 - SIN_LG_N_SAMPLES;
   int lowbits = phase & ((1 << SHIFT) - 1);
   int phase_int = (phase >> SHIFT) & (SIN_N_SAMPLES - 1);
-  int y0 = tritab[phase_int];
-  int y1 = tritab[phase_int + 1];
+  int y0 = tab[phase_int] * (1 << BL_SHIFT);
+  int y1 = tab[phase_int + 1] * (1 << BL_SHIFT);
 
   return y0 + (((int64_t)(y1 - y0) * (int64_t)lowbits) >> SHIFT);
 }
 #endif
 
-
-int32_t sqrtab[SIN_N_SAMPLES + 1];
-
-void Sqr::init() {
-  const int ramp = 20;  // reduce aliasing
-  for (int i = 0; i <= SIN_N_SAMPLES / 2; i++) {
-    if (i < ramp) {
-      float v = 1.0 * i / ramp;
-      sqrtab[i] = (int32_t)(v * (1 << 24));
-    }
-    else if (i > SIN_N_SAMPLES / 2 - ramp) {
-      float v = 1.0 * (SIN_N_SAMPLES / 2 - i) / ramp;
-      sqrtab[i] = (int32_t)(v * (1 << 24));
-    }
-    else
-      sqrtab[i] = (int32_t)(1 << 24);
-    sqrtab[SIN_N_SAMPLES - i] = -sqrtab[i];
-  }
-}
+// Positive for the first half of the cycle. The fundamental has amplitude
+// 1 rather than the 4 / pi of a +/-1 square, so that the Gibbs overshoot
+// keeps every level within the old +/-1 peak: level 0 reaches it, and the
+// levels above peak at about 0.93.
+constexpr BandLimitedRam sqrtab = bandlimited<0, BL_RAM_LEVELS>(1, 1, true);
+constexpr BandLimitedFlash sqrtab_flash PROGMEM =
+  bandlimited<BL_RAM_LEVELS, BL_LEVELS - BL_RAM_LEVELS>(1, 1, true);
 
 #ifndef SIN_INLINE
-int32_t Sqr::lookup(int32_t phase) {
+int32_t Sqr::lookup(int32_t phase, const int16_t *tab) {
   const int SHIFT = 24 - SIN_LG_N_SAMPLES;
   int lowbits = phase & ((1 << SHIFT) - 1);
   int phase_int = (phase >> SHIFT) & (SIN_N_SAMPLES - 1);
-  int y0 = sqrtab[phase_int];
-  int y1 = sqrtab[phase_int + 1];
+  int y0 = tab[phase_int] * (1 << BL_SHIFT);
+  int y1 = tab[phase_int + 1] * (1 << BL_SHIFT);
 
   return y0 + (((int64_t)(y1 - y0) * (int64_t)lowbits) >> SHIFT);
 }
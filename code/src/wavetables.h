@@ -14,11 +14,12 @@
    limitations under the License.
 */
 
+#include "const_table.h"
+
 class Sin {
   public:
     Sin();
 
-    static void init();
     static int32_t lookup(int32_t phase);
     static int32_t compute(int32_t phase);
 
@@ -35,9 +36,9 @@ class Sin {
 #define SIN_DELTA
 
 #ifdef SIN_DELTA
-extern int32_t sintab[SIN_N_SAMPLES << 1];
+extern const ConstTable<int32_t, SIN_N_SAMPLES << 1> sintab;
 #else
-extern int32_t sintab[SIN_N_SAMPLES + 1];
+extern const ConstTable<int32_t, SIN_N_SAMPLES + 1> sintab;
 #endif
 
 #ifdef SIN_INLINE
@@ -61,24 +62,68 @@ int32_t Sin::lookup(int32_t phase) {
 }
 #endif
 
+// The triangle and square are band-limited: there is a table for each
+// octave of operator frequency, and table level j, for phase increments
+// (Q24) above 1 << (22 - j) and up to 1 << (23 - j), has the harmonics
+// that stay below the Nyquist frequency at the top of that octave (up to
+// 1 << j). The operator kernels choose the table from the operator's
+// frequency once per block. The last level is used for everything below,
+// with harmonics up to SIN_N_SAMPLES / 2.
+#define BL_LEVELS 10
+#define BL_TABLE_SIZE (SIN_N_SAMPLES + 1)
+// The tables are Q15 int16_t, to halve their RAM; the lookups scale them up
+// to Q24
+#define BL_SHIFT (24 - 15)
+// Levels below this are in RAM on the Teensy and the rest in flash
+// (PROGMEM). An operator on level j steps 2^(8 - j) to 2^(9 - j) entries a
+// sample, so one on a RAM level reads every 32 byte cache line of its table
+// in a 128 sample block, and one on a flash level at most half of them.
+#define BL_RAM_LEVELS 7
+
+// The table level for an operator at freq
+inline int bandLevel(int32_t freq) {
+  if (freq <= 1)
+    return BL_LEVELS - 1;
+  int level = __builtin_clz(freq - 1) - 9;
+  return level < 0 ? 0 : (level >= BL_LEVELS ? BL_LEVELS - 1 : level);
+}
+
 class Tri {
   public:
     Tri();
 
-    static void init();
-    static int32_t lookup(int32_t phase);
+    // The table for an operator at freq
+    static const int16_t *table(int32_t freq);
+    static int32_t lookup(int32_t phase, const int16_t *tab);
 };
 
-extern int32_t tritab[SIN_N_SAMPLES + 1];
+typedef ConstTable<int16_t, BL_RAM_LEVELS * BL_TABLE_SIZE> BandLimitedRam;
+typedef ConstTable<int16_t, (BL_LEVELS - BL_RAM_LEVELS) * BL_TABLE_SIZE> BandLimitedFlash;
+
+// The table for an operator at freq from a wave's RAM and flash levels,
+// each held one after the other, BL_TABLE_SIZE entries each
+inline const int16_t *bandTable(const int16_t *ram, const int16_t *flash, int32_t freq) {
+  int level = bandLevel(freq);
+  if (level < BL_RAM_LEVELS)
+    return ram + level * BL_TABLE_SIZE;
+  return flash + (level - BL_RAM_LEVELS) * BL_TABLE_SIZE;
+}
+
+extern const BandLimitedRam tritab;
+extern const BandLimitedFlash tritab_flash;
+
+inline const int16_t *Tri::table(int32_t freq) {
+  return bandTable(tritab, tritab_flash, freq);
+}
 
 #ifdef SIN_INLINE
 inline
-int32_t Tri::lookup(int32_t phase) {
+int32_t Tri::lookup(int32_t phase, const int16_t *tab) {
   const int SHIFT = 24 - SIN_LG_N_SAMPLES;
   int lowbits = phase & ((1 << SHIFT) - 1);
   int phase_int = (phase >> SHIFT) & (SIN_N_SAMPLES - 1);
-  int y0 = tritab[phase_int];
-  int y1 = tritab[phase_int + 1];
+  int y0 = tab[phase_int] * (1 << BL_SHIFT);
+  int y1 = tab[phase_int + 1] * (1 << BL_SHIFT);
 
   return y0 + (((int64_t)(y1 - y0) * (int64_t)lowbits) >> SHIFT);
 }
@@ -88,21 +133,26 @@ class Sqr {
   public:
     Sqr();
 
-    static void init();
-    static int32_t lookup(int32_t phase);
+    static const int16_t *table(int32_t freq);
+    static int32_t lookup(int32_t phase, const int16_t *tab);
 };
 
-extern int32_t sqrtab[SIN_N_SAMPLES + 1];
+extern const BandLimitedRam sqrtab;
+extern const BandLimitedFlash sqrtab_flash;
+
+inline const int16_t *Sqr::table(int32_t freq) {
+  return bandTable(sqrtab, sqrtab_flash, freq);
+}
 
 #ifdef SIN_INLINE
 inline
-int32_t Sqr::lookup(int32_t phase) {
+int32_t Sqr::lookup(int32_t phase, const int16_t *tab) {
   const int SHIFT = 24 - SIN_LG_N_SAMPLES;
   int lowbits = phase & ((1 << SHIFT) - 1);
   int phase_int = (phase >> SHIFT) & (SIN_N_SAMPLES - 1);
-  int y0 = sqrtab[phase_int];
-  int y1 = sqrtab[phase_int + 1];
+  int y0 = tab[phase_int] * (1 << BL_SHIFT);
+  int y1 = tab[phase_int + 1] * (1 << BL_SHIFT);
 
   return y0 + (((int64_t)(y1 - y0) * (int64_t)lowbits) >> SHIFT);
 }
-#endif
\ No newline at end of file
+#endif